@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "can_hal.h"
+#include "can_filter.h"
+#include "can_spi_frame.h"
+#include "can_transport.h"
+#include "utils/buffer_helper.h"
+#include "utils/checksum.h"
+#include "utils/latency_hist.h"
+#include "utils/mpmc_queue.h"
+#include "utils/ringbuffer.h"
+
+/*
+	RX/TX 各个环节的微基准, 以及基于 MCU 模拟器的端到端吞吐和延迟测试.
+	微基准按批计时, 每批的平均耗时记入直方图, 得到每次操作耗时的分布.
+	结果输出为 JSON (默认) 或 CSV, 便于不同构建之间对比
+
+	用法: can_hal_bench [--format=json|csv] [--duration=毫秒] [--only=名字子串]
+*/
+
+#define BENCH_BATCH (256)
+#define BENCH_DURATION_MS_DEFAULT (500)
+#define BENCH_OPS_SAMPLES (UINT64_MAX) /**< bench_latency_result 的 ops 取直方图的样本数 */
+#define BENCH_DRAIN_MS (50) /**< 这么久读不到新帧就认为接收方向已经读空 */
+
+enum bench_format
+{
+	BENCH_JSON,
+	BENCH_CSV,
+};
+
+struct bench_result
+{
+	const char *name;
+	const char *unit; /**< 延迟分布的含义 */
+	uint64_t ops;
+	double seconds;
+	struct latency_summary lat;
+};
+
+struct bench_config
+{
+	enum bench_format format;
+	uint32_t duration_ms;
+	const char *only;
+	int printed;
+	int failed; /**< 有用例的结果校验不通过, 进程以非 0 退出 */
+};
+
+typedef void (*bench_fn)(void *arg, int iterations);
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_print_header(struct bench_config *cfg)
+{
+	if (cfg->format == BENCH_CSV)
+		printf("name,unit,ops,seconds,ops_per_sec,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+	else
+		printf("{\n  \"results\": [\n");
+}
+
+static void bench_print_footer(struct bench_config *cfg)
+{
+	if (cfg->format == BENCH_JSON)
+		printf("\n  ]\n}\n");
+}
+
+static void bench_print(struct bench_config *cfg, const struct bench_result *r)
+{
+	double rate = r->seconds > 0 ? r->ops / r->seconds : 0;
+	const struct latency_summary *l = &r->lat;
+
+	if (cfg->format == BENCH_CSV)
+	{
+		printf("%s,%s,%llu,%.6f,%.1f,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			   r->name, r->unit, (unsigned long long)r->ops, r->seconds, rate,
+			   (unsigned long long)l->mean_ns, (unsigned long long)l->min_ns,
+			   (unsigned long long)l->p50_ns, (unsigned long long)l->p90_ns,
+			   (unsigned long long)l->p99_ns, (unsigned long long)l->p999_ns,
+			   (unsigned long long)l->max_ns);
+	}
+	else
+	{
+		printf("%s    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+			   "\"mean_ns\": %llu, \"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+			   "\"p999_ns\": %llu, \"max_ns\": %llu}",
+			   cfg->printed ? ",\n" : "", r->name, r->unit, (unsigned long long)r->ops, r->seconds, rate,
+			   (unsigned long long)l->mean_ns, (unsigned long long)l->min_ns,
+			   (unsigned long long)l->p50_ns, (unsigned long long)l->p90_ns,
+			   (unsigned long long)l->p99_ns, (unsigned long long)l->p999_ns,
+			   (unsigned long long)l->max_ns);
+	}
+	cfg->printed++;
+	fflush(stdout);
+}
+
+static bool bench_selected(const struct bench_config *cfg, const char *name)
+{
+	return cfg->only == NULL || strstr(name, cfg->only) != NULL;
+}
+
+/* 反复调用 fn(arg, BENCH_BATCH) 直到用完 duration_ms, 每批的平均耗时作为一个样本 */
+static void bench_run_micro(struct bench_config *cfg, const char *name, bench_fn fn, void *arg)
+{
+	static struct latency_hist hist;
+	struct bench_result r = {.name = name, .unit = "ns_per_op"};
+
+	if (!bench_selected(cfg, name))
+		return;
+
+	// 预热, 让代码和数据都进缓存
+	fn(arg, BENCH_BATCH * 16);
+
+	latency_hist_reset(&hist);
+	uint64_t start = bench_now_ns();
+	uint64_t end = start + (uint64_t)cfg->duration_ms * 1000000ull;
+	uint64_t now = start;
+	while (now < end)
+	{
+		uint64_t t0 = now;
+		fn(arg, BENCH_BATCH);
+		now = bench_now_ns();
+		latency_hist_record(&hist, (now - t0) / BENCH_BATCH);
+		r.ops += BENCH_BATCH;
+	}
+	r.seconds = (now - start) / 1e9;
+	latency_hist_summary(&hist, &r.lat);
+	bench_print(cfg, &r);
+}
+
+/* ---------------- 微基准 ---------------- */
+
+static struct spi_can_frame bench_make_frame(uint32_t can_id)
+{
+	struct spi_can_frame f;
+	memset(&f, 0, sizeof(f));
+	f.head = HEAD_SIGN;
+	f.ide = 1;
+	f.dlc = 8;
+	f.can_id = can_id;
+	memset(f.payload, 0x5a, sizeof(f.payload));
+	spi_frame_seal(&f, CANHAL_INTEGRITY_XOR);
+	return f;
+}
+
+struct ring_arg
+{
+	ring_buffer_t rb;
+	char buf[2048];
+	char frame[CAN_FRAME_LENGTH];
+};
+
+static void bench_ring_buffer(void *arg, int iterations)
+{
+	struct ring_arg *a = arg;
+	char out[CAN_FRAME_LENGTH];
+	for (int n = 0; n < iterations; n++)
+	{
+		ring_buffer_queue_arr(&a->rb, a->frame, CAN_FRAME_LENGTH);
+		ring_buffer_dequeue_arr(&a->rb, out, CAN_FRAME_LENGTH);
+	}
+}
+
+struct bh_arg
+{
+	struct buffer_helper *bh;
+	struct spi_can_frame frame;
+	uint64_t delivered;
+	int split; /**< 0 表示整帧送入, 否则先送前 split 个字节 */
+};
+
+static void bench_bh_callback(uint8_t *buff, int len, void *userdata)
+{
+	struct bh_arg *a = userdata;
+	a->delivered += buff[len - 1];
+}
+
+static void bench_buffer_helper(void *arg, int iterations)
+{
+	struct bh_arg *a = arg;
+	char *p = (char *)&a->frame;
+	for (int n = 0; n < iterations; n++)
+	{
+		if (a->split == 0)
+		{
+			buffer_helper_loop(a->bh, p, CAN_FRAME_LENGTH);
+		}
+		else
+		{
+			buffer_helper_loop(a->bh, p, a->split);
+			buffer_helper_loop(a->bh, p + a->split, CAN_FRAME_LENGTH - a->split);
+		}
+	}
+}
+
+struct filter_arg
+{
+	struct can_filter_table *table;
+	uint32_t ids[1024];
+	uint32_t hits;
+};
+
+static void bench_filter_cb(void *context, struct can_frame *frame)
+{
+}
+
+static void bench_filter_find(void *arg, int iterations)
+{
+	struct filter_arg *a = arg;
+	drv_can_filter_callback cb;
+	void *ctx;
+	for (int n = 0; n < iterations; n++)
+		a->hits += can_filter_find(a->table, a->ids[n & 1023], true, &cb, &ctx);
+	can_filter_quiescent(a->table);
+}
+
+struct checksum_arg
+{
+	struct spi_can_frame frames[32];
+	uint8_t ok[32];
+	uint32_t sink;
+};
+
+static void bench_xor8(void *arg, int iterations)
+{
+	struct checksum_arg *a = arg;
+	for (int n = 0; n < iterations; n++)
+		a->sink += checksum_xor8(&a->frames[n & 31], CAN_FRAME_LENGTH - 1);
+}
+
+static void bench_xor8_batch(void *arg, int iterations)
+{
+	struct checksum_arg *a = arg;
+	// 一次操作校验一个帧, 按 32 帧一批调用
+	for (int n = 0; n < iterations; n += 32)
+		a->sink += checksum_xor8_verify_frames(a->frames, CAN_FRAME_LENGTH, 32, a->ok);
+}
+
+static void bench_crc16(void *arg, int iterations)
+{
+	struct checksum_arg *a = arg;
+	for (int n = 0; n < iterations; n++)
+		a->sink += checksum_crc16(INIT, &a->frames[n & 31], CAN_FRAME_CRC_LENGTH);
+}
+
+static void bench_mpmc(void *arg, int iterations)
+{
+	struct mpmc_queue *q = arg;
+	struct spi_can_frame f;
+	memset(&f, 0, sizeof(f));
+	for (int n = 0; n < iterations; n++)
+	{
+		mpmc_queue_push(q, &f);
+		mpmc_queue_pop(q, &f);
+	}
+}
+
+static void bench_micro(struct bench_config *cfg)
+{
+	struct spi_can_frame frame = bench_make_frame(0x12345);
+
+	struct ring_arg *ra = calloc(1, sizeof(*ra));
+	ring_buffer_init(&ra->rb, ra->buf, sizeof(ra->buf));
+	memcpy(ra->frame, &frame, CAN_FRAME_LENGTH);
+	bench_run_micro(cfg, "ring_buffer_queue_dequeue_frame", bench_ring_buffer, ra);
+	free(ra);
+
+	uint8_t head[CAN_FRAME_HEAD_LENGTH] = {HEAD_SIGN};
+	struct buffer_helper_meta meta = {
+		.frame_head = head,
+		.frame_head_size = CAN_FRAME_HEAD_LENGTH,
+		.frame_size = CAN_FRAME_LENGTH,
+	};
+	struct bh_arg ba = {.frame = frame};
+	ba.bh = buffer_helper_new(&meta, bench_bh_callback, &ba);
+	bench_run_micro(cfg, "buffer_helper_loop_frame", bench_buffer_helper, &ba);
+	ba.split = 5;
+	bench_run_micro(cfg, "buffer_helper_loop_split_frame", bench_buffer_helper, &ba);
+	buffer_helper_free(ba.bh);
+
+	struct filter_arg *fa = calloc(1, sizeof(*fa));
+	fa->table = can_filter_table_new();
+	for (int n = 0; n < 1024; n++)
+	{
+		fa->ids[n] = 0x10000 + n * 7;
+		can_filter_add(fa->table, fa->ids[n], true, 0x1fffffff, bench_filter_cb, NULL);
+	}
+	bench_run_micro(cfg, "can_filter_find_exact_1024", bench_filter_find, fa);
+	for (int n = 0; n < 16; n++)
+		can_filter_add(fa->table, 0x1000000 | (n << 8), true, 0x1fffff00, bench_filter_cb, NULL);
+	for (int n = 0; n < 1024; n++)
+		fa->ids[n] = 0x1000000 | ((n & 15) << 8) | (n >> 4);
+	bench_run_micro(cfg, "can_filter_find_masked_16", bench_filter_find, fa);
+	can_filter_table_free(fa->table);
+	free(fa);
+
+	struct checksum_arg *ca = calloc(1, sizeof(*ca));
+	for (int n = 0; n < 32; n++)
+		ca->frames[n] = bench_make_frame(0x100 + n);
+	bench_run_micro(cfg, "checksum_xor8_frame", bench_xor8, ca);
+	bench_run_micro(cfg, "checksum_xor8_verify_batch32", bench_xor8_batch, ca);
+	bench_run_micro(cfg, "checksum_crc16_frame", bench_crc16, ca);
+	free(ca);
+
+	struct mpmc_queue *q = mpmc_queue_new(1024, sizeof(struct spi_can_frame));
+	bench_run_micro(cfg, "mpmc_queue_push_pop_frame", bench_mpmc, q);
+	mpmc_queue_free(q);
+}
+
+/* ---------------- 端到端 ---------------- */
+
+static bool bench_open(canhal_ctx *ctx, struct can_transport **xport, const struct can_sim_params *sp, uint32_t batch)
+{
+	struct canhal_options opts;
+	canhal_options_init(&opts);
+	*xport = can_transport_sim_open(sp);
+	if (*xport == NULL)
+		return false;
+	opts.transport = *xport;
+	opts.batch_frames = batch;
+	opts.channels = sp->channels;
+	return canhal_init_ex(ctx, "can_bench", &opts);
+}
+
+/* 输出 canhal 某一阶段的延迟直方图. ops 为 BENCH_OPS_SAMPLES 时用直方图的样本数, 即这一阶段实际测到的次数 */
+static void bench_latency_result(struct bench_config *cfg, canhal_ctx ctx, const char *name,
+								 enum canhal_latency_stage stage, uint64_t ops, double seconds)
+{
+	struct canhal_latency l;
+	struct bench_result r = {.name = name, .unit = "ns_latency", .ops = ops, .seconds = seconds};
+	canhal_get_latency(ctx, stage, &l);
+	if (ops == BENCH_OPS_SAMPLES)
+		r.ops = l.count;
+	r.lat.count = l.count;
+	r.lat.min_ns = l.min_ns;
+	r.lat.max_ns = l.max_ns;
+	r.lat.mean_ns = l.mean_ns;
+	r.lat.p50_ns = l.p50_ns;
+	r.lat.p90_ns = l.p90_ns;
+	r.lat.p99_ns = l.p99_ns;
+	r.lat.p999_ns = l.p999_ns;
+	bench_print(cfg, &r);
+}
+
+/*
+	模拟器不限速地产生帧, 测 SPI 线程 -> canhal_read_batch 的最大吞吐. fd_len 非 0 时产生 FD 长帧.
+	计时结束后让模拟器停止产生帧, 读空 socket, 再核对每个发给主机的帧要么读到了要么计入了 rx_sock_dropped
+*/
+static void bench_e2e_rx(struct bench_config *cfg, uint32_t batch, uint8_t fd_len, const char *name)
+{
+	if (!bench_selected(cfg, name))
+		return;
+
+	struct can_sim_params sp;
+	can_sim_params_init(&sp);
+	sp.max_transfer = batch * CAN_FRAME_LENGTH;
+	sp.fd_len = fd_len;
+	canhal_ctx ctx;
+	struct can_transport *xport;
+	if (!bench_open(&ctx, &xport, &sp, batch))
+		return;
+
+	static struct can_frame frames[CANHAL_DGRAM_MAX_FRAMES * 8];
+	uint64_t got = 0;
+	uint64_t start = bench_now_ns();
+	uint64_t end = start + (uint64_t)cfg->duration_ms * 1000000ull;
+	uint64_t now = start;
+	canhal_reset_latency(ctx);
+	while (now < end)
+	{
+		int n = canhal_read_batch(ctx, frames, sizeof(frames) / sizeof(frames[0]), 10);
+		if (n > 0)
+			got += n;
+		now = bench_now_ns();
+	}
+	bench_latency_result(cfg, ctx, name, CANHAL_LAT_RX_SOCKET, got, (now - start) / 1e9);
+
+	// 模拟器停下后, 已经开始发的帧还要几次传输才能发完, 读到一段时间没有新帧为止
+	can_transport_sim_stop_rx(xport);
+	int n;
+	while ((n = canhal_read_batch(ctx, frames, sizeof(frames) / sizeof(frames[0]), BENCH_DRAIN_MS)) > 0)
+		got += n;
+
+	struct canhal_stats st;
+	struct can_sim_stats ss;
+	canhal_get_stats(ctx, &st);
+	can_transport_sim_get_stats(xport, &ss);
+	if (got + st.rx_sock_dropped != ss.rx_sent)
+	{
+		fprintf(stderr, "%s: read %llu + socket dropped %llu != sent %llu\n", name, (unsigned long long)got,
+				(unsigned long long)st.rx_sock_dropped, (unsigned long long)ss.rx_sent);
+		cfg->failed = 1;
+	}
+	canhal_close(ctx);
+}
+
+/* 按固定速率发送, 模拟器把帧回送回来, 测发送排队和整个来回的延迟 */
+static void bench_e2e_loopback(struct bench_config *cfg, uint32_t frames_per_sec)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "e2e_loopback_rtt_%ufps", frames_per_sec);
+	if (!bench_selected(cfg, name))
+		return;
+
+	struct can_sim_params sp;
+	can_sim_params_init(&sp);
+	sp.loopback = true;
+	sp.rx_frames_per_sec = 1; // 只回送, 几乎不自己产生帧
+	canhal_ctx ctx;
+	struct can_transport *xport;
+	if (!bench_open(&ctx, &xport, &sp, CAN_TRANSPORT_MAX_FRAMES))
+		return;
+
+	static struct latency_hist rtt;
+	latency_hist_reset(&rtt);
+	canhal_reset_latency(ctx);
+
+	struct can_frame out = {.can_id = 0x18ff0001, .can_dlc = 8, .extended_id = 1};
+	static struct can_frame frames[CANHAL_DGRAM_MAX_FRAMES * 8];
+	uint64_t interval = 1000000000ull / frames_per_sec;
+	uint64_t start = bench_now_ns();
+	uint64_t end = start + (uint64_t)cfg->duration_ms * 1000000ull;
+	uint64_t next = start;
+	uint64_t now = start;
+	uint64_t sent = 0;
+
+	while (now < end)
+	{
+		while (next <= now)
+		{
+			uint64_t ts = bench_now_ns();
+			memcpy(out.payload, &ts, sizeof(ts));
+			if (canhal_write_prio(ctx, &out, CANHAL_TX_PRIO_NORMAL))
+				sent++;
+			next += interval;
+		}
+		int n = canhal_read_batch(ctx, frames, sizeof(frames) / sizeof(frames[0]), 1);
+		now = bench_now_ns();
+		for (int i = 0; i < n; i++)
+		{
+			uint64_t ts;
+			if (frames[i].can_id != out.can_id)
+				continue;
+			memcpy(&ts, frames[i].payload, sizeof(ts));
+			latency_hist_record(&rtt, now - ts);
+		}
+	}
+
+	double seconds = (now - start) / 1e9;
+	struct bench_result r = {.name = name, .unit = "ns_latency", .ops = sent, .seconds = seconds};
+	latency_hist_summary(&rtt, &r.lat);
+	bench_print(cfg, &r);
+
+	snprintf(name, sizeof(name), "e2e_tx_queue_%ufps", frames_per_sec);
+	bench_latency_result(cfg, ctx, name, CANHAL_LAT_TX_QUEUE, BENCH_OPS_SAMPLES, seconds);
+	snprintf(name, sizeof(name), "e2e_sched_wakeup_%ufps", frames_per_sec);
+	bench_latency_result(cfg, ctx, name, CANHAL_LAT_SCHED_WAKEUP, BENCH_OPS_SAMPLES, seconds);
+	canhal_close(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.format = BENCH_JSON,
+		.duration_ms = BENCH_DURATION_MS_DEFAULT,
+	};
+
+	for (int n = 1; n < argc; n++)
+	{
+		if (strcmp(argv[n], "--format=csv") == 0)
+			cfg.format = BENCH_CSV;
+		else if (strcmp(argv[n], "--format=json") == 0)
+			cfg.format = BENCH_JSON;
+		else if (strncmp(argv[n], "--duration=", 11) == 0)
+			cfg.duration_ms = strtoul(argv[n] + 11, NULL, 0);
+		else if (strncmp(argv[n], "--only=", 7) == 0)
+			cfg.only = argv[n] + 7;
+		else
+		{
+			fprintf(stderr, "usage: %s [--format=json|csv] [--duration=ms] [--only=name]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// 初始化时 spidev 相关的提示走 stdout, 这里只要结果, 所以先把表头打出来
+	bench_print_header(&cfg);
+	bench_micro(&cfg);
+	bench_e2e_rx(&cfg, 1, 0, "e2e_rx_batch1");
+	bench_e2e_rx(&cfg, 16, 0, "e2e_rx_batch16");
+	bench_e2e_rx(&cfg, CAN_TRANSPORT_MAX_FRAMES, 0, "e2e_rx_batch256");
+	bench_e2e_rx(&cfg, CAN_TRANSPORT_MAX_FRAMES, CANHAL_FD_MAX_DLEN, "e2e_rx_fd64_batch256");
+	bench_e2e_loopback(&cfg, 1000);
+	bench_e2e_loopback(&cfg, 20000);
+	bench_print_footer(&cfg);
+	return cfg.failed;
+}
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include "can_dispatch.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "utils/ringbuffer.h"
+
+#define CAN_DISPATCH_IDLE_MS (100) /**< 工作线程睡眠的最长时间, 防止漏掉唤醒后一直不醒 */
+#define CAN_DISPATCH_WAIT_US (50)  /**< WAIT 策略下队列满时 SPI 线程每次等待的时间 */
+
+/* 队列里的一项, 回调和上下文在入队时取定, 之后过滤器表的变化不影响已入队的帧 */
+struct can_dispatch_item
+{
+	drv_can_filter_callback callback;
+	void *context;
+	struct can_frame frame;
+};
+
+struct can_dispatch_shard
+{
+	spsc_ring_buffer_t ring;
+	char *buf;
+	struct can_dispatch *pool;
+	pthread_t thread;
+	bool started;
+	bool dirty;			  /**< 本批有新入队的帧, 只由 SPI 线程读写 */
+	uint32_t wake_seq;	  /**< futex 字, SPI 线程唤醒时加一 */
+	uint32_t sleeping;	  /**< 工作线程正准备/正在睡眠 */
+	struct canhal_dispatch_stats stats; /**< delivered 由工作线程写, 其余只由 SPI 线程写, 任意线程 relaxed 读 */
+} __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+
+struct can_dispatch
+{
+	struct can_dispatch_shard *shards;
+	uint32_t count;
+	enum canhal_dispatch_overflow overflow;
+	struct latency_hist *callback_latency;
+	volatile int running;
+};
+
+#define DISPATCH_STAT_INC(c, v) __atomic_store_n(&(c), (c) + (v), __ATOMIC_RELAXED)
+
+static long can_dispatch_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static uint64_t can_dispatch_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void can_dispatch_wake(struct can_dispatch_shard *s)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleeping, __ATOMIC_RELAXED))
+	{
+		__atomic_fetch_add(&s->wake_seq, 1, __ATOMIC_RELEASE);
+		can_dispatch_futex(&s->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+	}
+}
+
+static void *can_dispatch_worker(void *arg)
+{
+	struct can_dispatch_shard *s = arg;
+	struct can_dispatch *d = s->pool;
+	struct can_dispatch_item item;
+	struct timespec idle = {.tv_sec = 0, .tv_nsec = CAN_DISPATCH_IDLE_MS * 1000000L};
+
+	for (;;)
+	{
+		if (spsc_ring_buffer_dequeue_arr(&s->ring, (char *)&item, sizeof(item)) == sizeof(item))
+		{
+			item.frame.ts_deliver_ns = can_dispatch_now_ns();
+			if (d->callback_latency != NULL)
+				latency_hist_record(d->callback_latency, item.frame.ts_deliver_ns - item.frame.ts_xfer_ns);
+			item.callback(item.context, &item.frame);
+			DISPATCH_STAT_INC(s->stats.delivered, 1);
+			continue;
+		}
+		// 队列空了才检查退出, 停止前把剩下的帧回调完
+		if (!d->running)
+			break;
+
+		uint32_t seq = __atomic_load_n(&s->wake_seq, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&s->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (spsc_ring_buffer_num_items(&s->ring) == 0 && d->running)
+			can_dispatch_futex(&s->wake_seq, FUTEX_WAIT_PRIVATE, seq, &idle);
+		__atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* 位图里第 n % popcount 个置位的 CPU */
+static int can_dispatch_pick_cpu(uint32_t mask, uint32_t n)
+{
+	int count = __builtin_popcount(mask);
+	int skip = n % count;
+	for (int cpu = 0; cpu < 32; cpu++)
+	{
+		if ((mask & (1u << cpu)) && skip-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+struct can_dispatch *can_dispatch_new(const struct can_dispatch_params *params)
+{
+	if (params->workers == 0 || params->workers > CANHAL_DISPATCH_MAX_WORKERS)
+		return NULL;
+
+	struct can_dispatch *d = calloc(1, sizeof(struct can_dispatch));
+	if (d == NULL)
+		return NULL;
+	d->shards = aligned_alloc(RING_BUFFER_CACHE_LINE, params->workers * sizeof(struct can_dispatch_shard));
+	if (d->shards == NULL)
+	{
+		free(d);
+		return NULL;
+	}
+	memset(d->shards, 0, params->workers * sizeof(struct can_dispatch_shard));
+	d->count = params->workers;
+	d->overflow = params->overflow;
+	d->callback_latency = params->callback_latency;
+	d->running = 1;
+
+	size_t bytes = RING_BUFFER_CACHE_LINE;
+	while (bytes < (size_t)params->queue_frames * sizeof(struct can_dispatch_item))
+		bytes <<= 1;
+
+	for (uint32_t n = 0; n < d->count; n++)
+	{
+		struct can_dispatch_shard *s = &d->shards[n];
+		char name[24];
+
+		// 整个环先写一遍, 运行中不会因为第一次访问而缺页
+		s->buf = malloc(bytes);
+		if (s->buf == NULL)
+			goto fail;
+		memset(s->buf, 0, bytes);
+		spsc_ring_buffer_init(&s->ring, s->buf, bytes);
+		s->pool = d;
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (params->cpu_affinity != 0)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(can_dispatch_pick_cpu(params->cpu_affinity, n), &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		int ret = pthread_create(&s->thread, &attr, can_dispatch_worker, s);
+		if (ret == EINVAL && params->cpu_affinity != 0)
+		{
+			// 位图里的 CPU 不存在或不允许使用, 不绑定
+			printf("can't pin dispatch worker %u to cpu %d, not pinned\n", n, can_dispatch_pick_cpu(params->cpu_affinity, n));
+			pthread_attr_destroy(&attr);
+			pthread_attr_init(&attr);
+			ret = pthread_create(&s->thread, &attr, can_dispatch_worker, s);
+		}
+		pthread_attr_destroy(&attr);
+		if (ret != 0)
+		{
+			errno = ret;
+			perror("pthread_create error");
+			goto fail;
+		}
+		s->started = true;
+		snprintf(name, sizeof(name), "can_disp%u", n);
+		pthread_setname_np(s->thread, name);
+	}
+	return d;
+
+fail:
+	can_dispatch_free(d);
+	return NULL;
+}
+
+void can_dispatch_free(struct can_dispatch *d)
+{
+	if (d == NULL)
+		return;
+	d->running = 0;
+	for (uint32_t n = 0; n < d->count; n++)
+	{
+		struct can_dispatch_shard *s = &d->shards[n];
+		if (!s->started)
+			continue;
+		__atomic_fetch_add(&s->wake_seq, 1, __ATOMIC_RELEASE);
+		can_dispatch_futex(&s->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+		pthread_join(s->thread, NULL);
+	}
+	for (uint32_t n = 0; n < d->count; n++)
+		free(d->shards[n].buf);
+	free(d->shards);
+	free(d);
+}
+
+static inline uint32_t can_dispatch_shard_of(const struct can_dispatch *d, const struct can_frame *frame)
+{
+	uint32_t key = ((uint32_t)frame->channel << 30) | (frame->extended_id ? 1u << 29 : 0) | (frame->can_id & 0x1fffffffu);
+	return ((key * 0x9e3779b1u) >> 16) % d->count;
+}
+
+bool can_dispatch_push(struct can_dispatch *d, drv_can_filter_callback callback, void *context,
+					   const struct can_frame *frame)
+{
+	struct can_dispatch_shard *s = &d->shards[can_dispatch_shard_of(d, frame)];
+	struct can_dispatch_item item = {.callback = callback, .context = context};
+
+	memcpy(&item.frame, frame, sizeof(item.frame));
+	while (!spsc_ring_buffer_queue_arr(&s->ring, (const char *)&item, sizeof(item)))
+	{
+		if (d->overflow == CANHAL_DISPATCH_DROP)
+		{
+			DISPATCH_STAT_INC(s->stats.dropped, 1);
+			return false;
+		}
+		// 反压: 先把工作线程叫醒, 等它腾出空位
+		DISPATCH_STAT_INC(s->stats.waits, 1);
+		can_dispatch_wake(s);
+		usleep(CAN_DISPATCH_WAIT_US);
+	}
+	DISPATCH_STAT_INC(s->stats.queued, 1);
+	uint64_t depth = spsc_ring_buffer_num_items(&s->ring) / sizeof(item);
+	if (depth > s->stats.max_depth)
+		__atomic_store_n(&s->stats.max_depth, depth, __ATOMIC_RELAXED);
+	s->dirty = true;
+	return true;
+}
+
+void can_dispatch_kick(struct can_dispatch *d)
+{
+	for (uint32_t n = 0; n < d->count; n++)
+	{
+		struct can_dispatch_shard *s = &d->shards[n];
+		if (!s->dirty)
+			continue;
+		s->dirty = false;
+		can_dispatch_wake(s);
+	}
+}
+
+int can_dispatch_get_stats(struct can_dispatch *d, struct canhal_dispatch_stats *out, int max)
+{
+	int count = (int)d->count < max ? (int)d->count : max;
+	for (int n = 0; n < count; n++)
+	{
+		const struct canhal_dispatch_stats *st = &d->shards[n].stats;
+		out[n].queued = __atomic_load_n(&st->queued, __ATOMIC_RELAXED);
+		out[n].delivered = __atomic_load_n(&st->delivered, __ATOMIC_RELAXED);
+		out[n].dropped = __atomic_load_n(&st->dropped, __ATOMIC_RELAXED);
+		out[n].waits = __atomic_load_n(&st->waits, __ATOMIC_RELAXED);
+		out[n].max_depth = __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED);
+	}
+	return count;
+}
@@ -0,0 +1,40 @@
+#ifndef CAN_DISPATCH_H
+#define CAN_DISPATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "can_hal.h"
+#include "utils/latency_hist.h"
+
+/*
+	过滤器回调的工作线程池.
+	SPI 线程查到过滤器后把 (回调, 上下文, 帧) 推进某个分片的队列, 分片由通道号、帧类型和 CAN ID 决定,
+	同一个 ID 的帧总是进同一个分片, 由同一个工作线程按收到的顺序回调.
+	每个分片是一个单生产者/单消费者的无锁环 (spsc_ring_buffer_t), 生产者只有 SPI 线程.
+	工作线程没有数据时在 futex 上睡眠, SPI 线程每批结束时调用 can_dispatch_kick 唤醒有数据的分片.
+*/
+struct can_dispatch;
+
+struct can_dispatch_params
+{
+	uint32_t workers;		/**< 工作线程数, 即分片数 */
+	uint32_t queue_frames;	/**< 每个分片至少能缓存的帧数 */
+	enum canhal_dispatch_overflow overflow;
+	uint32_t cpu_affinity;	/**< 第 n 个工作线程绑定到位图里第 n % popcount 个 CPU, 0 表示不限制 */
+	struct latency_hist *callback_latency; /**< 回调时记录 SPI 传输完成 -> 回调的延迟, 可为 NULL */
+};
+
+// 创建并启动全部工作线程
+struct can_dispatch *can_dispatch_new(const struct can_dispatch_params *params);
+// 停止工作线程, 队列里剩下的帧先回调完再退出
+void can_dispatch_free(struct can_dispatch *d);
+
+// 以下两个函数只能在 SPI 线程调用. push 返回 false 表示按 DROP 策略丢弃了这一帧
+bool can_dispatch_push(struct can_dispatch *d, drv_can_filter_callback callback, void *context,
+					   const struct can_frame *frame);
+void can_dispatch_kick(struct can_dispatch *d);
+
+// 任意线程调用, 返回分片数, 最多填 max 个
+int can_dispatch_get_stats(struct can_dispatch *d, struct canhal_dispatch_stats *out, int max);
+
+#endif
@@ -0,0 +1,394 @@
+#include "can_filter.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CAN_STD_ID_MASK (0x7ffu)
+#define CAN_EXT_ID_MASK (0x1fffffffu)
+#define CAN_STD_ID_COUNT (CAN_STD_ID_MASK + 1)
+
+#define FILTER_NONE (0) /**< 分发表里的空位, 其余值为 entries 下标 + 1 */
+
+struct filter_entry
+{
+	int id;
+	uint32_t can_id;
+	uint32_t mask;
+	bool extended;
+	drv_can_filter_callback callback;
+	void *context;
+};
+
+struct filter_hash
+{
+	uint32_t mask;	  /**< 槽位数 - 1 */
+	uint32_t *keys;
+	uint32_t *values; /**< FILTER_NONE 表示空槽 */
+};
+
+struct filter_group
+{
+	uint32_t mask;
+	bool extended;
+	uint32_t first; /**< 组里最早注册的过滤器的 entries 下标 + 1, 组按它从小到大排列 */
+	struct filter_hash hash;
+};
+
+/* 发布给读者的只读分发结构 */
+struct filter_dispatch
+{
+	uint32_t std_direct[CAN_STD_ID_COUNT];
+	struct filter_hash ext_exact;
+	struct filter_group *groups;
+	uint32_t group_count;
+	struct filter_entry *entries;
+	uint32_t entry_count;
+};
+
+struct filter_retired
+{
+	struct filter_dispatch *dispatch;
+	uint64_t epoch;
+	struct filter_retired *next;
+};
+
+struct can_filter_table
+{
+	struct filter_dispatch *current; /**< 读者用 acquire 读取 */
+	uint64_t reader_epoch;			 /**< 读者每次静止时加一 */
+
+	pthread_mutex_t lock; /**< 保护下面的写者状态 */
+	struct filter_entry *entries;
+	uint32_t entry_count;
+	uint32_t entry_cap;
+	int next_id;
+	struct filter_retired *retired;
+};
+
+static inline uint32_t filter_hash_slot(uint32_t key, uint32_t mask)
+{
+	return (key * 0x9e3779b1u) & mask;
+}
+
+static bool filter_hash_init(struct filter_hash *h, uint32_t count)
+{
+	uint32_t slots = 4;
+	while (slots < count * 2)
+		slots <<= 1;
+	h->mask = slots - 1;
+	h->keys = calloc(slots, sizeof(uint32_t));
+	h->values = calloc(slots, sizeof(uint32_t));
+	return h->keys != NULL && h->values != NULL;
+}
+
+static void filter_hash_destroy(struct filter_hash *h)
+{
+	free(h->keys);
+	free(h->values);
+}
+
+// 相同 key 已经存在时保留先注册的
+static void filter_hash_insert(struct filter_hash *h, uint32_t key, uint32_t value)
+{
+	uint32_t slot = filter_hash_slot(key, h->mask);
+	while (h->values[slot] != FILTER_NONE)
+	{
+		if (h->keys[slot] == key)
+			return;
+		slot = (slot + 1) & h->mask;
+	}
+	h->keys[slot] = key;
+	h->values[slot] = value;
+}
+
+static uint32_t filter_hash_lookup(const struct filter_hash *h, uint32_t key)
+{
+	if (h->keys == NULL)
+		return FILTER_NONE;
+	uint32_t slot = filter_hash_slot(key, h->mask);
+	while (h->values[slot] != FILTER_NONE)
+	{
+		if (h->keys[slot] == key)
+			return h->values[slot];
+		slot = (slot + 1) & h->mask;
+	}
+	return FILTER_NONE;
+}
+
+static inline uint32_t filter_id_mask(bool extended)
+{
+	return extended ? CAN_EXT_ID_MASK : CAN_STD_ID_MASK;
+}
+
+static void filter_dispatch_free(struct filter_dispatch *d)
+{
+	if (d == NULL)
+		return;
+	filter_hash_destroy(&d->ext_exact);
+	for (uint32_t n = 0; n < d->group_count; n++)
+		filter_hash_destroy(&d->groups[n].hash);
+	free(d->groups);
+	free(d->entries);
+	free(d);
+}
+
+static struct filter_group *filter_dispatch_group(struct filter_dispatch *d, uint32_t mask, bool extended)
+{
+	for (uint32_t n = 0; n < d->group_count; n++)
+	{
+		if (d->groups[n].mask == mask && d->groups[n].extended == extended)
+			return &d->groups[n];
+	}
+	return NULL;
+}
+
+/* 根据写者的过滤器列表生成一份新的分发结构 */
+static struct filter_dispatch *filter_dispatch_build(const struct filter_entry *entries, uint32_t count)
+{
+	struct filter_dispatch *d = calloc(1, sizeof(struct filter_dispatch));
+	if (d == NULL)
+		return NULL;
+
+	d->entries = calloc(count ? count : 1, sizeof(struct filter_entry));
+	d->groups = calloc(count ? count : 1, sizeof(struct filter_group));
+	if (d->entries == NULL || d->groups == NULL)
+		goto fail;
+	memcpy(d->entries, entries, count * sizeof(struct filter_entry));
+	d->entry_count = count;
+
+	// 先统计每个桶的大小, 哈希表按元素个数一次分配好
+	uint32_t ext_exact = 0;
+	uint32_t *group_size = calloc(count ? count : 1, sizeof(uint32_t));
+	if (group_size == NULL)
+		goto fail;
+	for (uint32_t n = 0; n < count; n++)
+	{
+		const struct filter_entry *e = &entries[n];
+		if (e->mask == filter_id_mask(e->extended))
+		{
+			ext_exact += e->extended;
+			continue;
+		}
+		struct filter_group *g = filter_dispatch_group(d, e->mask, e->extended);
+		if (g == NULL)
+		{
+			// 按注册顺序遍历, 新建的组的 first 一定比已有的组大
+			g = &d->groups[d->group_count++];
+			g->mask = e->mask;
+			g->extended = e->extended;
+			g->first = n + 1;
+		}
+		group_size[g - d->groups]++;
+	}
+
+	bool ok = filter_hash_init(&d->ext_exact, ext_exact);
+	for (uint32_t n = 0; n < d->group_count; n++)
+		ok = filter_hash_init(&d->groups[n].hash, group_size[n]) && ok;
+	free(group_size);
+	if (!ok)
+		goto fail;
+
+	for (uint32_t n = 0; n < count; n++)
+	{
+		const struct filter_entry *e = &entries[n];
+		uint32_t value = n + 1;
+		if (e->mask == filter_id_mask(e->extended))
+		{
+			if (!e->extended)
+			{
+				if (d->std_direct[e->can_id] == FILTER_NONE)
+					d->std_direct[e->can_id] = value;
+			}
+			else
+			{
+				filter_hash_insert(&d->ext_exact, e->can_id, value);
+			}
+		}
+		else
+		{
+			struct filter_group *g = filter_dispatch_group(d, e->mask, e->extended);
+			filter_hash_insert(&g->hash, e->can_id, value);
+		}
+	}
+	return d;
+
+fail:
+	filter_dispatch_free(d);
+	return NULL;
+}
+
+/* 释放所有读者已经不可能再引用的旧分发结构, 需持有写锁 */
+static void filter_reclaim(struct can_filter_table *t)
+{
+	uint64_t epoch = __atomic_load_n(&t->reader_epoch, __ATOMIC_SEQ_CST);
+	struct filter_retired **pp = &t->retired;
+	while (*pp != NULL)
+	{
+		struct filter_retired *r = *pp;
+		if (r->epoch < epoch)
+		{
+			*pp = r->next;
+			filter_dispatch_free(r->dispatch);
+			free(r);
+		}
+		else
+		{
+			pp = &r->next;
+		}
+	}
+}
+
+static bool filter_publish(struct can_filter_table *t)
+{
+	struct filter_dispatch *d = filter_dispatch_build(t->entries, t->entry_count);
+	struct filter_retired *r = malloc(sizeof(struct filter_retired));
+	if (d == NULL || r == NULL)
+	{
+		filter_dispatch_free(d);
+		free(r);
+		return false;
+	}
+
+	r->dispatch = __atomic_exchange_n(&t->current, d, __ATOMIC_SEQ_CST);
+	r->epoch = __atomic_load_n(&t->reader_epoch, __ATOMIC_SEQ_CST);
+	r->next = t->retired;
+	t->retired = r;
+	filter_reclaim(t);
+	return true;
+}
+
+struct can_filter_table *can_filter_table_new(void)
+{
+	struct can_filter_table *t = calloc(1, sizeof(struct can_filter_table));
+	if (t == NULL)
+		return NULL;
+	pthread_mutex_init(&t->lock, NULL);
+	t->current = filter_dispatch_build(NULL, 0);
+	if (t->current == NULL)
+	{
+		pthread_mutex_destroy(&t->lock);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void can_filter_table_free(struct can_filter_table *t)
+{
+	if (t == NULL)
+		return;
+	while (t->retired != NULL)
+	{
+		struct filter_retired *r = t->retired;
+		t->retired = r->next;
+		filter_dispatch_free(r->dispatch);
+		free(r);
+	}
+	filter_dispatch_free(t->current);
+	free(t->entries);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+int can_filter_add(struct can_filter_table *t, uint32_t can_id, bool extended, uint32_t mask,
+				   drv_can_filter_callback callback, void *context)
+{
+	int id = -1;
+	mask &= filter_id_mask(extended);
+
+	pthread_mutex_lock(&t->lock);
+	if (t->entry_count == t->entry_cap)
+	{
+		uint32_t cap = t->entry_cap ? t->entry_cap * 2 : 128;
+		struct filter_entry *entries = realloc(t->entries, cap * sizeof(struct filter_entry));
+		if (entries == NULL)
+			goto out;
+		t->entries = entries;
+		t->entry_cap = cap;
+	}
+
+	struct filter_entry *e = &t->entries[t->entry_count++];
+	e->id = t->next_id;
+	e->can_id = can_id & mask;
+	e->mask = mask;
+	e->extended = extended;
+	e->callback = callback;
+	e->context = context;
+	if (!filter_publish(t))
+	{
+		t->entry_count--;
+		goto out;
+	}
+	id = t->next_id++;
+
+out:
+	pthread_mutex_unlock(&t->lock);
+	return id;
+}
+
+bool can_filter_remove(struct can_filter_table *t, int filter_id)
+{
+	bool ok = false;
+
+	pthread_mutex_lock(&t->lock);
+	for (uint32_t n = 0; n < t->entry_count; n++)
+	{
+		if (t->entries[n].id != filter_id)
+			continue;
+		struct filter_entry removed = t->entries[n];
+		memmove(&t->entries[n], &t->entries[n + 1], (t->entry_count - n - 1) * sizeof(struct filter_entry));
+		t->entry_count--;
+		ok = filter_publish(t);
+		if (!ok)
+		{
+			// 重建失败时恢复原列表, 读者继续使用旧结构
+			memmove(&t->entries[n + 1], &t->entries[n], (t->entry_count - n) * sizeof(struct filter_entry));
+			t->entries[n] = removed;
+			t->entry_count++;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return ok;
+}
+
+bool can_filter_find(struct can_filter_table *t, uint32_t can_id, bool extended,
+					 drv_can_filter_callback *cb, void **context)
+{
+	const struct filter_dispatch *d = __atomic_load_n(&t->current, __ATOMIC_ACQUIRE);
+	uint32_t value;
+
+	can_id &= filter_id_mask(extended);
+	if (!extended)
+		value = d->std_direct[can_id];
+	else
+		value = filter_hash_lookup(&d->ext_exact, can_id);
+
+	// 没有精确匹配时在所有掩码组里取最早注册的一个. 组按 first 排序,
+	// 已经找到的比某个组里最早的还早时, 这个组和后面的组都不用再查
+	if (value == FILTER_NONE)
+	{
+		for (uint32_t n = 0; n < d->group_count; n++)
+		{
+			const struct filter_group *g = &d->groups[n];
+			if (value != FILTER_NONE && g->first > value)
+				break;
+			if (g->extended != extended)
+				continue;
+			uint32_t found = filter_hash_lookup(&g->hash, can_id & g->mask);
+			if (found != FILTER_NONE && (value == FILTER_NONE || found < value))
+				value = found;
+		}
+	}
+
+	if (value == FILTER_NONE)
+		return false;
+	*cb = d->entries[value - 1].callback;
+	*context = d->entries[value - 1].context;
+	return true;
+}
+
+void can_filter_quiescent(struct can_filter_table *t)
+{
+	__atomic_add_fetch(&t->reader_epoch, 1, __ATOMIC_SEQ_CST);
+}
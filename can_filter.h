@@ -0,0 +1,31 @@
+#ifndef CAN_FILTER_H
+#define CAN_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "can_hal.h"
+
+/*
+	CAN 接收过滤器表.
+	查找走一份只读的分发结构: 11 位精确 ID 用 2048 项直接索引表, 29 位精确 ID 用开放寻址哈希表,
+	带掩码的过滤器按 (掩码, 帧类型) 分组, 每组一个哈希表, 查找时间只和掩码组数有关.
+	增删过滤器时在写锁内重建一份新的分发结构并原子替换, 读者 (RX 线程) 不加锁;
+	旧结构等读者调用过 can_filter_quiescent 之后再释放.
+*/
+struct can_filter_table;
+
+struct can_filter_table *can_filter_table_new(void);
+void can_filter_table_free(struct can_filter_table *t);
+
+// 返回过滤器编号 (>= 0), 失败返回 -1. mask 中与帧类型 ID 宽度相同的位全部置 1 时为精确匹配
+int can_filter_add(struct can_filter_table *t, uint32_t can_id, bool extended, uint32_t mask,
+				   drv_can_filter_callback callback, void *context);
+bool can_filter_remove(struct can_filter_table *t, int filter_id);
+
+// 以下两个函数只能在读者线程调用
+bool can_filter_find(struct can_filter_table *t, uint32_t can_id, bool extended,
+					 drv_can_filter_callback *cb, void **context);
+// 读者声明自己不再持有任何分发结构的引用
+void can_filter_quiescent(struct can_filter_table *t);
+
+#endif
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "can_hal.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -9,203 +11,827 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "pt/pt.h"
 #include "utils/ringbuffer.h"
 #include "utils/buffer_helper.h"
+#include "utils/mpmc_queue.h"
+#include "utils/latency_hist.h"
+#include "utils/blog.h"
+#include "utils/checksum.h"
+#include "utils/prefault.h"
 #include "spidev.h"
+#include "can_tx_sched.h"
+#include "can_dispatch.h"
+#include "can_filter.h"
+#include "can_mailbox.h"
+#include "can_shm.h"
+#include "can_spi_frame.h"
+#include "can_transport.h"
 
-#define CAN_CACHE_SIZE (1024 * 1024)
-#define CAN_SPI_MAX_CHANNEL (1)
+/*
+	每个优先级通道默认 2048 帧, 1Mbit/s 总线满载时约 250ms 的发送量. 经典帧每个单元 32 字节,
+	每个 CAN 通道的三个优先级通道合计约 192KB, 启用 can_fd 时约 528KB. 需要更深的队列时设置 tx_lane_frames
+*/
+#define CAN_TX_LANE_FRAMES_DEFAULT (2048)
+#define CAN_SPI_MAX_CHANNEL CANHAL_MAX_CHANNELS /**< 通道号由 spi_addr 和 chan_hi 两位组成 */
 
-static struct
+#define CAN_SPI_BATCH_MAX CAN_TRANSPORT_MAX_FRAMES /**< 单次 SPI 传输最多打包的帧数 */
+#define CAN_SPI_BATCH_DEFAULT (16) /**< 默认批量帧数 */
+
+#define CAN_SOCK_SNDBUF (1024 * 1024) /**< 读 socket 上允许积压的字节数, 内核会按 wmem_max 截断 */
+
+#define CAN_DISPATCH_QUEUE_FRAMES_DEFAULT (1024) /**< 回调工作线程池每个分片默认的队列深度 */
+
+#define CAN_TX_SCHED_FRAMES_DEFAULT (4096)
+#define CAN_TX_SCHED_STARVE_US_DEFAULT (50000)
+
+#define CAN_IDLE_POLL_MS_DEFAULT (10)	/**< 没有中断源时的空闲轮询间隔, 与原来的 usleep(10000) 一致 */
+#define CAN_IDLE_POLL_MS_IRQ (1000)		/**< 有中断源时的兜底超时, 防止丢边沿后永远不再读 SPI */
+#define CAN_STACK_PREFAULT (32 * 1024) /**< 线程启动时预先访问的栈深度, 栈小于它的两倍时不做 */
+
+/*
+	发送队列里的元素, 带上 canhal_write 入队的时间.
+	没有启用 CAN FD 时队列只按 CAN_TX_ITEM_CLASSIC_SIZE 分配, 不为用不到的长帧空间付出内存
+*/
+struct can_tx_item
+{
+	uint64_t enqueue_ns;
+	union
+	{
+		struct spi_can_frame frame;
+		uint8_t wire[CAN_FRAME_MAX_LENGTH]; /**< FD 长帧的完整线上字节 */
+	};
+};
+
+#define CAN_TX_ITEM_CLASSIC_SIZE (offsetof(struct can_tx_item, frame) + CAN_FRAME_LENGTH)
+#define CAN_RX_CARRY_MAX (CAN_FRAME_MAX_SLOTS * CAN_FRAME_LENGTH) /**< 跨两次传输的长帧在前一次里最多的字节数, 向上取整到槽位 */
+
+struct canhal_instance;
+
+#define CAN_CACHE_LINE (64)
+
+/*
+	计数器都用 relaxed 原子读写, 只求单个值不撕裂, 不和其他数据建立顺序.
+	只由 SPI 线程写的计数器用 load + store 递增, 不需要带 lock 的指令;
+	会被任意线程写的计数器放在单独的 cache line 上, 用 fetch_add
+*/
+#define CAN_STAT_INC(c, v) __atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+#define CAN_STAT_ADD_SHARED(c, v) __atomic_fetch_add(&(c), (v), __ATOMIC_RELAXED)
+#define CAN_STAT_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+struct can_channel_counters
+{
+	uint64_t rx_bytes; /**< 以下只由 SPI 线程写 */
+	uint64_t rx_unmatched;
+	uint64_t tx_frames;
+	uint64_t tx_bytes;
+	uint64_t tx_dropped __attribute__((aligned(CAN_CACHE_LINE))); /**< canhal_write* 的调用线程写 */
+};
+
+struct can_link_counters
 {
-	int spi_fd;			  /**< SPI 设备文件描述符 */
+	uint64_t spi_transfers; /**< 全部只由 SPI 线程写 */
+	uint64_t spi_ioctl_errors;
+	uint64_t spi_bytes;
+	uint64_t spi_status_transfers;
+	uint64_t rx_xor_errors;
+	uint64_t rx_resyncs;
+	uint64_t rx_resync_bytes;
+	uint64_t rx_rejected;
+	uint64_t rx_bad_channel;
+	uint64_t rx_sock_dropped;
+	uint64_t minor_faults; /**< SPI 线程自己的 getrusage(RUSAGE_THREAD) 结果 */
+	uint64_t major_faults;
+};
+
+/* SPI 线程实际生效的运行环境, 线程启动后不再改变 */
+struct can_thread_info
+{
+	int sched_policy;
+	int sched_priority;
+	bool mem_locked;
+	bool prefault;	   /**< 线程启动时预先访问栈 */
+	size_t stack_size; /**< 0 表示系统默认 */
+};
+
+/* MCU 后面的一路 CAN 控制器 */
+struct can_channel
+{
+	struct canhal_instance *hal;
+	uint8_t index;
+	struct buffer_helper *bh;							/**< 接收解析器 */
+	struct mpmc_queue *tx_lanes[CANHAL_TX_PRIO_COUNT]; /**< 发送优先级通道, 任意线程生产, SPI 线程消费 */
+	struct can_tx_sched *tx_sched;						/**< 按 CAN ID 仲裁顺序的发送调度器, NULL 表示先进先出, 只在 SPI 线程使用 */
+	struct can_filter_table *filters;					/**< 接收过滤器表, 任意线程增删, SPI 线程查找 */
+	struct can_channel_counters stats __attribute__((aligned(CAN_CACHE_LINE))); /**< 接收帧数由 bh 统计 */
+};
+
+#define THIS_SPI_ADDR 1
+
+#define CAN_SPI_DEVICE_DEFAULT "/dev/spidev0.0"
+// #define CAN_SPI_MODE_DEFAULT (SPI_MODE_3 | SPI_LSB_FIRST)
+#define CAN_SPI_MODE_DEFAULT (SPI_CPOL | SPI_CPHA) /* SPI 通信使用全双工，设置 CPOL＝0，CPHA＝0。 */
+#define CAN_SPI_BITS_DEFAULT (8)				   /* ８ｂiｔｓ读写，MSB first。*/
+// #define CAN_SPI_SPEED_DEFAULT (562500)
+#define CAN_SPI_SPEED_DEFAULT (1125000) /* 设置传输速度 */
+#define CAN_SPI_DELAY_DEFAULT (0)
+
+#define CAN_AUTOTUNE_MAX_HZ (20000000)
+#define CAN_AUTOTUNE_STEP_PERCENT (25)
+#define CAN_AUTOTUNE_DWELL_MS (500)
+#define CAN_AUTOTUNE_MIN_FRAMES (1000)
+#define CAN_AUTOTUNE_POLL_MS (10)
+
+#define CAN_WIRE_HELLO_TRIES (3)
+#define CAN_WIRE_ACK_XFERS (4)
+#define CAN_WIRE_POLL_MS (1)
+
+/*
+	canhal_set_link 交给 SPI 线程的请求. 传输后端只能在 SPI 线程里操作,
+	所以调用者填好参数后置位 pending 并唤醒线程, 线程在两次传输之间应用并广播 done
+*/
+struct can_link_request
+{
+	pthread_mutex_t serialize; /**< 同一时刻只允许一个 canhal_set_link 调用者 */
+	pthread_mutex_t lock;	   /**< 保护以下字段和 canhal_instance::link */
+	pthread_cond_t done;
+	atomic_int pending;
+	struct canhal_link link; /**< 请求的参数, 成功后是实际生效的值 */
+	int result;
+};
+
+/*
+	一个 SPI-CAN 桥的全部状态, canhal_ctx 指向它.
+	每个实例有自己的 SPI fd、线程、发送队列、解析器和过滤器表, 同一进程可以同时驱动多个桥
+*/
+struct canhal_instance
+{
+	char device[64];	  /**< spidev 设备路径, 也用作读 socket 的名字 */
+	struct can_transport *xport; /**< 与 MCU 交换数据的传输后端 */
+	struct canhal_link link; /**< 当前的 SPI 链路参数, SPI 线程在 link_req.lock 下修改 */
+	struct can_link_request link_req;
 	int sock_fd;		  /**< Unix domain socket */
 	pthread_t thread;	  /**< SPI 读取线程 */
-	ring_buffer_t gl_can_send_ring; /**< SPI 发送环形缓冲区 */
+	struct can_channel chan[CAN_SPI_MAX_CHANNEL];
+	uint8_t channels;	  /**< 实际使用的通道数 */
+	uint8_t tx_rr;		  /**< 下一批从哪个通道开始取帧, 轮转保证公平 */
+	uint32_t batch_frames; /**< 单次 SPI 传输打包的帧数 */
+	int tx_event_fd;	  /**< canhal_write 用来唤醒 SPI 线程的 eventfd */
+	int idle_poll_ms;	  /**< 空闲时 poll 的超时时间 */
+	uint8_t rx_stream[CAN_RX_CARRY_MAX + CAN_SPI_BATCH_MAX * CAN_FRAME_LENGTH]; /**< 以下缓冲区只在 SPI 线程使用 */
+	struct spi_can_frame *rx_frames; /**< 指向 rx_stream + CAN_RX_CARRY_MAX, 前面放上一批没收全的长帧 */
+	size_t rx_carry;	 /**< 上一批末尾没收全的长帧的字节数, 紧挨着放在 rx_frames 前面 */
+	size_t rx_skip;		 /**< 上一批最后一个长帧的补齐字节延续到本批开头的字节数 */
+	struct spi_can_frame tx_frames[CAN_SPI_BATCH_MAX];
+	uint8_t tx_carry[CAN_FRAME_MAX_SLOTS * CAN_FRAME_LENGTH]; /**< 上一批没放下的长帧剩余槽位 */
+	size_t tx_carry_len;
+	bool can_fd;		 /**< 发送队列按 FD 长帧分配 */
+	bool rx_compact;	 /**< MCU 发来的是紧凑格式, 初始化时协商, 线程启动后不再改变 */
+	bool tx_compact;	 /**< 发给 MCU 的是紧凑格式 */
+	bool pending_status; /**< MCU 支持状态传输, 同样在初始化时协商 */
+	uint64_t tx_enqueue_ns[CAN_SPI_BATCH_MAX]; /**< tx_frames 中每个真实帧的入队时间 */
+	uint64_t rx_xfer_ns; /**< 当前这批 SPI 传输完成的时间 */
+	uint8_t rx_ok[CAN_SPI_BATCH_MAX]; /**< 当前这批 rx 帧各自是否通过校验 */
+	enum canhal_integrity integrity; /**< 帧校验方式 */
+	struct can_frame rx_pub[CAN_SPI_BATCH_MAX]; /**< 本批收到、等待发布到读 socket 的帧, 满了先发布 */
+	int rx_pub_count;
+	struct can_link_counters stats __attribute__((aligned(CAN_CACHE_LINE)));
+	struct can_shm_ring *rx_shm; /**< 共享内存接收广播环, NULL 表示未启用 */
+	struct can_mailbox_table *mailboxes; /**< 最新值邮箱, NULL 表示未启用 */
+	struct can_dispatch *dispatch; /**< 回调工作线程池, NULL 表示在 SPI 线程里直接回调 */
+	struct latency_hist latency[CANHAL_LAT_STAGE_COUNT]; /**< 各阶段延迟直方图, 任意线程记录/查询 */
+	atomic_int idle_waiting; /**< SPI 线程正准备/正在阻塞等待, canhal_write 据此决定是否需要唤醒 */
+	_Atomic uint64_t wake_req_ns; /**< canhal_write 请求唤醒 SPI 线程的时间, 0 表示没有请求, 用于统计调度延迟 */
+	struct can_thread_info thread_info;
 	volatile int running; /**< 线程运行标志 */
-} g_can_ctx = {
-	.spi_fd = -1,
-	.sock_fd = -1,
-	.running = 0};
+};
 
-static struct
+static bool driver_can_find_filter(struct can_channel *chan, uint32_t can_id, bool extended, drv_can_filter_callback *cb, void **context);
+
+/* 批量帧数不能超过传输后端单次传输的上限 (spidev 是单条 message 的缓冲区大小) */
+static uint32_t can_spi_batch_limit(struct canhal_instance *hal, uint32_t wanted)
 {
-	uint32_t can_id;
-	bool is_extended;
-	uint32_t mask;
-	drv_can_filter_callback callback;
-	void *context;
-} global_can_filter[128];
+	uint32_t limit = can_transport_max_transfer(hal->xport) / CAN_FRAME_LENGTH;
 
-struct spi_can_frame
+	if (wanted == 0)
+		wanted = CAN_SPI_BATCH_DEFAULT;
+	if (limit > CAN_SPI_BATCH_MAX)
+		limit = CAN_SPI_BATCH_MAX;
+	if (wanted > limit)
+		wanted = limit;
+	return wanted > 0 ? wanted : 1;
+}
+
+/* 校验一整批按帧长对齐的 rx 帧, ok[n] 表示第 n 帧是否通过 */
+static void can_frame_verify_batch(const struct canhal_instance *hal, const struct spi_can_frame *frames, int count, uint8_t *ok)
 {
-	uint8_t head;
-	uint8_t dlc : 4;
-	uint8_t rtr : 2;	  // 1 is remote frame, 0 is data frame
-	uint8_t ide : 1;	  // 1 is extended, 0 is standard frame
-	uint8_t spi_addr : 1; // choose spi addr
-	uint32_t can_id;
-	uint8_t payload[8];
-	uint8_t tail;
-	uint8_t xor_verify;
-} __attribute__((packed));
+	if (hal->integrity == CANHAL_INTEGRITY_CRC16)
+	{
+		// 长帧超出这个槽位, 由调用者按整帧校验
+		for (int n = 0; n < count; n++)
+			ok[n] = spi_frame_length(&frames[n]) == CAN_FRAME_LENGTH && spi_frame_verify(&frames[n], hal->integrity);
+		return;
+	}
+
+	// 异或模式整批一起算, 再补上包头包尾的检查
+	checksum_xor8_verify_frames(frames, CAN_FRAME_LENGTH, count, ok);
+	for (int n = 0; n < count; n++)
+		ok[n] = ok[n] && frames[n].head == HEAD_SIGN && frames[n].tail == TAIL_SIGN;
+}
+
+static uint64_t can_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool can_tx_pending(struct canhal_instance *hal)
+{
+	if (hal->tx_carry_len > 0)
+		return true;
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		struct can_channel *chan = &hal->chan[ch];
+		if (chan->tx_sched != NULL && can_tx_sched_count(chan->tx_sched) > 0)
+			return true;
+		for (int prio = 0; prio < CANHAL_TX_PRIO_COUNT; prio++)
+		{
+			if (mpmc_queue_size_approx(chan->tx_lanes[prio]) > 0)
+				return true;
+		}
+	}
+	return false;
+}
 
-#define HEAD_SIGN (0x7e)
-#define TAIL_SIGN (0x7d)
+/*
+	先把各优先级通道里的帧搬进调度器, 之后按 (通道, CAN 仲裁值) 出队.
+	通道优先级排在 CAN ID 之前, 所以高优先级通道的语义不变.
+	饥饿判断用 canhal_write 入队的时间, 在优先级通道里等待的时间也算在内.
+	多个线程同时写时时间戳在入队之前取, 通道内的顺序和时间戳可能有少量倒挂, 饥饿上限因此是近似的
+*/
+static void can_tx_sched_refill(struct can_channel *chan)
+{
+	struct can_tx_item item;
 
-static bool driver_can_find_filter(uint32_t can_id, drv_can_filter_callback *cb, void **context);
+	for (int prio = 0; prio < CANHAL_TX_PRIO_COUNT; prio++)
+	{
+		while (can_tx_sched_space(chan->tx_sched) > 0 && mpmc_queue_pop(chan->tx_lanes[prio], &item))
+		{
+			uint64_t key = ((uint64_t)prio << 32) | can_arb_key(item.frame.can_id & SPI_FRAME_ID_MASK, item.frame.ide, item.frame.rtr);
+			can_tx_sched_push(chan->tx_sched, key, prio, item.enqueue_ns, &item);
+		}
+	}
+}
 
-#define CAN_FRAME_LENGTH (sizeof(struct spi_can_frame))
-static struct buffer_helper *global_bh[CAN_SPI_MAX_CHANNEL] = {NULL};
+/* 取出一个通道里下一个要发的帧, 高优先级通道取空后才取下一个通道 */
+static bool can_tx_pop(struct can_channel *chan, uint64_t now, struct can_tx_item *item)
+{
+	if (chan->tx_sched != NULL)
+		return can_tx_sched_pop(chan->tx_sched, now, item);
 
-#define THIS_SPI_ADDR 1
+	for (int prio = 0; prio < CANHAL_TX_PRIO_COUNT; prio++)
+	{
+		if (mpmc_queue_pop(chan->tx_lanes[prio], item))
+			return true;
+	}
+	return false;
+}
+
+/*
+	把一个待发帧放进 out[pos] 开始的位置, 放不下的部分存进 tx_carry 留给下一批, 返回新的 pos.
+	槽位格式下帧补齐到槽位整数倍; 紧凑格式下先转换成紧凑帧, 紧挨着上一帧
+*/
+static size_t can_spi_put_frame(struct canhal_instance *hal, uint8_t *out, size_t pos, size_t cap, const struct can_tx_item *item)
+{
+	uint8_t bytes[CAN_FRAME_MAX_SLOTS * CAN_FRAME_LENGTH];
+	size_t len;
 
-#define CAN_FRAME_HEAD_LENGTH (1)
+	if (hal->tx_compact)
+	{
+		len = spi_compact_encode(bytes, &item->frame, hal->integrity);
+	}
+	else
+	{
+		size_t flen = spi_frame_length(&item->frame);
+		if (flen == CAN_FRAME_LENGTH && cap - pos >= CAN_FRAME_LENGTH)
+		{
+			memcpy(out + pos, item->wire, CAN_FRAME_LENGTH);
+			return pos + CAN_FRAME_LENGTH;
+		}
+		len = spi_frame_slot_length(flen);
+		memcpy(bytes, item->wire, flen);
+		memset(bytes + flen, IDLE_SIGN, len - flen);
+	}
 
-static const char *device = "/dev/spidev0.0";
-// static uint8_t mode = SPI_MODE_3 | SPI_LSB_FIRST; /* SPI 通信使用全双工，设置 CPOL＝0，CPHA＝0。 */
-static uint8_t mode = SPI_CPOL | SPI_CPHA; /* SPI 通信使用全双工，设置 CPOL＝0，CPHA＝0。 */
+	size_t now_len = len < cap - pos ? len : cap - pos;
+	memcpy(out + pos, bytes, now_len);
+	memcpy(hal->tx_carry, bytes + now_len, len - now_len);
+	hal->tx_carry_len = len - now_len;
+	return pos + now_len;
+}
 
-static uint8_t bits = 8; /* ８ｂiｔｓ读写，MSB first。*/
-// static uint32_t speed = 562500; //12*1000*1000;/* 设置传输速度 */
-static uint32_t speed = 1125000; // 12*1000*1000;/* 设置传输速度 */
+/*
+	一次取出最多 batch 个槽位的待发帧, 各通道轮流每次取一帧, 起始通道每批轮转,
+	一路繁忙的总线不会挤占其他通道的位置. 上一批没放下的帧剩余部分最先发.
+	紧凑格式下最后一个槽位的剩余字节填 IDLE_SIGN, 不足 min_frames 的部分用空闲帧(head = 0xff)补齐,
+	返回本次要传输的槽位数, *tx_count 为本批开始发送的真实帧数
+*/
+static int can_spi_fill_tx_batch(struct canhal_instance *hal, struct spi_can_frame *tx_frames, int min_frames, int *tx_count)
+{
+	int batch = hal->batch_frames;
+	uint8_t *out = (uint8_t *)tx_frames;
+	size_t cap = (size_t)batch * CAN_FRAME_LENGTH;
+	size_t pos = 0;
+	int count = 0;
+	uint64_t now = can_now_ns();
+	uint32_t active = 0; /**< 还可能有帧的通道位图 */
+	struct can_tx_item item;
 
-static uint16_t delay = 0;
+	if (hal->tx_carry_len > 0)
+	{
+		pos = hal->tx_carry_len < cap ? hal->tx_carry_len : cap;
+		memcpy(out, hal->tx_carry, pos);
+		memmove(hal->tx_carry, hal->tx_carry + pos, hal->tx_carry_len - pos);
+		hal->tx_carry_len -= pos;
+	}
 
-char can_send_buf[CAN_CACHE_SIZE];
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		if (hal->chan[ch].tx_sched != NULL)
+			can_tx_sched_refill(&hal->chan[ch]);
+		active |= 1u << ch;
+	}
+
+	for (int ch = hal->tx_rr; pos < cap && active != 0 && hal->tx_carry_len == 0; ch = (ch + 1) % hal->channels)
+	{
+		if (!(active & (1u << ch)))
+			continue;
+		if (can_tx_pop(&hal->chan[ch], now, &item))
+		{
+			pos = can_spi_put_frame(hal, out, pos, cap, &item);
+			hal->tx_enqueue_ns[count++] = item.enqueue_ns;
+			CAN_STAT_INC(hal->chan[ch].stats.tx_frames, 1);
+			CAN_STAT_INC(hal->chan[ch].stats.tx_bytes, spi_frame_data_len(&item.frame));
+		}
+		else
+		{
+			active &= ~(1u << ch);
+		}
+	}
+	hal->tx_rr = (hal->tx_rr + 1) % hal->channels;
+	*tx_count = count;
+
+	int frames = (pos + CAN_FRAME_LENGTH - 1) / CAN_FRAME_LENGTH;
+	memset(out + pos, IDLE_SIGN, frames * CAN_FRAME_LENGTH - pos);
+	for (; frames < min_frames && frames < batch; frames++)
+	{
+		if (hal->tx_compact)
+		{
+			memset(&tx_frames[frames], IDLE_SIGN, CAN_FRAME_LENGTH);
+			continue;
+		}
+		bzero(&tx_frames[frames], CAN_FRAME_LENGTH);
+		tx_frames[frames].head = IDLE_SIGN;
+		tx_frames[frames].spi_addr = THIS_SPI_ADDR;
+	}
+	return frames;
+}
 
-static int SPI_Transfer(const uint8_t *TxBuf, uint8_t *RxBuf, int len)
+/*
+	把本批收到的帧发布到读 socket: 每个数据报最多打包 CANHAL_DGRAM_MAX_FRAMES 帧,
+	所有数据报用一次 sendmmsg 发出. 读端来不及取时直接丢弃, 不阻塞 SPI 线程
+*/
+static void can_rx_publish_flush(struct canhal_instance *hal)
 {
-	int ret;
-	int fd = g_can_ctx.spi_fd;
-	struct spi_ioc_transfer tr = {
-		.tx_buf = (unsigned long)TxBuf,
-		.rx_buf = (unsigned long)RxBuf,
-		.len = len,
-		.delay_usecs = delay,
-	};
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
-	if (ret < 1)
-		perror("can't send spi message\n");
+	struct mmsghdr msgs[CAN_SPI_BATCH_MAX / CANHAL_DGRAM_MAX_FRAMES + 1];
+	struct iovec iov[CAN_SPI_BATCH_MAX / CANHAL_DGRAM_MAX_FRAMES + 1];
+	int count = hal->rx_pub_count;
+	int nmsg = 0;
+
+	can_shm_ring_publish(hal->rx_shm, hal->rx_pub, count);
+	if (count == 0 || hal->sock_fd < 0)
+	{
+		hal->rx_pub_count = 0;
+		return;
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (int off = 0; off < count; off += CANHAL_DGRAM_MAX_FRAMES, nmsg++)
+	{
+		int n = count - off < CANHAL_DGRAM_MAX_FRAMES ? count - off : CANHAL_DGRAM_MAX_FRAMES;
+		iov[nmsg].iov_base = &hal->rx_pub[off];
+		iov[nmsg].iov_len = n * sizeof(struct can_frame);
+		msgs[nmsg].msg_hdr.msg_iov = &iov[nmsg];
+		msgs[nmsg].msg_hdr.msg_iovlen = 1;
+	}
+
+	int sent = sendmmsg(hal->sock_fd, msgs, nmsg, MSG_DONTWAIT);
+	if (sent < 0)
+		sent = 0;
+	for (int n = sent; n < nmsg; n++)
+		CAN_STAT_INC(hal->stats.rx_sock_dropped, iov[n].iov_len / sizeof(struct can_frame));
+	hal->rx_pub_count = 0;
+}
+
+/*
+	把一个校验过的帧交给所属通道的解析器, 返回 1 表示交给了上层.
+	raw 是槽位格式或紧凑格式的整帧, 两种格式前两个字节相同
+*/
+static int can_spi_dispatch_rx(struct canhal_instance *hal, uint8_t *raw, size_t len)
+{
+	const struct spi_can_frame *head = (const struct spi_can_frame *)raw;
+
+	// 标准帧和扩展帧都收, 解析后按 ide 分别查过滤器和邮箱; 遥控帧不上报
+	if (head->rtr != 0)
+	{
+		CAN_STAT_INC(hal->stats.rx_rejected, 1);
+		blog_dbg("reject remote frame, ide=%d\n", head->ide);
+		return 0;
+	}
+
+	uint8_t channel = spi_frame_channel(head);
+	blog_dbg("can frame dlc=%d channel=%d\n", head->dlc, channel);
+	if (channel >= hal->channels)
+	{
+		CAN_STAT_INC(hal->stats.rx_bad_channel, 1);
+		blog_warn("bad channel %d\n", channel);
+		return 0;
+	}
+	buffer_helper_loop(hal->chan[channel].bh, (char *)raw, len);
+	return 1;
+}
+
+/*
+	从 off 之后找下一个包头、包尾和异或校验都对的帧, 返回它在 buf 里的偏移, 找不到返回 len.
+	包头声明的长帧超出 buf 末尾时无法校验, 也返回它的位置, 由调用者留到下一批.
+	用 memchr 找包头候选, 一次跳过整段垃圾数据
+*/
+static size_t can_spi_resync_scan(const struct canhal_instance *hal, uint8_t *buf, size_t off, size_t len)
+{
+	size_t pos = off + 1;
+
+	while (pos + CAN_FRAME_LENGTH <= len)
+	{
+		uint8_t *cand = memchr(buf + pos, HEAD_SIGN, len - CAN_FRAME_LENGTH + 1 - pos);
+		if (cand == NULL)
+			break;
+		size_t flen = spi_frame_length((struct spi_can_frame *)cand);
+		if (cand - buf + flen > len || spi_frame_verify((struct spi_can_frame *)cand, hal->integrity))
+			return cand - buf;
+		pos = cand - buf + 1;
+	}
+	return len;
+}
+
+/*
+	一次解析一批 rx 帧, 返回其中有效 can 帧的数量.
+	正常情况下帧按 CAN_FRAME_LENGTH 对齐; 遇到校验不过的位置就往后扫描下一个有效帧,
+	MCU 和主机的字节流错位时在这里重新对齐, 后面的帧按新的位置继续解析.
+	FD 长帧占若干个槽位, 末尾没收全的长帧挪到 rx_frames 前面, 和下一批接起来再解析
+*/
+static int can_spi_parse_rx_batch(struct canhal_instance *hal, struct spi_can_frame *rx_frames, int frames)
+{
+	int rx_count = 0;
+	size_t carry = hal->rx_carry;
+	uint8_t *buf = (uint8_t *)rx_frames - carry;
+	size_t len = carry + (size_t)frames * CAN_FRAME_LENGTH;
+	size_t off = hal->rx_skip;
+
+	hal->rx_carry = 0;
+	hal->rx_skip = 0;
+	can_frame_verify_batch(hal, rx_frames, frames, hal->rx_ok);
+	while (off + CAN_FRAME_LENGTH <= len)
+	{
+		struct spi_can_frame *rx_frame = (struct spi_can_frame *)(buf + off);
+		size_t flen = spi_frame_length(rx_frame);
+		bool ok;
+
+		if (flen == CAN_FRAME_LENGTH && off >= carry && (off - carry) % CAN_FRAME_LENGTH == 0)
+		{
+			ok = hal->rx_ok[(off - carry) / CAN_FRAME_LENGTH];
+		}
+		else if (off + flen > len && rx_frame->head == HEAD_SIGN)
+		{
+			// 长帧的后半部分还在 MCU 那边, 留到下一批
+			hal->rx_carry = len - off;
+			memmove((uint8_t *)rx_frames - hal->rx_carry, rx_frame, hal->rx_carry);
+			break;
+		}
+		else
+		{
+			ok = off + flen <= len && spi_frame_verify(rx_frame, hal->integrity);
+		}
+
+		if (!ok)
+		{
+			// 包头不对是 MCU 没有数据时的空闲帧, 不算错误
+			if (rx_frame->head == HEAD_SIGN)
+			{
+				CAN_STAT_INC(hal->stats.rx_xor_errors, 1);
+				blog_warn("xor error, can id=0x%08x xor=0x%02x\n", rx_frame->can_id, rx_frame->xor_verify);
+			}
+
+			// 跳过整帧的只是空闲帧或坏帧, 跳过的字节数不是帧长的整数倍才说明字节流错位了
+			size_t next = can_spi_resync_scan(hal, buf, off, len);
+			if (next < len && (next - off) % CAN_FRAME_LENGTH != 0)
+			{
+				CAN_STAT_INC(hal->stats.rx_resyncs, 1);
+				CAN_STAT_INC(hal->stats.rx_resync_bytes, next - off);
+				blog_dbg("resync, skip %d bytes\n", (int)(next - off));
+			}
+			off = next;
+			continue;
+		}
+		off += spi_frame_slot_length(flen);
+		rx_count += can_spi_dispatch_rx(hal, (uint8_t *)rx_frame, flen);
+	}
+	// 最后一个长帧的补齐字节延续到了下一批
+	if (off > len)
+		hal->rx_skip = off - len;
+	can_rx_publish_flush(hal);
+	return rx_count;
+}
+
+/*
+	解析紧凑格式的一批 rx, 返回其中有效 can 帧的数量.
+	整批是连续的字节流, 帧与帧之间没有补齐, 空闲时是 IDLE_SIGN 字节;
+	校验不过时从下一个字节开始找包头. 末尾没收全的帧挪到 rx_frames 前面, 和下一批接起来再解析
+*/
+static int can_spi_parse_rx_compact(struct canhal_instance *hal, struct spi_can_frame *rx_frames, int frames)
+{
+	int rx_count = 0;
+	size_t carry = hal->rx_carry;
+	uint8_t *buf = (uint8_t *)rx_frames - carry;
+	size_t len = carry + (size_t)frames * CAN_FRAME_LENGTH;
+	size_t off = 0;
+
+	hal->rx_carry = 0;
+	while (off < len)
+	{
+		uint8_t *p = buf + off;
+		if (*p != HEAD_SIGN)
+		{
+			// 空闲字节不算错误, 一段里有其他字节才说明字节流出错了
+			uint8_t *next = memchr(p, HEAD_SIGN, len - off);
+			size_t skip = next ? (size_t)(next - p) : len - off;
+			size_t idle = 0;
+			while (idle < skip && p[idle] == IDLE_SIGN)
+				idle++;
+			if (idle < skip)
+			{
+				CAN_STAT_INC(hal->stats.rx_resyncs, 1);
+				CAN_STAT_INC(hal->stats.rx_resync_bytes, skip - idle);
+				blog_dbg("resync, skip %d bytes\n", (int)(skip - idle));
+			}
+			off += skip;
+			continue;
+		}
+
+		if (len - off < SPI_COMPACT_HEAD_LENGTH || len - off < spi_compact_length(p, hal->integrity))
+		{
+			// 帧的后半部分还在 MCU 那边, 留到下一批
+			hal->rx_carry = len - off;
+			memmove((uint8_t *)rx_frames - hal->rx_carry, p, hal->rx_carry);
+			break;
+		}
+
+		size_t flen = spi_compact_length(p, hal->integrity);
+		if (!spi_compact_verify(p, flen, hal->integrity))
+		{
+			CAN_STAT_INC(hal->stats.rx_xor_errors, 1);
+			blog_warn("compact frame checksum error, len=%d\n", (int)flen);
+			off++;
+			continue;
+		}
+		off += flen;
+		rx_count += can_spi_dispatch_rx(hal, p, flen);
+	}
+	can_rx_publish_flush(hal);
+	return rx_count;
+}
+
+static void can_event_notify(struct canhal_instance *hal)
+{
+	uint64_t one = 1;
+	if (hal->tx_event_fd >= 0 && write(hal->tx_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("can't signal spi thread");
+}
+
+/* canhal_write 唤醒空闲的 SPI 线程, 同时记下请求时间. 多个写者同时唤醒时只记最早的一个 */
+static void can_event_wake(struct canhal_instance *hal)
+{
+	uint64_t expected = 0;
+	atomic_compare_exchange_strong(&hal->wake_req_ns, &expected, can_now_ns());
+	can_event_notify(hal);
+}
+
+/*
+	记录一次空闲等待之后的调度延迟: 被 canhal_write 唤醒时从唤醒请求算起, 超时返回时从超时到期算起.
+	被 MCU 中断唤醒时不知道中断发生的时刻, 不统计. 顺便更新 SPI 线程的缺页计数
+*/
+static void can_record_wakeup(struct canhal_instance *hal, int ret, uint64_t start_ns, uint64_t now_ns)
+{
+	uint64_t req = atomic_exchange(&hal->wake_req_ns, 0);
+	uint64_t due;
+
+	if (ret > 0 && req != 0)
+		due = req;
+	else if (ret == 0)
+		due = start_ns + (uint64_t)hal->idle_poll_ms * 1000000ull;
 	else
+		due = 0;
+	if (due != 0)
+		latency_hist_record(&hal->latency[CANHAL_LAT_SCHED_WAKEUP], now_ns > due ? now_ns - due : 0);
+
+	struct rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru) == 0)
 	{
-#if 0
-        int i;
-        printf("send spi message Succeed ret=%d\r\n",ret );
-        printf("SPI Send [Len:%d]: \r\n", len);
-        for (i = 0; i < len; i++)
-        {
-            if (i % 8 == 0)
-                printf("\r\n");
-            printf("0x%02X \r\n", TxBuf[i]);
-        }
-        printf("\n");
-        printf("SPI Receive [len:%d]:\n", len);
-        for (i = 0; i < len; i++)
-        {
-            if (i % 8 == 0)
-                printf("\r\n");
-            printf("0x%02X \r\n", RxBuf[i]);
-        }
-        printf("\n");
-#endif
+		CAN_STAT_INC(hal->stats.minor_faults, ru.ru_minflt - hal->stats.minor_faults);
+		CAN_STAT_INC(hal->stats.major_faults, ru.ru_majflt - hal->stats.major_faults);
 	}
-	return ret;
 }
 
-static uint8_t xor_calculate(struct spi_can_frame *frame)
+/*
+	SPI 两个方向都空闲时阻塞, 直到 MCU 拉 "数据就绪" 线、canhal_write 有新帧或者超时.
+	idle_waiting 置位后再检查一次发送队列, 与 canhal_write 的 "先入队后检查 idle_waiting" 配对,
+	保证不会在入队和阻塞之间丢掉唤醒
+*/
+static void can_hal_wait_event(struct canhal_instance *hal)
 {
-	uint8_t *p = (uint8_t *)frame;
-	uint8_t xor = 0;
-	for (int n = 0; n < (sizeof(struct spi_can_frame) - 1); n++)
+	uint64_t start_ns;
+
+	if (hal->tx_event_fd < 0)
+	{
+		start_ns = can_now_ns();
+		usleep(hal->idle_poll_ms * 1000);
+		can_record_wakeup(hal, 0, start_ns, can_now_ns());
+		return;
+	}
+
+	atomic_store(&hal->wake_req_ns, 0);
+	atomic_store(&hal->idle_waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (can_tx_pending(hal) || !hal->running)
+	{
+		atomic_store(&hal->idle_waiting, 0);
+		return;
+	}
+
+	// 传输后端同时等 MCU 的 "数据就绪" 和 tx_event_fd, 返回前会把两者都清掉
+	start_ns = can_now_ns();
+	int ret = can_transport_wait(hal->xport, hal->tx_event_fd, hal->idle_poll_ms);
+	can_record_wakeup(hal, ret, start_ns, can_now_ns());
+	atomic_store(&hal->idle_waiting, 0);
+	if (ret < 0)
 	{
-		xor ^= p[n];
+		blog_err("transport wait error, errno=%d\n", errno);
+		usleep(hal->idle_poll_ms * 1000);
 	}
-	return xor;
 }
 
-static bool xor_verify_ok(struct spi_can_frame *frame)
+/* 在 SPI 线程里应用 canhal_set_link 的请求, 失败时恢复原来的参数 */
+static void can_link_apply(struct canhal_instance *hal)
 {
-	uint8_t *p = (uint8_t *)frame;
-	uint8_t xor = 0;
+	struct can_link_request *req = &hal->link_req;
 
-	if (frame->head != HEAD_SIGN || frame->tail != TAIL_SIGN)
+	pthread_mutex_lock(&req->lock);
+	struct canhal_link old = hal->link;
+	struct canhal_link link = req->link;
+	req->result = can_transport_configure(hal->xport, &link);
+	if (req->result == 0)
 	{
-		// blog_dbg("head tail error\n");
-		// show_data_with_msg("raw fram:", frame, sizeof(*frame));
+		hal->link = link;
+		req->link = link;
+	}
+	else
+	{
+		can_transport_configure(hal->xport, &old);
+	}
+	atomic_store(&req->pending, 0);
+	pthread_cond_broadcast(&req->done);
+	pthread_mutex_unlock(&req->lock);
+}
 
-		return false;
+/* 让栈的前 CAN_STACK_PREFAULT 字节都有物理页, 运行中不会因为调用链变深而缺页 */
+static void __attribute__((noinline)) can_stack_prefault(void)
+{
+	volatile char stack[CAN_STACK_PREFAULT];
+	for (size_t off = 0; off < sizeof(stack); off += PREFAULT_PAGE_SIZE)
+		stack[off] = 0;
+}
+
+/*
+	状态传输: 只交换 SPI_STATUS_LENGTH 个字节, 问 MCU 还有多少字节要发.
+	返回待发字节数; 传输失败或应答无效时返回 -1, 调用者按一个槽位轮询
+*/
+static int can_spi_read_status(struct canhal_instance *hal)
+{
+	uint8_t tx[SPI_STATUS_LENGTH];
+	uint8_t rx[SPI_STATUS_LENGTH];
+
+	spi_status_make(tx, 0);
+	memset(rx, 0, sizeof(rx));
+	if (can_transport_transfer(hal->xport, tx, rx, SPI_STATUS_LENGTH, 1) < 0)
+	{
+		CAN_STAT_INC(hal->stats.spi_ioctl_errors, 1);
+		blog_err("spi status transfer failed, errno=%d\n", errno);
+		return -1;
 	}
+	CAN_STAT_INC(hal->stats.spi_status_transfers, 1);
+	CAN_STAT_INC(hal->stats.spi_bytes, SPI_STATUS_LENGTH);
 
-	xor = xor_calculate(frame);
-	// show_data_with_msg("raw fram:", frame, sizeof(*frame));
-	// blog_dbg("xor = %d\n", frame->xor_verify);
-	return frame->xor_verify == xor;
+	int pending = spi_status_parse(rx);
+	if (pending < 0)
+		CAN_STAT_INC(hal->stats.rx_xor_errors, 1);
+	return pending;
 }
 
 static void *can_hal_thread(void *arg)
 {
-	(void)arg;
-	static struct spi_can_frame rx_frame;
-	static struct spi_can_frame tx_frame;
+	struct canhal_instance *hal = arg;
+	struct spi_can_frame *rx_frames = hal->rx_frames;
+	struct spi_can_frame *tx_frames = hal->tx_frames;
+	struct can_thread_info *info = &hal->thread_info;
+
+	if (info->prefault && (info->stack_size == 0 || info->stack_size >= 2 * CAN_STACK_PREFAULT))
+		can_stack_prefault();
 
-	while (g_can_ctx.running)
+	// 申请的策略可能因为权限不足而回退, 以线程里看到的为准
+	struct sched_param param;
+	int policy;
+	if (pthread_getschedparam(pthread_self(), &policy, &param) == 0)
 	{
-		// 一直处理spi ，直到没有数据才退出
-		while (1)
+		__atomic_store_n(&info->sched_policy, policy, __ATOMIC_RELAXED);
+		__atomic_store_n(&info->sched_priority, param.sched_priority, __ATOMIC_RELAXED);
+	}
+
+	while (hal->running)
+	{
+		// 上一批收到过数据, 说明 MCU 可能还有积压, 下一批按满批量去取
+		int min_frames = 1;
+
+		// 一直处理spi ，直到没有数据才退出. MCU 持续有数据时也要能响应 canhal_close
+		while (hal->running)
 		{
 			int ret;
-			bool has_new_spi_frame = false;
-			bzero(&rx_frame, CAN_FRAME_LENGTH);
+			int tx_count;
+			int rx_count = 0;
 
-			if (ring_buffer_num_items(&g_can_ctx.gl_can_send_ring) >= CAN_FRAME_LENGTH)
-			{
-				// 如果有数据 需要写入 spi ， 那么就从 ringbuffer里读出来，放入 tx-frame
-				ring_buffer_dequeue_arr(&g_can_ctx.gl_can_send_ring, (char *)&tx_frame, CAN_FRAME_LENGTH);
-				// printf("send can id=0x%08x, dlc=%d\n", tx_frame.can_id, tx_frame.dlc);
-				// show_data_with_msg("send can", &tx_frame, sizeof(tx_frame));
-			}
-			else
+			if (atomic_load_explicit(&hal->link_req.pending, memory_order_acquire))
+				can_link_apply(hal);
+
+			// 没有要发的帧时先问 MCU 有多少数据, 两边都空就不再传输, 否则正好取这么多.
+			// 状态传输失败时这一轮退回原来的轮询方式
+			bool polling = !hal->pending_status;
+			if (hal->pending_status && !can_tx_pending(hal))
 			{
-				tx_frame.head = 0xff;
-				tx_frame.spi_addr = THIS_SPI_ADDR;
+				int pending = can_spi_read_status(hal);
+				if (pending == 0)
+					break;
+				polling = pending < 0;
+				min_frames = polling ? 1 : (pending + CAN_FRAME_LENGTH - 1) / CAN_FRAME_LENGTH;
 			}
-#if 1
-			ret = SPI_Transfer((const uint8_t *)&tx_frame, (uint8_t *)&rx_frame, CAN_FRAME_LENGTH);
 
+			int frames = can_spi_fill_tx_batch(hal, tx_frames, min_frames, &tx_count);
+
+			bzero(rx_frames, frames * CAN_FRAME_LENGTH);
+			ret = can_transport_transfer(hal->xport, tx_frames, rx_frames, CAN_FRAME_LENGTH, frames);
 			if (ret > 0)
 			{
-				int v = xor_verify_ok(&rx_frame);
-				if (v && rx_frame.ide && rx_frame.rtr == 0)
-				{
-					printf("can id=0x%04x dlc=%d payload=:\r\n", rx_frame.can_id, rx_frame.dlc);
-					// fprintf(stderr, "can id=0x%04x dlc=%d payload=:\r\n", rx_frame.can_id, rx_frame.dlc);
-					// show_data_with_msg("spi can payload=", &rx_frame, sizeof(rx_frame));
-					if (rx_frame.spi_addr < CAN_SPI_MAX_CHANNEL)
-					{
-						buffer_helper_loop(global_bh[rx_frame.spi_addr], (char *)&rx_frame, sizeof(rx_frame));
-						has_new_spi_frame = true;
-					}
-					else
-					{
-						printf("spi error 1\n");
-					}
-				}
+				CAN_STAT_INC(hal->stats.spi_transfers, 1);
+				CAN_STAT_INC(hal->stats.spi_bytes, (uint64_t)frames * CAN_FRAME_LENGTH);
+				hal->rx_xfer_ns = can_now_ns();
+				for (int n = 0; n < tx_count; n++)
+					latency_hist_record(&hal->latency[CANHAL_LAT_TX_QUEUE], hal->rx_xfer_ns - hal->tx_enqueue_ns[n]);
+				if (hal->rx_compact)
+					rx_count = can_spi_parse_rx_compact(hal, rx_frames, frames);
 				else
-				{
-					printf("sssstep, %d, %d, %d\n", v,rx_frame.ide, rx_frame.rtr);
-					// show_data_with_msg("fuck", &rx_frame, CAN_FRAME_LENGTH);
-				}
+					rx_count = can_spi_parse_rx_batch(hal, rx_frames, frames);
 			}
 			else
 			{
-				printf("spi error 2\n");
+				CAN_STAT_INC(hal->stats.spi_ioctl_errors, 1);
+				blog_err("spi transfer of %d frames failed, errno=%d\n", frames, errno);
 			}
-#endif
+			// 这一批已经处理完, 不再引用过滤器表, 让写者可以回收旧表
+			for (int ch = 0; ch < hal->channels; ch++)
+				can_filter_quiescent(hal->chan[ch].filters);
+			if (hal->dispatch != NULL)
+				can_dispatch_kick(hal->dispatch);
 
-			if (ring_buffer_num_items(&g_can_ctx.gl_can_send_ring) < CAN_FRAME_LENGTH &&
-				has_new_spi_frame == false)
+			// 还有没收全的长帧时 MCU 那边一定还有数据
+			min_frames = (rx_count > 0 || hal->rx_carry > 0) ? hal->batch_frames : 1;
+			if (polling && !can_tx_pending(hal) && rx_count == 0 && hal->rx_carry == 0)
 			{
 				// printf("break spi\n");
 				break;
@@ -213,228 +839,1035 @@ static void *can_hal_thread(void *arg)
 
 		} // end of while(1) for loop read spi
 
-		usleep(10000);
+		can_hal_wait_event(hal);
 	}
 	return NULL;
 }
 
-static bool driver_can_spi_send_channel(uint8_t can_channel, struct can_frame *frame)
+static bool driver_can_spi_send_channel(struct canhal_instance *hal, uint8_t can_channel, struct can_frame *frame, enum canhal_tx_prio prio)
 {
-    // if ( can_channel >= CAN_SPI_MAX_CHANNEL)
-    //     return false;
+    bool fd = frame->flags & CANHAL_FRAME_FD;
+    if (can_channel >= hal->channels || (fd && !hal->can_fd))
+        return false;
+
+    struct can_tx_item item;
+    struct spi_can_frame *spi_frame = &item.frame;
+    uint8_t dlc;
+    uint32_t len;
+
+    if (fd)
+    {
+        dlc = can_fd_len_to_dlc(frame->can_dlc);
+        len = can_fd_dlc_to_len(dlc);
+    }
+    else
+    {
+        dlc = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+        len = dlc;
+    }
 
-    struct spi_can_frame spi_frame;
-    spi_frame.head = HEAD_SIGN;
-    spi_frame.tail = TAIL_SIGN;
-    spi_frame.dlc = frame->can_dlc;
-    spi_frame.can_id = frame->can_id;
-    memcpy(spi_frame.payload, frame->payload, frame->can_dlc);
-    spi_frame.rtr = frame->rtr;
-    spi_frame.ide = frame->extended_id;
-    spi_frame.spi_addr = can_channel;
+    memset(item.wire, 0, CAN_FRAME_LENGTH - 8 + (len > 8 ? len : 8));
+    spi_frame->head = HEAD_SIGN;
+    spi_frame->dlc = dlc;
+    spi_frame->can_id = frame->can_id & SPI_FRAME_ID_MASK;
+    if (fd)
+    {
+        spi_frame->can_id |= SPI_FRAME_ID_FD;
+        if (frame->flags & CANHAL_FRAME_BRS)
+            spi_frame->can_id |= SPI_FRAME_ID_BRS;
+        if (frame->flags & CANHAL_FRAME_ESI)
+            spi_frame->can_id |= SPI_FRAME_ID_ESI;
+    }
+    // FD 帧超过 8 字节的 payload 直接接在 payload 后面
+    memcpy(spi_frame->payload, frame->payload, frame->can_dlc < len ? frame->can_dlc : len);
+    spi_frame->rtr = frame->rtr;
+    spi_frame->ide = frame->extended_id;
+    spi_frame_set_channel(spi_frame, can_channel);
 
-    spi_frame.xor_verify = xor_calculate(&spi_frame);
+    spi_frame_seal(spi_frame, hal->integrity);
 
-    ring_buffer_safe_queue_arr(
-        &g_can_ctx.gl_can_send_ring, 
-        (const char*)&spi_frame, 
-        sizeof(struct spi_can_frame)
-    );
+    item.enqueue_ns = can_now_ns();
+    frame->ts_enqueue_ns = item.enqueue_ns;
+
+    // 整帧入队, 通道满时丢弃
+    if (!mpmc_queue_push(hal->chan[can_channel].tx_lanes[prio], &item))
+    {
+        CAN_STAT_ADD_SHARED(hal->chan[can_channel].stats.tx_dropped, 1);
+        return false;
+    }
     return true;
 }
 
-static bool driver_can_find_filter(uint32_t can_id, drv_can_filter_callback *cb, void **context)
+static bool driver_can_find_filter(struct can_channel *chan, uint32_t can_id, bool extended, drv_can_filter_callback *cb, void **context)
 {
-	for (int n = 0; n < ARRAY_MEMBER_COUNT(global_can_filter); n++)
-	{
-		if ((can_id & global_can_filter[n].mask) == global_can_filter[n].can_id)
-		{
-			*cb = global_can_filter[n].callback;
-			*context = global_can_filter[n].context;
-			return true;
-		}
-	}
-	return false;
+	return can_filter_find(chan->filters, can_id, extended, cb, context);
 }
 
-static void spican_frame_callback(uint8_t *can_raw_data, int len, void *useless)
+static void spican_frame_callback(uint8_t *can_raw_data, int len, void *userdata)
 {
-	struct spi_can_frame *frame = (struct spi_can_frame *)can_raw_data;
+	struct can_channel *chan = userdata;
+	struct canhal_instance *hal = chan->hal;
+	const struct spi_can_frame *frame = (const struct spi_can_frame *)can_raw_data;
+	uint32_t wire_id;
+	const uint8_t *payload;
+	size_t payload_len;
+
+	// 两种格式的前两个字节相同; 紧凑帧不展开, ID 和 payload 直接从输入里取, payload 只拷贝一次
+	if (hal->rx_compact)
+	{
+		payload = can_raw_data + spi_compact_id(can_raw_data, &wire_id);
+		payload_len = spi_compact_data_len(frame->dlc, wire_id & SPI_FRAME_ID_FD);
+	}
+	else
+	{
+		wire_id = frame->can_id;
+		payload = frame->payload;
+		// 线上至少有 8 字节 payload, FD 长帧的其余部分紧跟在后面, 帧尾两个字节不属于 payload
+		payload_len = len - CAN_FRAME_LENGTH + 8;
+	}
+	uint32_t can_id = wire_id & (frame->ide ? SPI_FRAME_ID_MASK : SPI_FRAME_STD_ID_MASK);
+
+	// 每个收到的帧都先放进发布缓冲区, 本批解析完后统一发到读 socket.
+	// 紧凑格式一次传输能解出的帧比槽位多, 缓冲区满了先发布一次, 不丢帧
+	if (hal->rx_pub_count == CAN_SPI_BATCH_MAX)
+		can_rx_publish_flush(hal);
+	struct can_frame *can = &hal->rx_pub[hal->rx_pub_count];
+	can->can_dlc = (wire_id & SPI_FRAME_ID_FD) ? can_fd_dlc_to_len(frame->dlc) : frame->dlc;
+	can->can_id = can_id;
+	can->extended_id = frame->ide;
+	can->rtr = frame->rtr;
+	can->channel = chan->index;
+	can->flags = 0;
+	if (wire_id & SPI_FRAME_ID_FD)
+	{
+		can->flags = CANHAL_FRAME_FD;
+		if (wire_id & SPI_FRAME_ID_BRS)
+			can->flags |= CANHAL_FRAME_BRS;
+		if (wire_id & SPI_FRAME_ID_ESI)
+			can->flags |= CANHAL_FRAME_ESI;
+	}
+	memcpy(can->payload, payload, payload_len);
+	// 紧凑格式的经典帧只带 dlc 个字节, 和槽位格式一样补齐到 8 字节, 不把上一帧的数据带出去
+	if (payload_len < 8)
+		memset(can->payload + payload_len, 0, 8 - payload_len);
+	can->ts_enqueue_ns = 0;
+	can->ts_xfer_ns = hal->rx_xfer_ns;
+	can->ts_deliver_ns = 0;
+	CAN_STAT_INC(chan->stats.rx_bytes, can->can_dlc);
+	hal->rx_pub_count++;
+
+	bool boxed = hal->mailboxes != NULL && can_mailbox_update(hal->mailboxes, can);
 
 	drv_can_filter_callback callback;
 	void *context;
-	if (driver_can_find_filter(frame->can_id, &callback, &context))
+	if (driver_can_find_filter(chan, can_id, frame->ide, &callback, &context))
 	{
-		if (callback != NULL)
+		if (callback != NULL && hal->dispatch != NULL)
 		{
-
-			struct can_frame can;
-			can.can_dlc = frame->dlc;
-			can.can_id = frame->can_id;
-			can.extended_id = frame->ide;
-			can.rtr = frame->rtr;
-			memcpy(can.payload, frame->payload, 8);
-
-			callback(context, &can);
+			// 工作线程回调时记录延迟和 ts_deliver_ns
+			can_dispatch_push(hal->dispatch, callback, context, can);
+		}
+		else if (callback != NULL)
+		{
+			can->ts_deliver_ns = can_now_ns();
+			latency_hist_record(&hal->latency[CANHAL_LAT_RX_CALLBACK], can->ts_deliver_ns - can->ts_xfer_ns);
+			callback(context, can);
 		}
 	}
-	else
+	else if (!boxed)
 	{
-		printf("unknown can id=0x%08x\n", frame->can_id);
+		CAN_STAT_INC(chan->stats.rx_unmatched, 1);
+		blog_dbg("unknown can id=0x%08x\n", can_id);
 	}
 }
 
-static int SPI_Open(void)
+static bool can_transport_open(struct canhal_instance *hal, const struct canhal_options *opts)
 {
-	int fd = g_can_ctx.spi_fd;
-	int ret = 0;
-	if (fd >= 0) /* 设备已打开 */
-		return 0xF1;
-	fd = open(device, O_RDWR);
-	if (fd < 0)
-		printf("can't open device\n");
+	if (opts->transport != NULL)
+	{
+		hal->xport = opts->transport;
+	}
 	else
-		printf("SPI - Open Succeed. Start Init SPI...\n");
-	g_can_ctx.spi_fd = fd;
-
-	ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
-	if (ret == -1)
-		printf("can't set spi mode\n");
-	ret = ioctl(fd, SPI_IOC_RD_MODE, &mode);
-	if (ret == -1)
-		printf("can't get spi mode\n");
-
-	/*
-	 * bits per word
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		printf("can't set bits per word\n");
-	ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		printf("can't get bits per word\n");
-	/*
-	 * max speed hz
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		printf("can't set max speed hz\n");
-	ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		printf("can't get max speed hz\n");
-
-	// printf("spi mode: %d\n", mode);
-	printf("bits per word: %d\n", bits);
-	printf("max speed: %d KHz (%d MHz)\n", speed / 1000, speed / 1000 / 1000);
-	return ret;
-}
-
-static bool init_drv_can_spi(const char *dev)
-{
-	uint8_t frame_head[CAN_FRAME_HEAD_LENGTH] = {0x7e};
-
-	int ret = SPI_Open();
-	if (ret == 0)
-	{
-		// TODO 根据协议设置
-		struct buffer_helper_meta buffer_meta = {
-			.frame_head = frame_head,
-			.frame_head_size = CAN_FRAME_HEAD_LENGTH,
-			.frame_size = CAN_FRAME_LENGTH,
+	{
+		struct can_spidev_params params = {
+			.device = hal->device,
+			.irq_gpiochip = opts->irq_gpiochip,
+			.irq_gpio_line = opts->irq_gpio_line,
+			.irq_rising_edge = opts->irq_rising_edge,
+			.irq_fd = opts->irq_fd,
 		};
+		hal->xport = can_transport_spidev_open(&params);
+		if (hal->xport == NULL)
+			return false;
+	}
+	hal->link = opts->link;
+	if (hal->link.bits == 0)
+		hal->link.bits = CAN_SPI_BITS_DEFAULT;
+	if (hal->link.speed_hz == 0)
+		hal->link.speed_hz = CAN_SPI_SPEED_DEFAULT;
+	return can_transport_configure(hal->xport, &hal->link) == 0;
+}
+
+/*
+	buffer_helper 读完帧的固定部分后调用: 槽位格式下经典帧到此为止, FD 长帧还要再读 payload 超出 8 字节的部分;
+	紧凑格式下固定部分只有 SPI_COMPACT_HEAD_LENGTH 个字节, 其余按包头算出
+*/
+static int spican_payload_len(struct buffer_helper *bh)
+{
+	const struct can_channel *chan = buffer_helper_get_userdata(bh);
+	const uint8_t *raw = buffer_helper_get_frame(bh);
 
-		global_bh[0] = buffer_helper_new(&buffer_meta, spican_frame_callback, NULL);
-		buffer_helper_set_name(global_bh[0], "spi_can");
+	if (chan->hal->rx_compact)
+		return spi_compact_length(raw, chan->hal->integrity) - SPI_COMPACT_HEAD_LENGTH;
+	return spi_frame_length((const struct spi_can_frame *)raw) - CAN_FRAME_LENGTH;
+}
 
-		ring_buffer_init(&g_can_ctx.gl_can_send_ring, can_send_buf, CAN_CACHE_SIZE);
+static bool init_drv_can_spi(struct canhal_instance *hal)
+{
+	uint8_t frame_head[CAN_FRAME_HEAD_LENGTH] = {HEAD_SIGN};
 
-		return true;
+	// TODO 根据协议设置
+	struct buffer_helper_meta buffer_meta = {
+		.frame_head = frame_head,
+		.frame_head_size = CAN_FRAME_HEAD_LENGTH,
+		.frame_size = CAN_FRAME_LENGTH,
+	};
+
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		char name[16];
+		hal->chan[ch].bh = buffer_helper_new(&buffer_meta, spican_frame_callback, &hal->chan[ch]);
+		if (hal->chan[ch].bh == NULL)
+			return false;
+		snprintf(name, sizeof(name), "spi_can%d", ch);
+		buffer_helper_set_name(hal->chan[ch].bh, name);
+		buffer_helper_set_payload_callback(hal->chan[ch].bh, spican_payload_len);
 	}
+	return true;
+}
+
+/* 在 ACK 可能错位的两个槽位里找 MCU 的 ACK, 返回它接受的能力位图, 没找到返回 -1 */
+static int can_wire_find_ack(const struct canhal_instance *hal, const uint8_t *window, size_t len)
+{
+	for (size_t off = 0; off + CAN_FRAME_LENGTH <= len; off++)
+	{
+		const struct spi_can_frame *frame = (const struct spi_can_frame *)(window + off);
+		if (spi_ctrl_verify(frame, hal->integrity) && frame->payload[0] == SPI_CTRL_ACK)
+			return frame->payload[1];
+	}
+	return -1;
+}
+
+/*
+	和 MCU 协商 wanted 里的能力 (SPI_CAP_*), 在 SPI 线程启动之前用单槽位传输完成 (过程见 can_spi_frame.h).
+	HELLO 最多发 CAN_WIRE_HELLO_TRIES 次, 每次等 CAN_WIRE_ACK_XFERS 次传输.
+	老固件不应答时保持槽位格式和原来的轮询方式; 协商期间 MCU 发来的数据帧丢弃
+*/
+static void can_wire_negotiate(struct canhal_instance *hal, uint8_t wanted)
+{
+	uint8_t window[2 * CAN_FRAME_LENGTH];
+	struct spi_can_frame tx;
+	int caps = -1;
+
+	memset(window, 0, sizeof(window));
+	for (int attempt = 0; attempt < CAN_WIRE_HELLO_TRIES && caps < 0; attempt++)
+	{
+		spi_ctrl_make(&tx, SPI_CTRL_HELLO, wanted, hal->integrity);
+		for (int n = 0; n < CAN_WIRE_ACK_XFERS && caps < 0; n++)
+		{
+			if (can_transport_transfer(hal->xport, &tx, window + CAN_FRAME_LENGTH, CAN_FRAME_LENGTH, 1) < 0)
+			{
+				printf("spi transfer failed during wire negotiation, keep 16-byte frames\n");
+				return;
+			}
+			caps = can_wire_find_ack(hal, window, sizeof(window));
+			memmove(window, window + CAN_FRAME_LENGTH, CAN_FRAME_LENGTH);
+			memset(&tx, 0, sizeof(tx));
+			tx.head = IDLE_SIGN;
+			tx.spi_addr = THIS_SPI_ADDR;
+			can_transport_wait(hal->xport, -1, CAN_WIRE_POLL_MS);
+		}
+	}
+
+	if (caps < 0)
+	{
+		printf("mcu did not answer wire negotiation, keep 16-byte frames\n");
+		return;
+	}
+	caps &= wanted;
+	if (caps != wanted)
+		printf("mcu declined wire capabilities 0x%02x\n", wanted & ~caps);
+	if (caps == 0)
+		return;
+
+	// MCU 从 ACK 之后已经按它接受的格式发送, 主机的发送方向等 COMMIT 发出去以后再切换
+	hal->rx_compact = caps & SPI_CAP_COMPACT;
+	if (hal->rx_compact)
+	{
+		struct buffer_helper_meta meta = {
+			.frame_head_size = CAN_FRAME_HEAD_LENGTH,
+			.frame_size = SPI_COMPACT_HEAD_LENGTH,
+		};
+		for (int ch = 0; ch < hal->channels; ch++)
+			buffer_helper_update_meta(hal->chan[ch].bh, &meta);
+	}
+
+	spi_ctrl_make(&tx, SPI_CTRL_COMMIT, caps, hal->integrity);
+	if (can_transport_transfer(hal->xport, &tx, window, CAN_FRAME_LENGTH, 1) < 0)
+	{
+		// MCU 没收到 COMMIT, 仍然按槽位格式解析主机发的帧, 也不认状态传输, 只有接收方向使用紧凑格式
+		printf("spi transfer failed sending wire commit, %s\n",
+		       hal->rx_compact ? "compact format only for rx" : "keep polling");
+		return;
+	}
+	hal->tx_compact = caps & SPI_CAP_COMPACT;
+	hal->pending_status = caps & SPI_CAP_PENDING;
+	if (hal->tx_compact)
+		printf("using compact wire format\n");
+	if (hal->pending_status)
+		printf("using pending-count status transfers\n");
+}
+
+static void can_event_close(struct canhal_instance *hal)
+{
+	if (hal->tx_event_fd >= 0)
+		close(hal->tx_event_fd);
+	hal->tx_event_fd = -1;
+}
+
+static bool can_event_open(struct canhal_instance *hal, const struct canhal_options *opts)
+{
+	hal->tx_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (hal->tx_event_fd < 0)
+		perror("eventfd error, fall back to polling");
+
+	if (opts->idle_poll_ms != 0)
+		hal->idle_poll_ms = opts->idle_poll_ms;
 	else
-		return false;
+		hal->idle_poll_ms = hal->xport->has_data_irq ? CAN_IDLE_POLL_MS_IRQ : CAN_IDLE_POLL_MS_DEFAULT;
+	return true;
+}
+
+void canhal_options_init(struct canhal_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->batch_frames = CAN_SPI_BATCH_DEFAULT;
+	opts->irq_fd = -1;
+	opts->link.mode = CAN_SPI_MODE_DEFAULT;
+	opts->link.bits = CAN_SPI_BITS_DEFAULT;
+	opts->link.speed_hz = CAN_SPI_SPEED_DEFAULT;
+	opts->link.delay_us = CAN_SPI_DELAY_DEFAULT;
 }
 
 bool canhal_init(canhal_ctx *context, const char *device)
 {
-	init_drv_can_spi(device);
+	return canhal_init_ex(context, device, NULL);
+}
+
+static void can_channel_close(struct can_channel *chan)
+{
+	buffer_helper_free(chan->bh);
+	chan->bh = NULL;
+	can_filter_table_free(chan->filters);
+	chan->filters = NULL;
+	can_tx_sched_free(chan->tx_sched);
+	chan->tx_sched = NULL;
+	for (int prio = 0; prio < CANHAL_TX_PRIO_COUNT; prio++)
+	{
+		mpmc_queue_free(chan->tx_lanes[prio]);
+		chan->tx_lanes[prio] = NULL;
+	}
+}
+
+static bool can_channel_open(struct can_channel *chan, const struct canhal_options *opts)
+{
+	size_t item_size = opts->can_fd ? sizeof(struct can_tx_item) : CAN_TX_ITEM_CLASSIC_SIZE;
+	size_t frames = CAN_TX_LANE_FRAMES_DEFAULT;
+	if (opts->tx_lane_frames != 0)
+	{
+		frames = 2;
+		while (frames < opts->tx_lane_frames)
+			frames <<= 1;
+	}
+
+	for (int prio = 0; prio < CANHAL_TX_PRIO_COUNT; prio++)
+	{
+		chan->tx_lanes[prio] = mpmc_queue_new(frames, item_size);
+		if (chan->tx_lanes[prio] == NULL)
+		{
+			perror("can't alloc tx lane");
+			return false;
+		}
+	}
+
+	if (opts->tx_sched)
+	{
+		uint32_t sched_frames = opts->tx_sched_frames ? opts->tx_sched_frames : CAN_TX_SCHED_FRAMES_DEFAULT;
+		uint32_t starve_us = opts->tx_sched_max_starve_us ? opts->tx_sched_max_starve_us : CAN_TX_SCHED_STARVE_US_DEFAULT;
+		chan->tx_sched = can_tx_sched_new(sched_frames, item_size, (uint64_t)starve_us * 1000);
+		if (chan->tx_sched == NULL)
+		{
+			perror("can't alloc tx scheduler");
+			return false;
+		}
+	}
+
+	chan->filters = can_filter_table_new();
+	return chan->filters != NULL;
+}
+
+/* 释放实例及其申请的全部资源, 可以在初始化的任意阶段调用, 调用前 SPI 线程必须已经退出 */
+static void can_hal_release(struct canhal_instance *hal)
+{
+	// 最先停工作线程: 它们回调完队列里剩下的帧才退出, 回调期间用户代码还可能访问过滤器、邮箱等资源
+	can_dispatch_free(hal->dispatch);
+	hal->dispatch = NULL;
+	for (int ch = 0; ch < CAN_SPI_MAX_CHANNEL; ch++)
+		can_channel_close(&hal->chan[ch]);
+	can_shm_ring_free(hal->rx_shm);
+	hal->rx_shm = NULL;
+	can_mailbox_table_free(hal->mailboxes);
+	hal->mailboxes = NULL;
+	can_event_close(hal);
+	can_transport_close(hal->xport);
+	if (hal->sock_fd >= 0)
+		close(hal->sock_fd);
+	pthread_cond_destroy(&hal->link_req.done);
+	pthread_mutex_destroy(&hal->link_req.lock);
+	pthread_mutex_destroy(&hal->link_req.serialize);
+	free(hal);
+}
+
+static struct canhal_instance *can_hal_alloc(const char *device)
+{
+	struct canhal_instance *hal = calloc(1, sizeof(struct canhal_instance));
+	if (hal == NULL)
+		return NULL;
+	snprintf(hal->device, sizeof(hal->device), "%s", device ? device : CAN_SPI_DEVICE_DEFAULT);
+	hal->sock_fd = -1;
+	hal->tx_event_fd = -1;
+	hal->batch_frames = 1;
+	hal->idle_poll_ms = CAN_IDLE_POLL_MS_DEFAULT;
+	hal->rx_frames = (struct spi_can_frame *)(hal->rx_stream + CAN_RX_CARRY_MAX);
+	pthread_mutex_init(&hal->link_req.serialize, NULL);
+	pthread_mutex_init(&hal->link_req.lock, NULL);
+	pthread_cond_init(&hal->link_req.done, NULL);
+	for (int stage = 0; stage < CANHAL_LAT_STAGE_COUNT; stage++)
+		latency_hist_reset(&hal->latency[stage]);
+	return hal;
+}
 
-	int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+/*
+	读 socket 绑定在抽象命名空间 "can_hal:<设备路径>" 上并连接到自己,
+	每个实例一个名字, 同一进程里的多个实例互不冲突
+*/
+static bool can_sock_open(struct canhal_instance *hal)
+{
+	int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	if (sock < 0)
 	{
 		perror("socket error");
-		close(g_can_ctx.spi_fd);
 		return false;
 	}
+	hal->sock_fd = sock;
 
 	struct sockaddr_un addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, "\0can_hal", sizeof(addr.sun_path) - 1);
-	size_t addr_len = sizeof(sa_family_t) + strlen("can_hal") + 1;
+	int name_len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "can_hal:%s", hal->device);
+	if (name_len > (int)sizeof(addr.sun_path) - 1)
+		name_len = sizeof(addr.sun_path) - 1;
+	socklen_t addr_len = sizeof(sa_family_t) + 1 + name_len;
 
 	if (bind(sock, (struct sockaddr *)&addr, addr_len) < 0)
 	{
 		perror("bind error");
-		close(sock);
-		close(g_can_ctx.spi_fd);
 		return false;
 	}
 
 	if (connect(sock, (struct sockaddr *)&addr, addr_len) < 0)
 	{
 		perror("connect error");
-		close(sock);
-		close(g_can_ctx.spi_fd);
 		return false;
 	}
-	g_can_ctx.sock_fd = sock;
 
-	if (pthread_create(&g_can_ctx.thread, NULL, can_hal_thread, NULL) != 0)
+	int sndbuf = CAN_SOCK_SNDBUF;
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+		perror("can't set socket sndbuf");
+	return true;
+}
+
+/* 访问一遍 SPI 线程会用到的所有缓冲区, 发送通道的槽位在 mpmc_queue_new 里已经逐个写过 */
+static void can_hal_prefault(struct canhal_instance *hal)
+{
+	prefault_range(hal, sizeof(*hal));
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		buffer_helper_prefault(hal->chan[ch].bh);
+		if (hal->chan[ch].tx_sched != NULL)
+			can_tx_sched_prefault(hal->chan[ch].tx_sched);
+	}
+	can_shm_ring_prefault(hal->rx_shm);
+}
+
+/*
+	按选项创建 SPI 线程. 实时策略需要 CAP_SYS_NICE 或 RLIMIT_RTPRIO,
+	没有权限时打印警告并回退到继承调用者的调度策略, 实际值从 canhal_get_stats 里看
+*/
+static bool can_thread_start(struct canhal_instance *hal, const struct canhal_options *opts)
+{
+	pthread_attr_t attr;
+	bool rt = opts->sched_policy == SCHED_FIFO || opts->sched_policy == SCHED_RR;
+	int ret;
+
+	pthread_attr_init(&attr);
+	if (opts->stack_size != 0 && pthread_attr_setstacksize(&attr, opts->stack_size) != 0)
+		printf("invalid stack size %zu, using default\n", opts->stack_size);
+	else
+		hal->thread_info.stack_size = opts->stack_size;
+
+	if (opts->cpu_affinity != 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (int cpu = 0; cpu < 32; cpu++)
+		{
+			if (opts->cpu_affinity & (1u << cpu))
+				CPU_SET(cpu, &cpus);
+		}
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	if (rt)
 	{
+		struct sched_param param = {.sched_priority = opts->sched_priority};
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, opts->sched_policy);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	ret = pthread_create(&hal->thread, &attr, can_hal_thread, hal);
+	if (ret == EPERM && rt)
+	{
+		printf("no permission for realtime policy %d priority %d, falling back\n", opts->sched_policy, opts->sched_priority);
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(&hal->thread, &attr, can_hal_thread, hal);
+	}
+	pthread_attr_destroy(&attr);
+	if (ret != 0)
+	{
+		errno = ret;
 		perror("pthread_create error");
-		close(sock);
-		close(g_can_ctx.spi_fd);
 		return false;
 	}
-	g_can_ctx.running = 1;
+	pthread_setname_np(hal->thread, "can_hal");
+	return true;
+}
+
+bool canhal_init_ex(canhal_ctx *context, const char *device, const struct canhal_options *opts)
+{
+	struct canhal_options def_opts;
+	if (opts == NULL)
+	{
+		canhal_options_init(&def_opts);
+		opts = &def_opts;
+	}
+
+	struct canhal_instance *hal = can_hal_alloc(device);
+	if (hal == NULL)
+	{
+		can_transport_close(opts->transport);
+		return false;
+	}
+	hal->can_fd = opts->can_fd;
+	hal->channels = opts->channels == 0 ? 1 : opts->channels;
+	if (hal->channels > CAN_SPI_MAX_CHANNEL)
+		hal->channels = CAN_SPI_MAX_CHANNEL;
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		hal->chan[ch].hal = hal;
+		hal->chan[ch].index = ch;
+		if (!can_channel_open(&hal->chan[ch], opts))
+		{
+			can_hal_release(hal);
+			return false;
+		}
+	}
+
+	if (!can_transport_open(hal, opts) || !init_drv_can_spi(hal))
+	{
+		can_hal_release(hal);
+		return false;
+	}
+	hal->batch_frames = can_spi_batch_limit(hal, opts->batch_frames);
+	hal->integrity = opts->integrity == CANHAL_INTEGRITY_CRC16 ? CANHAL_INTEGRITY_CRC16 : CANHAL_INTEGRITY_XOR;
+	uint8_t wanted = (opts->compact_wire ? SPI_CAP_COMPACT : 0) | (opts->pending_status ? SPI_CAP_PENDING : 0);
+	if (wanted != 0)
+		can_wire_negotiate(hal, wanted);
+	if (!can_event_open(hal, opts))
+	{
+		can_hal_release(hal);
+		return false;
+	}
+
+	if (opts->shm_rx_slots != 0)
+	{
+		// 环至少能放下两批, 读者才有机会在被套圈前读完一批
+		uint32_t slots = opts->shm_rx_slots < CAN_SPI_BATCH_MAX * 2 ? CAN_SPI_BATCH_MAX * 2 : opts->shm_rx_slots;
+		hal->rx_shm = can_shm_ring_new(slots);
+		if (hal->rx_shm == NULL)
+		{
+			can_hal_release(hal);
+			return false;
+		}
+	}
+
+	if (opts->mailboxes != 0)
+	{
+		hal->mailboxes = can_mailbox_table_new(opts->mailboxes);
+		if (hal->mailboxes == NULL)
+		{
+			perror("can't alloc mailboxes");
+			can_hal_release(hal);
+			return false;
+		}
+	}
+
+	if (opts->dispatch_workers != 0)
+	{
+		struct can_dispatch_params dp = {
+			.workers = opts->dispatch_workers > CANHAL_DISPATCH_MAX_WORKERS ? CANHAL_DISPATCH_MAX_WORKERS : opts->dispatch_workers,
+			.queue_frames = opts->dispatch_queue_frames ? opts->dispatch_queue_frames : CAN_DISPATCH_QUEUE_FRAMES_DEFAULT,
+			.overflow = opts->dispatch_overflow,
+			.cpu_affinity = opts->dispatch_cpu_affinity,
+			.callback_latency = &hal->latency[CANHAL_LAT_RX_CALLBACK],
+		};
+		hal->dispatch = can_dispatch_new(&dp);
+		if (hal->dispatch == NULL)
+		{
+			perror("can't start dispatch workers");
+			can_hal_release(hal);
+			return false;
+		}
+	}
+
+	if (!can_sock_open(hal))
+	{
+		can_hal_release(hal);
+		return false;
+	}
+
+	if (opts->mlock_all)
+	{
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+			hal->thread_info.mem_locked = true;
+		else
+			perror("mlockall error");
+	}
+	hal->thread_info.prefault = opts->prefault;
+	if (opts->prefault)
+		can_hal_prefault(hal);
+
+	// 必须在创建线程前置位, 否则线程可能看到 running == 0 直接退出
+	hal->running = 1;
+	if (!can_thread_start(hal, opts))
+	{
+		hal->running = 0;
+		can_hal_release(hal);
+		return false;
+	}
 
 	if (context)
 	{
-		*context = (canhal_ctx)&g_can_ctx;
+		*context = (canhal_ctx)hal;
 	}
 	return true;
 }
 
 void canhal_close(canhal_ctx ctx)
 {
-	if (!ctx)
+	struct canhal_instance *hal = ctx;
+	if (!hal)
 		return;
-	g_can_ctx.running = 0;
-	pthread_join(g_can_ctx.thread, NULL);
-	if (g_can_ctx.spi_fd >= 0)
-		close(g_can_ctx.spi_fd);
-	if (g_can_ctx.sock_fd >= 0)
-		close(g_can_ctx.sock_fd);
-	g_can_ctx.spi_fd = -1;
-	g_can_ctx.sock_fd = -1;
+	hal->running = 0;
+	can_event_notify(hal);
+	pthread_join(hal->thread, NULL);
+	can_hal_release(hal);
+}
+
+bool canhal_is_open(canhal_ctx ctx)
+{
+	struct canhal_instance *hal = ctx;
+	return hal != NULL && hal->xport != NULL && hal->running;
+}
+
+bool canhal_write_prio(canhal_ctx ctx, struct can_frame *frame, enum canhal_tx_prio prio)
+{
+	return canhal_write_channel(ctx, 0, frame, prio);
+}
+
+bool canhal_write_channel(canhal_ctx ctx, uint8_t channel, struct can_frame *frame, enum canhal_tx_prio prio)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || hal->xport == NULL)
+		return false;
+	if ((unsigned)prio >= CANHAL_TX_PRIO_COUNT)
+		prio = CANHAL_TX_PRIO_LOW;
+
+	if (!driver_can_spi_send_channel(hal, channel, frame, prio))
+		return false;
+
+	// SPI 线程正在空闲等待时才需要一次 eventfd 写, 忙时不产生额外的系统调用
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&hal->idle_waiting))
+		can_event_wake(hal);
+	return true;
 }
 
 void canhal_write(canhal_ctx ctx, void *data, uint32_t data_len)
 {
-	if (!ctx)
+	struct canhal_instance *hal = ctx;
+	struct can_frame frame;
+	if (!hal || !data || data_len < offsetof(struct can_frame, payload))
 		return;
-	if (g_can_ctx.spi_fd >= 0)
+
+	// 只读调用者给出的 data_len 个字节, 老调用者的帧结构可能没有后面的 FD payload 和时间戳
+	memset(&frame, 0, sizeof(frame));
+	memcpy(&frame, data, data_len < sizeof(frame) ? data_len : sizeof(frame));
+	if (data_len < sizeof(frame))
 	{
-		if (driver_can_spi_send_channel(0, data) != 1)
+		// 老结构里 channel 和 flags 的位置是没有初始化的填充字节, 不能当成 FD 标志
+		frame.channel = 0;
+		frame.flags = 0;
+	}
+	uint32_t dlen = frame.can_dlc < CANHAL_FD_MAX_DLEN ? frame.can_dlc : CANHAL_FD_MAX_DLEN;
+	if (data_len < offsetof(struct can_frame, payload) + dlen)
+		return;
+	// 队列满时丢弃, 计入 tx_dropped
+	if (hal->xport != NULL)
+		canhal_write_prio(ctx, &frame, CANHAL_TX_PRIO_NORMAL);
+}
+
+/* 过滤器编号的高 8 位是通道号, 低 24 位是该通道过滤器表里的编号 */
+#define CAN_FILTER_ID_CHANNEL_SHIFT (24)
+
+int canhal_add_filter(canhal_ctx ctx, uint32_t can_id, bool extended, uint32_t mask,
+					  drv_can_filter_callback callback, void *context)
+{
+	return canhal_add_channel_filter(ctx, 0, can_id, extended, mask, callback, context);
+}
+
+int canhal_add_channel_filter(canhal_ctx ctx, uint8_t channel, uint32_t can_id, bool extended, uint32_t mask,
+							  drv_can_filter_callback callback, void *context)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || channel >= hal->channels)
+		return -1;
+	int id = can_filter_add(hal->chan[channel].filters, can_id, extended, mask, callback, context);
+	if (id < 0 || id >= (1 << CAN_FILTER_ID_CHANNEL_SHIFT))
+		return -1;
+	return (channel << CAN_FILTER_ID_CHANNEL_SHIFT) | id;
+}
+
+bool canhal_remove_filter(canhal_ctx ctx, int filter_id)
+{
+	struct canhal_instance *hal = ctx;
+	uint8_t channel = (uint32_t)filter_id >> CAN_FILTER_ID_CHANNEL_SHIFT;
+	if (!hal || filter_id < 0 || channel >= hal->channels)
+		return false;
+	return can_filter_remove(hal->chan[channel].filters, filter_id & ((1 << CAN_FILTER_ID_CHANNEL_SHIFT) - 1));
+}
+
+int canhal_add_mailbox(canhal_ctx ctx, uint8_t channel, uint32_t can_id, bool extended)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || !hal->mailboxes || channel >= hal->channels)
+		return -1;
+	if (can_id > (extended ? SPI_FRAME_ID_MASK : SPI_FRAME_STD_ID_MASK))
+		return -1;
+	return can_mailbox_add(hal->mailboxes, channel, can_id, extended);
+}
+
+bool canhal_read_mailbox(canhal_ctx ctx, int mailbox_id, struct canhal_mailbox_value *out)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || !hal->mailboxes || !out)
+		return false;
+	return can_mailbox_read(hal->mailboxes, mailbox_id, out);
+}
+
+int canhal_get_read_fd(canhal_ctx ctx)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal)
+		return false;
+	return hal->sock_fd;
+}
+
+int canhal_get_shm_fd(canhal_ctx ctx)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal)
+		return -1;
+	return can_shm_ring_fd(hal->rx_shm);
+}
+
+int canhal_read_batch(canhal_ctx ctx, struct can_frame *frames, uint32_t max_frames, int timeout_ms)
+{
+	struct canhal_instance *hal = ctx;
+	struct mmsghdr msgs[CANHAL_READ_BATCH_MAX_DGRAMS];
+	struct iovec iov[CANHAL_READ_BATCH_MAX_DGRAMS];
+	int nmsg = 0;
+
+	if (!hal || hal->sock_fd < 0 || max_frames < CANHAL_DGRAM_MAX_FRAMES)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct pollfd pfd = {.fd = hal->sock_fd, .events = POLLIN};
+	int ret = poll(&pfd, 1, timeout_ms);
+	if (ret <= 0)
+		return ret;
+
+	// 每个数据报都给满一个 CANHAL_DGRAM_MAX_FRAMES 大小的缓冲区, 保证不会截断
+	memset(msgs, 0, sizeof(msgs));
+	for (uint32_t off = 0; off + CANHAL_DGRAM_MAX_FRAMES <= max_frames && nmsg < CANHAL_READ_BATCH_MAX_DGRAMS;
+		 off += CANHAL_DGRAM_MAX_FRAMES, nmsg++)
+	{
+		iov[nmsg].iov_base = &frames[off];
+		iov[nmsg].iov_len = CANHAL_DGRAM_MAX_FRAMES * sizeof(struct can_frame);
+		msgs[nmsg].msg_hdr.msg_iov = &iov[nmsg];
+		msgs[nmsg].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(hal->sock_fd, msgs, nmsg, MSG_DONTWAIT, NULL);
+	if (ret < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	// 数据报不一定是满的, 把后面的帧往前挪成连续数组
+	uint32_t count = 0;
+	for (int n = 0; n < ret; n++)
+	{
+		uint32_t got = msgs[n].msg_len / sizeof(struct can_frame);
+		if (&frames[count] != iov[n].iov_base)
+			memmove(&frames[count], iov[n].iov_base, got * sizeof(struct can_frame));
+		count += got;
+	}
+
+	uint64_t now = can_now_ns();
+	for (uint32_t n = 0; n < count; n++)
+	{
+		frames[n].ts_deliver_ns = now;
+		latency_hist_record(&hal->latency[CANHAL_LAT_RX_SOCKET], now - frames[n].ts_xfer_ns);
+	}
+	return count;
+}
+
+bool canhal_get_latency(canhal_ctx ctx, enum canhal_latency_stage stage, struct canhal_latency *out)
+{
+	struct canhal_instance *hal = ctx;
+	struct latency_summary sum;
+	if (!hal || (unsigned)stage >= CANHAL_LAT_STAGE_COUNT)
+		return false;
+
+	latency_hist_summary(&hal->latency[stage], &sum);
+	out->count = sum.count;
+	out->min_ns = sum.min_ns;
+	out->max_ns = sum.max_ns;
+	out->mean_ns = sum.mean_ns;
+	out->p50_ns = sum.p50_ns;
+	out->p90_ns = sum.p90_ns;
+	out->p99_ns = sum.p99_ns;
+	out->p999_ns = sum.p999_ns;
+	return true;
+}
+
+void canhal_reset_latency(canhal_ctx ctx)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal)
+		return;
+	for (int stage = 0; stage < CANHAL_LAT_STAGE_COUNT; stage++)
+		latency_hist_reset(&hal->latency[stage]);
+}
+
+bool canhal_get_stats(canhal_ctx ctx, struct canhal_stats *out)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || !out)
+		return false;
+
+	memset(out, 0, sizeof(*out));
+	out->spi_transfers = CAN_STAT_GET(hal->stats.spi_transfers);
+	out->spi_ioctl_errors = CAN_STAT_GET(hal->stats.spi_ioctl_errors);
+	out->spi_bytes = CAN_STAT_GET(hal->stats.spi_bytes);
+	out->spi_status_transfers = CAN_STAT_GET(hal->stats.spi_status_transfers);
+	out->compact_wire = hal->rx_compact && hal->tx_compact;
+	out->pending_status = hal->pending_status;
+	out->rx_xor_errors = CAN_STAT_GET(hal->stats.rx_xor_errors);
+	out->rx_resyncs = CAN_STAT_GET(hal->stats.rx_resyncs);
+	out->rx_resync_bytes = CAN_STAT_GET(hal->stats.rx_resync_bytes);
+	out->rx_rejected = CAN_STAT_GET(hal->stats.rx_rejected);
+	out->rx_bad_channel = CAN_STAT_GET(hal->stats.rx_bad_channel);
+	out->rx_sock_dropped = CAN_STAT_GET(hal->stats.rx_sock_dropped);
+	out->sched_policy = CAN_STAT_GET(hal->thread_info.sched_policy);
+	out->sched_priority = CAN_STAT_GET(hal->thread_info.sched_priority);
+	out->mem_locked = hal->thread_info.mem_locked;
+	out->thread_minor_faults = CAN_STAT_GET(hal->stats.minor_faults);
+	out->thread_major_faults = CAN_STAT_GET(hal->stats.major_faults);
+
+	struct latency_summary sched;
+	latency_hist_summary(&hal->latency[CANHAL_LAT_SCHED_WAKEUP], &sched);
+	out->sched_wakeups = sched.count;
+	out->sched_latency_p99_ns = sched.p99_ns;
+	out->sched_latency_max_ns = sched.max_ns;
+	out->channels = hal->channels;
+
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		struct can_channel *chan = &hal->chan[ch];
+		struct canhal_channel_stats *cs = &out->chan[ch];
+
+		if (chan->bh != NULL)
 		{
-			perror("write(spi) error");
+			ring_buffer_t *rb = buffer_helper_get_ringbuffer(chan->bh);
+			cs->rx_frames = buffer_helper_get_receive_count(chan->bh);
+			cs->rx_header_resyncs = buffer_helper_get_resync_count(chan->bh);
+			cs->rx_header_discarded = buffer_helper_get_discard_bytes(chan->bh);
+			cs->rx_ring_overwrites = ring_buffer_overwrite_count(rb);
 		}
+		cs->rx_bytes = CAN_STAT_GET(chan->stats.rx_bytes);
+		cs->rx_unmatched = CAN_STAT_GET(chan->stats.rx_unmatched);
+		cs->tx_frames = CAN_STAT_GET(chan->stats.tx_frames);
+		cs->tx_bytes = CAN_STAT_GET(chan->stats.tx_bytes);
+		cs->tx_dropped = CAN_STAT_GET(chan->stats.tx_dropped);
 	}
+	if (hal->dispatch != NULL)
+		out->dispatch_workers = can_dispatch_get_stats(hal->dispatch, out->dispatch, CANHAL_DISPATCH_MAX_WORKERS);
+	return true;
 }
 
-int canhal_get_read_fd(canhal_ctx ctx)
+bool canhal_set_link(canhal_ctx ctx, struct canhal_link *link)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || !link || hal->xport == NULL || pthread_equal(pthread_self(), hal->thread))
+		return false;
+
+	struct can_link_request *req = &hal->link_req;
+	pthread_mutex_lock(&req->serialize);
+	pthread_mutex_lock(&req->lock);
+	req->link = *link;
+	if (req->link.bits == 0)
+		req->link.bits = CAN_SPI_BITS_DEFAULT;
+	if (req->link.speed_hz == 0)
+		req->link.speed_hz = CAN_SPI_SPEED_DEFAULT;
+	atomic_store_explicit(&req->pending, 1, memory_order_release);
+	can_event_notify(hal);
+	while (atomic_load(&req->pending))
+		pthread_cond_wait(&req->done, &req->lock);
+	bool ok = req->result == 0;
+	if (ok)
+		*link = req->link;
+	pthread_mutex_unlock(&req->lock);
+	pthread_mutex_unlock(&req->serialize);
+	return ok;
+}
+
+bool canhal_get_link(canhal_ctx ctx, struct canhal_link *out)
+{
+	struct canhal_instance *hal = ctx;
+	if (!hal || !out)
+		return false;
+	pthread_mutex_lock(&hal->link_req.lock);
+	*out = hal->link;
+	pthread_mutex_unlock(&hal->link_req.lock);
+	return true;
+}
+
+/* 链路错误总数和收到的有效帧数 */
+static void can_link_sample(struct canhal_instance *hal, uint64_t *errors, uint64_t *frames)
+{
+	*errors = CAN_STAT_GET(hal->stats.spi_ioctl_errors) + CAN_STAT_GET(hal->stats.rx_xor_errors) +
+			  CAN_STAT_GET(hal->stats.rx_resyncs) + CAN_STAT_GET(hal->stats.rx_bad_channel);
+	*frames = 0;
+	for (int ch = 0; ch < hal->channels; ch++)
+	{
+		*errors += buffer_helper_get_resync_count(hal->chan[ch].bh);
+		*frames += buffer_helper_get_receive_count(hal->chan[ch].bh);
+	}
+}
+
+/* 在当前时钟下观察真实流量. 返回 1 没有错误, 0 出现错误, -1 最长等待时间内收不够帧 */
+static int can_autotune_observe(struct canhal_instance *hal, const struct canhal_autotune *p)
+{
+	uint64_t errors0, frames0, errors, frames;
+	uint64_t start = can_now_ns();
+
+	can_link_sample(hal, &errors0, &frames0);
+	while (1)
+	{
+		usleep(CAN_AUTOTUNE_POLL_MS * 1000);
+		can_link_sample(hal, &errors, &frames);
+		uint64_t elapsed_ms = (can_now_ns() - start) / 1000000;
+		if (errors != errors0)
+			return 0;
+		// 计数器是 32 位的, 按无符号差值计算
+		if (elapsed_ms >= p->dwell_ms && (uint32_t)(frames - frames0) >= p->min_frames)
+			return 1;
+		if (elapsed_ms >= p->max_dwell_ms)
+			return -1;
+	}
+}
+
+bool canhal_autotune_link(canhal_ctx ctx, const struct canhal_autotune *params, struct canhal_link *result)
 {
-	if (!ctx)
+	struct canhal_instance *hal = ctx;
+	struct canhal_autotune p = {0};
+	struct canhal_link orig, link, best;
+	bool have_best = false;
+
+	if (!hal || hal->xport == NULL || !canhal_get_link(ctx, &orig))
 		return false;
-	return g_can_ctx.sock_fd;
-}
\ No newline at end of file
+	if (params)
+		p = *params;
+	if (p.max_hz == 0)
+		p.max_hz = CAN_AUTOTUNE_MAX_HZ;
+	if (p.step_percent == 0)
+		p.step_percent = CAN_AUTOTUNE_STEP_PERCENT;
+	if (p.dwell_ms == 0)
+		p.dwell_ms = CAN_AUTOTUNE_DWELL_MS;
+	if (p.min_frames == 0)
+		p.min_frames = CAN_AUTOTUNE_MIN_FRAMES;
+	if (p.max_dwell_ms < p.dwell_ms)
+		p.max_dwell_ms = p.dwell_ms * 10;
+
+	link = orig;
+	if (p.start_hz != 0)
+		link.speed_hz = p.start_hz;
+	while (1)
+	{
+		struct canhal_link tried = link;
+		if (!canhal_set_link(ctx, &tried))
+			break;
+		int ret = can_autotune_observe(hal, &p);
+		printf("autotune: %u Hz %s\n", tried.speed_hz, ret > 0 ? "ok" : (ret == 0 ? "errors" : "not enough traffic"));
+		if (ret <= 0)
+			break;
+		best = tried;
+		have_best = true;
+		if (link.speed_hz >= p.max_hz)
+			break;
+
+		uint64_t next = (uint64_t)link.speed_hz * (100 + p.step_percent) / 100;
+		if (next <= link.speed_hz)
+			next = link.speed_hz + 1;
+		link.speed_hz = next > p.max_hz ? p.max_hz : (uint32_t)next;
+	}
+
+	struct canhal_link final = have_best ? best : orig;
+	canhal_set_link(ctx, &final);
+	if (result)
+		*result = final;
+	return have_best;
+}
@@ -2,26 +2,274 @@
 #define CAN_HAL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define CANHAL_FD_MAX_DLEN (64) /**< CAN FD 帧最长的 payload */
+
+/* struct can_frame::flags */
+#define CANHAL_FRAME_FD (0x01)  /**< CAN FD 帧 */
+#define CANHAL_FRAME_BRS (0x02) /**< FD 帧的数据段使用更高的波特率 */
+#define CANHAL_FRAME_ESI (0x04) /**< FD 帧发送节点处于被动错误状态 */
+
 struct can_frame
 {
     uint32_t can_id;  /**<  can帧的id */
-    uint32_t can_dlc; /**< can帧的负载长度*/
+    uint32_t can_dlc; /**< can帧的负载长度, FD 帧是字节数 (0~8, 12, 16, 20, 24, 32, 48, 64), 发送时向上取整 */
     bool extended_id; /**< 是否是扩展帧  */
     bool rtr; /**< 是否是遥控帧,大多数场景下都应该为false */
-    uint8_t payload[8] __attribute__((aligned(8))) ;  /**<  can帧的数据部分 */
+    uint8_t channel; /**< MCU 上的 CAN 通道号, 发送时由 canhal_write_channel 的参数决定 */
+    uint8_t flags;   /**< CANHAL_FRAME_* */
+    uint8_t payload[CANHAL_FD_MAX_DLEN] __attribute__((aligned(8))) ;  /**<  can帧的数据部分, 经典帧只用前 8 字节 */
+    /* 以下时间戳均为 CLOCK_MONOTONIC 纳秒, 0 表示不适用 */
+    uint64_t ts_enqueue_ns; /**< 发送: canhal_write 入队的时间 */
+    uint64_t ts_xfer_ns;    /**< 接收: 所在 SPI 传输完成的时间 */
+    uint64_t ts_deliver_ns; /**< 接收: 交给过滤器回调或 canhal_read_batch 返回的时间 */
 };
 
 typedef void (*drv_can_filter_callback)(void*context, struct can_frame *can_frame);
 
 typedef void *canhal_ctx;
 
+#define CANHAL_DGRAM_MAX_FRAMES (32)      /**< 读 socket 上一个数据报最多携带的 struct can_frame 个数 */
+#define CANHAL_READ_BATCH_MAX_DGRAMS (64) /**< canhal_read_batch 一次最多收取的数据报个数 */
+
+/* 发送优先级通道, SPI 线程总是先发完高优先级通道再发低优先级通道 */
+enum canhal_tx_prio
+{
+    CANHAL_TX_PRIO_HIGH = 0,   /**< 控制类帧 */
+    CANHAL_TX_PRIO_NORMAL = 1, /**< canhal_write 的默认通道 */
+    CANHAL_TX_PRIO_LOW = 2,    /**< 日志、诊断等可以延后的流量 */
+    CANHAL_TX_PRIO_COUNT
+};
+
+/* 延迟直方图统计的阶段 */
+enum canhal_latency_stage
+{
+    CANHAL_LAT_TX_QUEUE = 0,    /**< canhal_write 入队 -> SPI 传输完成 */
+    CANHAL_LAT_RX_CALLBACK = 1, /**< SPI 传输完成 -> 过滤器回调被调用, 启用工作线程池时包括排队时间 */
+    CANHAL_LAT_RX_SOCKET = 2,   /**< SPI 传输完成 -> canhal_read_batch 返回 */
+    CANHAL_LAT_SCHED_WAKEUP = 3, /**< 唤醒请求或空闲超时到期 -> SPI 线程实际恢复运行, 即调度延迟 */
+    CANHAL_LAT_STAGE_COUNT
+};
+
+struct canhal_latency
+{
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+};
+
+#define CANHAL_MAX_CHANNELS (4)
+
+#define CANHAL_DISPATCH_MAX_WORKERS (16)
+
+/* 回调工作线程池队列满时的处理方式 */
+enum canhal_dispatch_overflow
+{
+    CANHAL_DISPATCH_DROP = 0, /**< 丢弃这一帧并计入 dropped, SPI 线程不等待 */
+    CANHAL_DISPATCH_WAIT = 1, /**< SPI 线程等到队列有空位, 不丢帧, 但慢回调会拖慢 SPI 传输 */
+};
+
+/* 回调工作线程池每个分片的计数器 */
+struct canhal_dispatch_stats
+{
+    uint64_t queued;    /**< 入队的帧数 */
+    uint64_t delivered; /**< 已经回调的帧数 */
+    uint64_t dropped;   /**< 队列满而丢弃的帧数 */
+    uint64_t waits;     /**< WAIT 策略下 SPI 线程因队列满而等待的次数 */
+    uint64_t max_depth; /**< 入队后队列深度的最大值 */
+};
+
+/* canhal_read_mailbox 的结果 */
+struct canhal_mailbox_value
+{
+    struct can_frame frame; /**< 最近收到的一帧, 从未收到时只有 ID、帧类型和通道号有效; ts_deliver_ns 是读取的时间 */
+    uint64_t updates;       /**< 自登记起收到的次数 */
+    uint64_t age_ns;        /**< 读取时距离最近一次收到 (ts_xfer_ns) 的时间, 从未收到时为 0 */
+};
+
+/* 单个 CAN 通道的计数器, 自 canhal_init 起单调递增 */
+struct canhal_channel_stats
+{
+    uint64_t rx_frames;          /**< 交给上层的帧数 */
+    uint64_t rx_bytes;           /**< 交给上层的 payload 字节数 */
+    uint64_t rx_unmatched;       /**< 没有匹配到过滤器的帧数 */
+    uint64_t rx_header_resyncs;  /**< 解析器遇到错误包头而重新同步的次数 */
+    uint64_t rx_header_discarded; /**< 解析器重新同步时丢弃的字节数 */
+    uint64_t rx_ring_overwrites; /**< 解析器环形缓冲区满而覆盖 (丢掉) 的字节数 */
+    uint64_t tx_frames;          /**< 已经送上 SPI 的帧数 */
+    uint64_t tx_bytes;           /**< 已经送上 SPI 的 payload 字节数 */
+    uint64_t tx_dropped;         /**< 发送队列满而被 canhal_write* 拒绝的帧数 */
+};
+
+/* SPI 链路的计数器加上每个通道的计数器 */
+struct canhal_stats
+{
+    uint64_t spi_transfers;      /**< 成功的 SPI ioctl 次数 */
+    uint64_t spi_ioctl_errors;   /**< 失败的 SPI ioctl 次数 */
+    uint64_t spi_bytes;          /**< 成功传输的字节数, 每个方向各这么多, 包括状态传输 */
+    uint64_t spi_status_transfers; /**< 成功的状态传输次数, 不计入 spi_transfers */
+    bool compact_wire;           /**< 与 MCU 协商后正在使用紧凑线上格式 */
+    bool pending_status;         /**< 与 MCU 协商后按状态传输报告的待发字节数决定传输长度 */
+    uint64_t rx_xor_errors;      /**< 包头正确但包尾或异或校验错误的帧数 */
+    uint64_t rx_resyncs;         /**< SPI 字节流错位后重新对齐到有效帧的次数 */
+    uint64_t rx_resync_bytes;    /**< 重新对齐时丢弃的字节数 */
+    uint64_t rx_rejected;        /**< 校验正确但是遥控帧而被丢弃的帧数 */
+    uint64_t rx_bad_channel;     /**< 通道号超出配置范围的帧数 */
+    uint64_t rx_sock_dropped;    /**< 读 socket 积压已满而丢弃的帧数 */
+    int sched_policy;            /**< SPI 线程实际的调度策略, 申请实时策略失败时是回退后的值 */
+    int sched_priority;          /**< SPI 线程实际的调度优先级 */
+    bool mem_locked;             /**< mlockall 是否成功 */
+    uint64_t sched_wakeups;      /**< 统计过调度延迟的唤醒次数, 完整分布见 CANHAL_LAT_SCHED_WAKEUP */
+    uint64_t sched_latency_p99_ns;
+    uint64_t sched_latency_max_ns;
+    uint64_t thread_minor_faults; /**< SPI 线程的缺页次数, 每次空闲等待后更新 */
+    uint64_t thread_major_faults;
+    uint8_t channels;            /**< chan[] 中有效的通道数 */
+    struct canhal_channel_stats chan[CANHAL_MAX_CHANNELS];
+    uint8_t dispatch_workers;    /**< dispatch[] 中有效的分片数, 0 表示回调在 SPI 线程里执行 */
+    struct canhal_dispatch_stats dispatch[CANHAL_DISPATCH_MAX_WORKERS];
+};
+
+/* SPI 帧的完整性校验方式, 必须和 MCU 固件一致 */
+enum canhal_integrity
+{
+    CANHAL_INTEGRITY_XOR = 0,   /**< 包尾 0x7d + 1 字节异或 */
+    CANHAL_INTEGRITY_CRC16 = 1, /**< 帧最后两个字节换成之前所有字节的大端 CRC-16/CCITT (0x1021, 初值 0) */
+};
+
+struct can_transport; /**< 见 can_transport.h */
+
+/* SPI 链路参数 */
+struct canhal_link
+{
+    uint8_t mode;      /**< SPI_CPOL/SPI_CPHA/SPI_LSB_FIRST 等标志的组合, 见 spidev.h */
+    uint8_t bits;      /**< 每个字的位数, 0 表示默认值 8 */
+    uint32_t speed_hz; /**< SPI 时钟, 0 表示默认值 */
+    uint16_t delay_us; /**< 帧与帧之间片选翻转前的延时 */
+};
+
+/* canhal_autotune_link 的参数, 各字段为 0 时使用默认值 */
+struct canhal_autotune
+{
+    uint32_t start_hz;     /**< 起始时钟, 默认当前时钟 */
+    uint32_t max_hz;       /**< 最高尝试到的时钟, 默认 20MHz */
+    uint32_t step_percent; /**< 每步提高的百分比, 默认 25 */
+    uint32_t dwell_ms;     /**< 每个时钟至少观察的时间, 默认 500ms */
+    uint32_t min_frames;   /**< 每个时钟至少要收到的有效帧数, 默认 1000 */
+    uint32_t max_dwell_ms; /**< 每个时钟最长等待时间, 到时还收不够帧就停止提速, 默认 dwell_ms 的 10 倍 */
+};
+
+struct canhal_options
+{
+    uint32_t batch_frames; /**< 单次 SPI 传输最多打包的帧数, 0 表示默认值, 实际值受 spidev bufsiz 限制 */
+    const char *irq_gpiochip; /**< MCU "数据就绪" 信号所在的 gpiochip, 如 "/dev/gpiochip0", NULL 表示不使用 */
+    uint32_t irq_gpio_line;   /**< "数据就绪" 信号在 gpiochip 上的 line 编号 */
+    bool irq_rising_edge;     /**< true 上升沿触发, false 下降沿触发 */
+    int irq_fd;               /**< 外部提供的唤醒 fd (eventfd/pipe 等), 可读即表示 MCU 有数据, -1 表示不使用; 优先于 irq_gpiochip */
+    uint32_t idle_poll_ms;    /**< 空闲时最长阻塞时间, 0 表示默认值 (无中断源时 10ms, 有中断源时 1000ms) */
+    uint32_t tx_lane_frames;  /**< 每个发送优先级通道能缓存的帧数, 向上取整到 2 的幂, 0 表示默认值 2048 */
+    bool tx_sched;            /**< true: 同一优先级通道内按 CAN ID 仲裁顺序发送, false: 先进先出 */
+    uint32_t tx_sched_frames; /**< 调度器最多同时排序的帧数, 0 表示默认值 */
+    uint32_t tx_sched_max_starve_us; /**< 任意帧从入队起的大致最长等待时间, 超过后不论 ID 直接发送, 0 表示默认值 */
+    uint32_t shm_rx_slots;    /**< 共享内存接收广播环的槽位数, 向上取整到 2 的幂, 0 表示不启用 */
+    uint32_t mailboxes;       /**< 最新值邮箱最多能登记的 CAN ID 个数 (所有通道合计), 0 表示不启用 */
+    uint32_t dispatch_workers; /**< 过滤器回调的工作线程数, 最多 CANHAL_DISPATCH_MAX_WORKERS, 0 表示在 SPI 线程里直接回调.
+                                    帧按通道、帧类型和 CAN ID 分片, 同一个 ID 的回调总在同一个线程里按顺序执行 */
+    uint32_t dispatch_queue_frames; /**< 每个工作线程的队列至少能缓存的帧数, 0 表示默认值 */
+    enum canhal_dispatch_overflow dispatch_overflow; /**< 队列满时的处理方式, 默认丢弃 */
+    uint32_t dispatch_cpu_affinity; /**< 第 n 个工作线程绑定到位图里第 n % popcount 个 CPU, 0 表示不限制 */
+    uint8_t channels;         /**< MCU 后面的 CAN 通道数, 1~4, 0 表示 1 */
+    bool can_fd;              /**< 允许发送 CAN FD 帧, 发送队列的每个槽位按 64 字节 payload 分配; 接收总是支持 FD 帧 */
+    struct canhal_link link;  /**< SPI 链路参数, canhal_options_init 填入默认值 (模式 3, 8 位, 1.125MHz, 无延时) */
+    enum canhal_integrity integrity; /**< 帧校验方式, 默认异或 */
+    bool compact_wire;        /**< 初始化时和 MCU 协商紧凑线上格式 (帧长随 dlc 变化), MCU 不支持时保持 16 字节槽位格式 */
+    bool pending_status;      /**< 初始化时和 MCU 协商状态传输: 发送队列空时先用 4 字节的传输查询 MCU 待发的字节数,
+                                   按它决定下一次传输的长度, 两边都没有数据时不再空跑整帧; MCU 不支持时按原来的方式轮询 */
+    struct can_transport *transport; /**< 自定义传输后端 (如 MCU 模拟器), NULL 表示打开 device 上的 spidev; 无论成功与否都由 canhal 接管并负责关闭 */
+    int sched_policy;         /**< SPI 线程的调度策略 SCHED_OTHER/SCHED_FIFO/SCHED_RR, 默认 SCHED_OTHER; 没有权限时回退到继承调用者 */
+    int sched_priority;       /**< SCHED_FIFO/SCHED_RR 的优先级 1~99 */
+    uint32_t cpu_affinity;    /**< SPI 线程可以运行的 CPU 位图, bit n 表示 CPU n, 0 表示不限制 */
+    size_t stack_size;        /**< SPI 线程的栈大小, 0 表示系统默认 */
+    bool mlock_all;           /**< mlockall(MCL_CURRENT | MCL_FUTURE), 作用于整个进程, 失败只打印警告 */
+    bool prefault;            /**< 启动线程前访问一遍 canhal 的所有缓冲区, 线程启动时访问一遍栈, 避免运行中缺页 */
+};
+
+void canhal_options_init(struct canhal_options *opts);
 bool canhal_init(canhal_ctx *ctx, const char *device_name);
+bool canhal_init_ex(canhal_ctx *ctx, const char *device_name, const struct canhal_options *opts);
 bool canhal_is_open(canhal_ctx ctx);
 void canhal_close(canhal_ctx ctx);
+// data 是一个 struct can_frame, data_len 至少要盖住 can_dlc 个字节的 payload, 后面缺的字段按 0 处理.
+// data_len 小于 sizeof(struct can_frame) 时按老的帧结构处理, 忽略 channel 和 flags, 只发经典帧
 void canhal_write(canhal_ctx ctx, void *data, uint32_t data_len);
+bool canhal_write_prio(canhal_ctx ctx, struct can_frame *frame, enum canhal_tx_prio prio);
+bool canhal_write_channel(canhal_ctx ctx, uint8_t channel, struct can_frame *frame, enum canhal_tx_prio prio);
+/*
+    读 socket 上的每个数据报是若干个连续的 struct can_frame, 最多 CANHAL_DGRAM_MAX_FRAMES 个.
+    直接 recv 时缓冲区至少要 CANHAL_DGRAM_MAX_FRAMES * sizeof(struct can_frame) 字节
+*/
 int canhal_get_read_fd(canhal_ctx ctx);
+/*
+    用 recvmmsg 一次取走尽可能多的接收帧, max_frames 至少为 CANHAL_DGRAM_MAX_FRAMES.
+    timeout_ms 为 -1 时一直等待. 返回取到的帧数, 超时返回 0, 出错返回 -1
+*/
+int canhal_read_batch(canhal_ctx ctx, struct can_frame *frames, uint32_t max_frames, int timeout_ms);
+/*
+    共享内存接收广播环的 memfd, 未启用时返回 -1. 可以通过 SCM_RIGHTS 传给其他进程,
+    读者用 can_shm.h 里的 can_shm_reader_* 只读映射并跟随
+*/
+int canhal_get_shm_fd(canhal_ctx ctx);
+
+/*
+    最新值邮箱: 登记过的 CAN ID 每收到一帧就原地覆盖它的邮箱, 不排队, 也不需要注册回调.
+    读者在任意线程用序号锁读出一致的快照, 不加锁、不阻塞 SPI 线程. 邮箱只能登记不能删除.
+    canhal_add_mailbox 返回邮箱编号, 同一个 ID 重复登记返回同一个编号, 邮箱已满、未启用或 ID 超出帧类型的范围时返回 -1.
+    帧同时匹配过滤器时两边都会收到; 只登记了邮箱的帧不计入 rx_unmatched
+*/
+int canhal_add_mailbox(canhal_ctx ctx, uint8_t channel, uint32_t can_id, bool extended);
+bool canhal_read_mailbox(canhal_ctx ctx, int mailbox_id, struct canhal_mailbox_value *out);
+
+/* 查询某个阶段的延迟分布, 百分位的误差在 3% 以内. 可以在任意线程调用 */
+bool canhal_get_latency(canhal_ctx ctx, enum canhal_latency_stage stage, struct canhal_latency *out);
+void canhal_reset_latency(canhal_ctx ctx);
+
+/* 读取计数器快照, 各计数器分别原子地读出, 彼此之间不保证是同一时刻. 可以在任意线程调用 */
+bool canhal_get_stats(canhal_ctx ctx, struct canhal_stats *out);
+
+/*
+    运行中修改 SPI 链路参数, 由 SPI 线程在两次传输之间生效, 调用者阻塞到生效为止.
+    成功时 link 里是实际生效的值 (spidev 可能把时钟向下取整); 失败时恢复原来的参数.
+    不能在过滤器回调 (SPI 线程) 里调用
+*/
+bool canhal_set_link(canhal_ctx ctx, struct canhal_link *link);
+bool canhal_get_link(canhal_ctx ctx, struct canhal_link *out);
+/*
+    用真实流量自动选择 SPI 时钟: 从 start_hz 开始逐步提高, 每一步观察一段时间的校验错误、
+    包头错位和 ioctl 错误, 出现错误就退回上一个没有错误的时钟并停止.
+    阻塞到调优结束, 期间收发照常进行. 返回 true 表示至少有一个时钟验证通过, result 是最后采用的参数;
+    返回 false 时链路恢复为调用前的参数
+*/
+bool canhal_autotune_link(canhal_ctx ctx, const struct canhal_autotune *params, struct canhal_link *result);
+
+/*
+    注册接收过滤器, (帧 ID & mask) == (can_id & mask) 且帧类型相同时调用 callback.
+    mask 覆盖整个 ID 宽度 (标准帧 0x7ff, 扩展帧 0x1fffffff) 时为精确匹配, 精确匹配优先于掩码匹配,
+    没有精确匹配时在所有掩码匹配的过滤器里取最先注册的一个, 与掩码是否相同无关. 可以在 SPI 线程运行期间调用. 返回过滤器编号, 失败返回 -1.
+    启用 dispatch_workers 时回调在工作线程里执行, 移除过滤器时已经入队的帧仍会回调一次.
+    canhal_add_filter 注册在通道 0 上, 每个通道有独立的过滤器表
+*/
+int canhal_add_filter(canhal_ctx ctx, uint32_t can_id, bool extended, uint32_t mask,
+                      drv_can_filter_callback callback, void *context);
+int canhal_add_channel_filter(canhal_ctx ctx, uint8_t channel, uint32_t can_id, bool extended, uint32_t mask,
+                              drv_can_filter_callback callback, void *context);
+bool canhal_remove_filter(canhal_ctx ctx, int filter_id);
 
 
 #endif
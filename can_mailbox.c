@@ -0,0 +1,166 @@
+#include "can_mailbox.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CAN_MAILBOX_CACHE_LINE (64)
+#define CAN_MAILBOX_NONE (0) /**< 哈希表里的空位, 其余值为邮箱编号 + 1 */
+
+struct can_mailbox
+{
+	uint32_t seq;	  /**< 序号锁, 奇数表示正在写 */
+	uint64_t updates; /**< 自登记起收到的帧数 */
+	struct can_frame frame;
+} __attribute__((aligned(CAN_MAILBOX_CACHE_LINE)));
+
+struct can_mailbox_table
+{
+	struct can_mailbox *boxes;
+	uint32_t capacity;
+	uint32_t count;		  /**< 已登记的邮箱数 */
+	uint32_t hash_mask;	  /**< 哈希槽位数 - 1 */
+	uint32_t *keys;
+	uint32_t *values;	  /**< CAN_MAILBOX_NONE 表示空槽, 写者查找时用 acquire 读取 */
+	pthread_mutex_t lock; /**< 登记者之间互斥 */
+};
+
+/* 通道号、帧类型和 ID 拼成 32 位的键: 通道占最高 2 位, 帧类型 1 位, 其余是 29 位 ID */
+static inline uint32_t can_mailbox_key(uint8_t channel, uint32_t can_id, bool extended)
+{
+	return ((uint32_t)channel << 30) | (extended ? 1u << 29 : 0) | (can_id & 0x1fffffffu);
+}
+
+static inline uint32_t can_mailbox_slot(uint32_t key, uint32_t mask)
+{
+	return (key * 0x9e3779b1u) & mask;
+}
+
+static uint64_t can_mailbox_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct can_mailbox_table *can_mailbox_table_new(uint32_t capacity)
+{
+	if (capacity == 0 || capacity > (1u << 24))
+		return NULL;
+
+	struct can_mailbox_table *t = calloc(1, sizeof(struct can_mailbox_table));
+	if (t == NULL)
+		return NULL;
+
+	pthread_mutex_init(&t->lock, NULL);
+	uint32_t slots = 4;
+	while (slots < capacity * 2)
+		slots <<= 1;
+	t->capacity = capacity;
+	t->hash_mask = slots - 1;
+	t->keys = calloc(slots, sizeof(uint32_t));
+	t->values = calloc(slots, sizeof(uint32_t));
+	t->boxes = aligned_alloc(CAN_MAILBOX_CACHE_LINE, (size_t)capacity * sizeof(struct can_mailbox));
+	if (t->keys == NULL || t->values == NULL || t->boxes == NULL)
+	{
+		can_mailbox_table_free(t);
+		return NULL;
+	}
+	memset(t->boxes, 0, (size_t)capacity * sizeof(struct can_mailbox));
+	return t;
+}
+
+void can_mailbox_table_free(struct can_mailbox_table *t)
+{
+	if (t == NULL)
+		return;
+	pthread_mutex_destroy(&t->lock);
+	free(t->boxes);
+	free(t->keys);
+	free(t->values);
+	free(t);
+}
+
+int can_mailbox_add(struct can_mailbox_table *t, uint8_t channel, uint32_t can_id, bool extended)
+{
+	uint32_t key = can_mailbox_key(channel, can_id, extended);
+	int id = -1;
+
+	pthread_mutex_lock(&t->lock);
+	uint32_t slot = can_mailbox_slot(key, t->hash_mask);
+	while (t->values[slot] != CAN_MAILBOX_NONE)
+	{
+		if (t->keys[slot] == key)
+		{
+			id = t->values[slot] - 1;
+			goto out;
+		}
+		slot = (slot + 1) & t->hash_mask;
+	}
+	if (t->count == t->capacity)
+		goto out;
+
+	id = t->count;
+	struct can_mailbox *box = &t->boxes[id];
+	box->frame.can_id = can_id;
+	box->frame.extended_id = extended;
+	box->frame.channel = channel;
+	t->keys[slot] = key;
+	// 邮箱和键都写好以后再发布, SPI 线程看到非空槽时一定能看到完整的表项
+	__atomic_store_n(&t->values[slot], id + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->count, t->count + 1, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&t->lock);
+	return id;
+}
+
+bool can_mailbox_update(struct can_mailbox_table *t, const struct can_frame *frame)
+{
+	uint32_t key = can_mailbox_key(frame->channel, frame->can_id, frame->extended_id);
+	uint32_t slot = can_mailbox_slot(key, t->hash_mask);
+	uint32_t value;
+
+	while ((value = __atomic_load_n(&t->values[slot], __ATOMIC_ACQUIRE)) != CAN_MAILBOX_NONE)
+	{
+		if (t->keys[slot] == key)
+			break;
+		slot = (slot + 1) & t->hash_mask;
+	}
+	if (value == CAN_MAILBOX_NONE)
+		return false;
+
+	struct can_mailbox *box = &t->boxes[value - 1];
+	uint32_t seq = box->seq;
+	// 只有 SPI 线程写, 序号先变成奇数, 读者看到奇数或者前后不一致就重读
+	__atomic_store_n(&box->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&box->frame, frame, sizeof(struct can_frame));
+	__atomic_store_n(&box->updates, box->updates + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&box->seq, seq + 2, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool can_mailbox_read(struct can_mailbox_table *t, int mailbox_id, struct canhal_mailbox_value *out)
+{
+	if (mailbox_id < 0 || (uint32_t)mailbox_id >= __atomic_load_n(&t->count, __ATOMIC_ACQUIRE))
+		return false;
+
+	const struct can_mailbox *box = &t->boxes[mailbox_id];
+	uint32_t seq;
+	for (;;)
+	{
+		seq = __atomic_load_n(&box->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(&out->frame, &box->frame, sizeof(struct can_frame));
+		out->updates = __atomic_load_n(&box->updates, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&box->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	uint64_t now = can_mailbox_now_ns();
+	out->frame.ts_deliver_ns = now;
+	out->age_ns = out->updates != 0 && now > out->frame.ts_xfer_ns ? now - out->frame.ts_xfer_ns : 0;
+	return true;
+}
@@ -0,0 +1,27 @@
+#ifndef CAN_MAILBOX_H
+#define CAN_MAILBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "can_hal.h"
+
+/*
+	最新值邮箱表: 每个登记的 (通道, 帧类型, CAN ID) 一个邮箱, 只保存最近收到的一帧.
+	容量在创建时固定, 邮箱只增不删, 所以读者拿到的邮箱编号一直有效.
+	SPI 线程是唯一的写者, 查找走开放寻址哈希表, 表项在登记时以 release 发布, 查找不加锁.
+	每个邮箱用序号锁 (seqlock) 保护: 写者写之前把序号加到奇数, 写完再加到偶数;
+	读者在序号为偶数且前后一致时得到一致的快照, 否则重读. 读者不加锁、不排队、不影响写者.
+*/
+struct can_mailbox_table;
+
+struct can_mailbox_table *can_mailbox_table_new(uint32_t capacity);
+void can_mailbox_table_free(struct can_mailbox_table *t);
+
+// 返回邮箱编号 (>= 0), 同一个键重复登记返回原来的编号, 表满返回 -1. 可以在任意线程调用
+int can_mailbox_add(struct can_mailbox_table *t, uint8_t channel, uint32_t can_id, bool extended);
+// 只能在 SPI 线程调用. 帧属于某个已登记的邮箱时更新它并返回 true
+bool can_mailbox_update(struct can_mailbox_table *t, const struct can_frame *frame);
+// 任意线程调用, 邮箱编号无效时返回 false
+bool can_mailbox_read(struct can_mailbox_table *t, int mailbox_id, struct canhal_mailbox_value *out);
+
+#endif
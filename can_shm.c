@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "can_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "utils/prefault.h"
+
+struct can_shm_ring
+{
+	int fd;
+	size_t map_size;
+	struct can_shm_header *hdr;
+	struct can_shm_slot *slots;
+	uint32_t mask;
+};
+
+static size_t can_shm_map_size(uint32_t slot_count)
+{
+	size_t hdr = (sizeof(struct can_shm_header) + 63) & ~(size_t)63;
+	return hdr + (size_t)slot_count * sizeof(struct can_shm_slot);
+}
+
+static struct can_shm_slot *can_shm_slots(const struct can_shm_header *hdr)
+{
+	size_t off = (sizeof(struct can_shm_header) + 63) & ~(size_t)63;
+	return (struct can_shm_slot *)((char *)hdr + off);
+}
+
+static long can_futex(const uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+struct can_shm_ring *can_shm_ring_new(uint32_t slot_count)
+{
+	uint32_t slots = 2;
+	while (slots < slot_count)
+		slots <<= 1;
+
+	struct can_shm_ring *ring = calloc(1, sizeof(struct can_shm_ring));
+	if (ring == NULL)
+		return NULL;
+
+	ring->map_size = can_shm_map_size(slots);
+	ring->fd = memfd_create("can_hal_rx", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (ring->fd < 0)
+	{
+		perror("memfd_create error");
+		free(ring);
+		return NULL;
+	}
+	if (ftruncate(ring->fd, ring->map_size) < 0)
+	{
+		perror("ftruncate error");
+		goto fail;
+	}
+	// 读者依赖固定的大小做 mmap, 不允许再改变
+	fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	ring->hdr = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->hdr == MAP_FAILED)
+	{
+		perror("mmap error");
+		goto fail;
+	}
+	ring->slots = can_shm_slots(ring->hdr);
+	ring->mask = slots - 1;
+
+	ring->hdr->slot_count = slots;
+	ring->hdr->slot_size = sizeof(struct can_shm_slot);
+	ring->hdr->version = CAN_SHM_VERSION;
+	__atomic_store_n(&ring->hdr->magic, CAN_SHM_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+
+fail:
+	close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+void can_shm_ring_free(struct can_shm_ring *ring)
+{
+	if (ring == NULL)
+		return;
+	munmap(ring->hdr, ring->map_size);
+	close(ring->fd);
+	free(ring);
+}
+
+int can_shm_ring_fd(struct can_shm_ring *ring)
+{
+	return ring ? ring->fd : -1;
+}
+
+void can_shm_ring_prefault(struct can_shm_ring *ring)
+{
+	if (ring != NULL)
+		prefault_range(ring->hdr, ring->map_size);
+}
+
+void can_shm_ring_publish(struct can_shm_ring *ring, const struct can_frame *frames, int count)
+{
+	if (ring == NULL || count <= 0)
+		return;
+
+	uint64_t seq = ring->hdr->write_seq;
+	for (int n = 0; n < count; n++, seq++)
+	{
+		struct can_shm_slot *slot = &ring->slots[seq & ring->mask];
+		// 先把槽位标记为写入中, 读者看到 stamp 变化就知道读到的数据不完整
+		__atomic_store_n(&slot->stamp, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(&slot->frame, &frames[n], sizeof(struct can_frame));
+		__atomic_store_n(&slot->stamp, seq + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ring->hdr->write_seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->hdr->futex_word, (uint32_t)seq, __ATOMIC_RELEASE);
+	can_futex(&ring->hdr->futex_word, FUTEX_WAKE, INT32_MAX, NULL);
+}
+
+bool can_shm_reader_open(struct can_shm_reader *r, int fd)
+{
+	struct can_shm_header hdr;
+
+	memset(r, 0, sizeof(*r));
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != CAN_SHM_MAGIC ||
+		hdr.version != CAN_SHM_VERSION || hdr.slot_size != sizeof(struct can_shm_slot))
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	r->map_size = can_shm_map_size(hdr.slot_count);
+	void *map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	r->hdr = map;
+	r->slots = can_shm_slots(r->hdr);
+	r->cursor = __atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE);
+	return true;
+}
+
+void can_shm_reader_close(struct can_shm_reader *r)
+{
+	if (r->hdr != NULL)
+		munmap((void *)r->hdr, r->map_size);
+	memset(r, 0, sizeof(*r));
+}
+
+int can_shm_read(struct can_shm_reader *r, struct can_frame *frames, int max_frames, uint64_t *lost)
+{
+	uint32_t slot_count = r->hdr->slot_count;
+	int count = 0;
+
+	while (count < max_frames)
+	{
+		uint64_t head = __atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE);
+		if (r->cursor == head)
+			break;
+		if (head - r->cursor > slot_count)
+		{
+			// 被套圈, 跳到环里还保留着的最老的帧
+			if (lost)
+				*lost += head - r->cursor - slot_count;
+			r->cursor = head - slot_count;
+		}
+
+		const struct can_shm_slot *slot = &r->slots[r->cursor & (slot_count - 1)];
+		uint64_t stamp = __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE);
+		memcpy(&frames[count], &slot->frame, sizeof(struct can_frame));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (stamp != r->cursor + 1 || __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) != stamp)
+		{
+			// cursor < write_seq 时这个槽位一定写完过, 序号不对说明已被下一圈覆盖
+			if (lost)
+				(*lost)++;
+			r->cursor++;
+			continue;
+		}
+		r->cursor++;
+		count++;
+	}
+	return count;
+}
+
+int can_shm_wait(struct can_shm_reader *r, int timeout_ms)
+{
+	struct timespec ts;
+	struct timespec *pts = NULL;
+
+	if (timeout_ms >= 0)
+	{
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		pts = &ts;
+	}
+
+	while (1)
+	{
+		uint32_t word = __atomic_load_n(&r->hdr->futex_word, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE) != r->cursor)
+			return 1;
+		if (can_futex(&r->hdr->futex_word, FUTEX_WAIT, word, pts) < 0)
+		{
+			if (errno == ETIMEDOUT)
+				return 0;
+			if (errno != EAGAIN && errno != EINTR)
+				return -1;
+		}
+	}
+}
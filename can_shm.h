@@ -0,0 +1,63 @@
+#ifndef CAN_SHM_H
+#define CAN_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "can_hal.h"
+
+/*
+	基于 memfd 的接收帧广播环.
+	SPI 线程把每个收到的帧写入环中一次, 任意多个读进程只读 mmap 同一个 fd, 各自维护读游标.
+	每个槽位带序号 (写入期间为 0, 写完为帧序号 + 1), 读者据此判断读到的是否是一致的数据,
+	以及自己是否已经被写者套圈 (overrun). 写者每发布一批帧在 futex_word 上做一次 FUTEX_WAKE,
+	读者用 FUTEX_WAIT 阻塞, 不需要对共享内存有写权限.
+*/
+
+#define CAN_SHM_MAGIC (0x43414e52) /* "CANR" */
+#define CAN_SHM_VERSION (2) /* 2: struct can_frame 加入 FD 标志和 64 字节 payload */
+
+struct can_shm_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count; /**< 2 的幂 */
+	uint32_t slot_size;
+	uint64_t write_seq __attribute__((aligned(64))); /**< 已发布的帧总数, 即下一个要写的序号 */
+	uint32_t futex_word;							 /**< write_seq 的低 32 位, 每批发布后更新 */
+};
+
+struct can_shm_slot
+{
+	uint64_t stamp; /**< 0 表示正在写, 否则为帧序号 + 1 */
+	struct can_frame frame;
+};
+
+/* 写者, 只在 can_hal 内部使用 */
+struct can_shm_ring;
+
+struct can_shm_ring *can_shm_ring_new(uint32_t slot_count);
+void can_shm_ring_free(struct can_shm_ring *ring);
+int can_shm_ring_fd(struct can_shm_ring *ring);
+/* 提前分配整个共享内存环的物理页, 只能在开始发布前调用 */
+void can_shm_ring_prefault(struct can_shm_ring *ring);
+void can_shm_ring_publish(struct can_shm_ring *ring, const struct can_frame *frames, int count);
+
+/* 读者, 可以在任意进程里使用 */
+struct can_shm_reader
+{
+	const struct can_shm_header *hdr;
+	const struct can_shm_slot *slots;
+	size_t map_size;
+	uint64_t cursor; /**< 下一个要读的序号 */
+};
+
+// 只读映射 fd, 游标从当前写位置开始, 只读之后发布的帧
+bool can_shm_reader_open(struct can_shm_reader *r, int fd);
+void can_shm_reader_close(struct can_shm_reader *r);
+// 非阻塞地读出最多 max_frames 帧, 被套圈时跳过丢失的帧并把个数累加到 *lost (可为 NULL)
+int can_shm_read(struct can_shm_reader *r, struct can_frame *frames, int max_frames, uint64_t *lost);
+// 没有新帧时阻塞等待, timeout_ms 为 -1 时一直等待. 有新帧返回 1, 超时返回 0
+int can_shm_wait(struct can_shm_reader *r, int timeout_ms);
+
+#endif
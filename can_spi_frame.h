@@ -0,0 +1,316 @@
+#ifndef CAN_SPI_FRAME_H
+#define CAN_SPI_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "can_hal.h"
+#include "utils/checksum.h"
+
+/*
+	主机和 MCU 之间 SPI 上的帧格式, 两个方向相同. 传输以 16 字节为一个槽位, 帧与帧之间翻转片选.
+	经典帧正好占一个槽位. CAN FD 帧在 can_id 的最高位置 SPI_FRAME_ID_FD, dlc 是 FD 的 DLC 编码,
+	payload 超过 8 字节时把多出的部分接在 payload 后面, 帧尾两个字节随之后移,
+	整帧用空闲字节 (0xff) 补齐到槽位的整数倍. 长帧可以跨越两次 SPI 传输.
+	没有数据要发的一方发空闲帧 (head = IDLE_SIGN).
+	初始化时可以和 MCU 协商改用紧凑格式 (见下面的 spi_compact_*)
+*/
+struct spi_can_frame
+{
+	uint8_t head;
+	uint8_t dlc : 4;
+	uint8_t rtr : 1;	  // 1 is remote frame, 0 is data frame
+	uint8_t chan_hi : 1;  // high bit of the channel, was the unused high bit of rtr
+	uint8_t ide : 1;	  // 1 is extended, 0 is standard frame
+	uint8_t spi_addr : 1; // choose spi addr, low bit of the channel
+	uint32_t can_id;
+	uint8_t payload[8];
+	uint8_t tail;
+	uint8_t xor_verify;
+} __attribute__((packed));
+
+#define HEAD_SIGN (0x7e)
+#define TAIL_SIGN (0x7d)
+#define IDLE_SIGN (0xff)
+#define CTRL_SIGN (0x7c) /**< 控制帧的包头, 老固件当作无效数据忽略 */
+#define STATUS_SIGN (0x7b) /**< 状态传输的包头 */
+
+#define CAN_FRAME_LENGTH (sizeof(struct spi_can_frame))
+#define CAN_FRAME_HEAD_LENGTH (1)
+#define CAN_FRAME_CRC_LENGTH (offsetof(struct spi_can_frame, tail)) /**< CRC 模式下 tail 和 xor_verify 两个字节存放大端 CRC */
+#define CAN_FRAME_MAX_LENGTH (CAN_FRAME_LENGTH - 8 + CANHAL_FD_MAX_DLEN) /**< 64 字节 payload 的 FD 帧 */
+#define CAN_FRAME_MAX_SLOTS ((CAN_FRAME_MAX_LENGTH + CAN_FRAME_LENGTH - 1) / CAN_FRAME_LENGTH)
+
+/* can_id 里 29 位 ID 以外的三位用来传 FD 帧的标志 */
+#define SPI_FRAME_ID_MASK (0x1fffffffu)
+#define SPI_FRAME_STD_ID_MASK (0x7ffu) /**< ide 为 0 的标准帧只有低 11 位是 ID */
+#define SPI_FRAME_ID_FD (1u << 31)
+#define SPI_FRAME_ID_BRS (1u << 30)
+#define SPI_FRAME_ID_ESI (1u << 29)
+
+static const uint8_t can_fd_dlc_len[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+static inline uint8_t can_fd_dlc_to_len(uint8_t dlc)
+{
+	return can_fd_dlc_len[dlc & 0x0f];
+}
+
+/* 能放下 len 字节的最小 DLC 编码, 超过 64 按 64 */
+static inline uint8_t can_fd_len_to_dlc(uint32_t len)
+{
+	uint8_t dlc = 0;
+	while (dlc < 15 && can_fd_dlc_len[dlc] < len)
+		dlc++;
+	return dlc;
+}
+
+/* 帧在线上的字节数 (不含补齐), 只看包头之后的 6 个字节 */
+static inline size_t spi_frame_length(const struct spi_can_frame *frame)
+{
+	if (!(frame->can_id & SPI_FRAME_ID_FD) || frame->dlc <= 8)
+		return CAN_FRAME_LENGTH;
+	return CAN_FRAME_LENGTH - 8 + can_fd_dlc_to_len(frame->dlc);
+}
+
+/* 帧携带的数据字节数: 经典帧是 dlc, FD 帧按 DLC 编码换算 */
+static inline uint8_t spi_frame_data_len(const struct spi_can_frame *frame)
+{
+	return (frame->can_id & SPI_FRAME_ID_FD) ? can_fd_dlc_to_len(frame->dlc) : frame->dlc;
+}
+
+/* 补齐到槽位整数倍后的长度 */
+static inline size_t spi_frame_slot_length(size_t len)
+{
+	return (len + CAN_FRAME_LENGTH - 1) / CAN_FRAME_LENGTH * CAN_FRAME_LENGTH;
+}
+
+static inline uint8_t spi_frame_channel(const struct spi_can_frame *frame)
+{
+	return frame->spi_addr | (frame->chan_hi << 1);
+}
+
+static inline void spi_frame_set_channel(struct spi_can_frame *frame, uint8_t channel)
+{
+	frame->spi_addr = channel & 1;
+	frame->chan_hi = (channel >> 1) & 1;
+}
+
+/* 检查 len 字节的帧最后两个字节的校验 */
+static inline bool spi_frame_check_trailer(const uint8_t *p, size_t len, enum canhal_integrity integrity)
+{
+	if (integrity == CANHAL_INTEGRITY_CRC16)
+	{
+		uint16_t crc = checksum_crc16(INIT, p, len - 2);
+		return p[len - 2] == (crc >> 8) && p[len - 1] == (crc & 0xff);
+	}
+	return p[len - 2] == TAIL_SIGN && checksum_xor8(p, len - 1) == p[len - 1];
+}
+
+/*
+	填写帧尾的校验字段, 帧的其他字段必须已经填好.
+	以下两个函数按 spi_frame_length 访问整帧, FD 长帧的调用者要保证后面的字节可访问
+*/
+static inline void spi_frame_seal(struct spi_can_frame *frame, enum canhal_integrity integrity)
+{
+	uint8_t *p = (uint8_t *)frame;
+	size_t len = spi_frame_length(frame);
+
+	if (integrity == CANHAL_INTEGRITY_CRC16)
+	{
+		uint16_t crc = checksum_crc16(INIT, p, len - 2);
+		p[len - 2] = crc >> 8;
+		p[len - 1] = crc & 0xff;
+		return;
+	}
+	p[len - 2] = TAIL_SIGN;
+	p[len - 1] = checksum_xor8(p, len - 1);
+}
+
+static inline bool spi_frame_verify(const struct spi_can_frame *frame, enum canhal_integrity integrity)
+{
+	if (frame->head != HEAD_SIGN)
+		return false;
+	return spi_frame_check_trailer((const uint8_t *)frame, spi_frame_length(frame), integrity);
+}
+
+/*
+	控制帧: 16 字节槽位格式, 包头是 CTRL_SIGN, payload[0] 是命令, payload[1] 是能力位图, 帧尾校验同普通帧.
+	线上格式的协商只在初始化时用单槽位传输进行:
+	主机发 HELLO, MCU 回 ACK 并从 ACK 之后按双方都支持的格式发送,
+	主机收到 ACK 后发 COMMIT, 从 COMMIT 之后按新格式发送. 老固件不应答 HELLO, 双方保持槽位格式.
+	SPI_CAP_PENDING 不改变帧格式, 只允许主机在 COMMIT 之后发起状态传输
+*/
+#define SPI_CTRL_HELLO (0x01)
+#define SPI_CTRL_ACK (0x02)
+#define SPI_CTRL_COMMIT (0x03)
+
+#define SPI_CAP_COMPACT (0x01) /**< 紧凑线上格式 */
+#define SPI_CAP_PENDING (0x02) /**< 状态传输, 见 spi_status_* */
+
+static inline void spi_ctrl_make(struct spi_can_frame *frame, uint8_t cmd, uint8_t caps, enum canhal_integrity integrity)
+{
+	memset(frame, 0, sizeof(*frame));
+	frame->head = CTRL_SIGN;
+	frame->payload[0] = cmd;
+	frame->payload[1] = caps;
+	spi_frame_seal(frame, integrity);
+}
+
+static inline bool spi_ctrl_verify(const struct spi_can_frame *frame, enum canhal_integrity integrity)
+{
+	return frame->head == CTRL_SIGN && spi_frame_check_trailer((const uint8_t *)frame, CAN_FRAME_LENGTH, integrity);
+}
+
+/*
+	状态传输: COMMIT 之后, 主机可以单独发起一次只有 SPI_STATUS_LENGTH 字节的传输,
+	主机发 STATUS_SIGN 和 0, MCU 回 STATUS_SIGN、小端的待发字节数 (超过 0xffff 按 0xffff) 和前三个字节的异或.
+	待发字节数按当前线上格式计算, 包括发了一半的帧剩下的部分, 主机据此决定下一次传输的长度
+*/
+#define SPI_STATUS_LENGTH (4)
+#define SPI_STATUS_PENDING_MAX (0xffff)
+
+static inline void spi_status_make(uint8_t *p, uint32_t pending)
+{
+	if (pending > SPI_STATUS_PENDING_MAX)
+		pending = SPI_STATUS_PENDING_MAX;
+	p[0] = STATUS_SIGN;
+	p[1] = pending & 0xff;
+	p[2] = pending >> 8;
+	p[3] = checksum_xor8(p, 3);
+}
+
+/* 返回状态应答里的待发字节数, 应答无效时返回 -1 */
+static inline int spi_status_parse(const uint8_t *p)
+{
+	if (p[0] != STATUS_SIGN || checksum_xor8(p, 3) != p[3])
+		return -1;
+	return p[1] | (p[2] << 8);
+}
+
+/*
+	紧凑格式: 包头 HEAD_SIGN, 一个和槽位格式第二个字节相同的标志字节 (dlc/rtr/ide/通道),
+	大端的 ID (扩展帧 4 字节、标准帧 2 字节, 最高三位是 FD/BRS/ESI 标志),
+	数据长度个 payload 字节, 最后是校验: 异或模式 1 字节异或, CRC 模式 2 字节大端 CRC.
+	帧与帧之间不补齐, 连续排在 SPI 字节流里, 可以跨越槽位和传输; 空闲时发 IDLE_SIGN 字节
+*/
+#define SPI_COMPACT_HEAD_LENGTH (3) /**< 包头、标志字节和 ID 的第一个字节, 足以算出整帧长度 */
+#define SPI_COMPACT_MAX_LENGTH (2 + 4 + CANHAL_FD_MAX_DLEN + 2)
+#define SPI_COMPACT_ID_FD (0x80) /**< ID 第一个字节里的 FD 标志 */
+
+/* 紧凑帧里 payload 的字节数: FD 帧按 DLC 编码换算, 经典帧最多 8 字节 */
+static inline size_t spi_compact_data_len(uint8_t dlc, bool fd)
+{
+	if (fd)
+		return can_fd_dlc_to_len(dlc);
+	return dlc > 8 ? 8 : dlc;
+}
+
+static inline size_t spi_compact_trailer_length(enum canhal_integrity integrity)
+{
+	return integrity == CANHAL_INTEGRITY_CRC16 ? 2 : 1;
+}
+
+/* 紧凑帧的总长度, p 至少要有 SPI_COMPACT_HEAD_LENGTH 个字节 */
+static inline size_t spi_compact_length(const uint8_t *p, enum canhal_integrity integrity)
+{
+	const struct spi_can_frame *head = (const struct spi_can_frame *)p;
+	size_t id_len = head->ide ? 4 : 2;
+	size_t data_len = spi_compact_data_len(head->dlc, p[2] & SPI_COMPACT_ID_FD);
+	return 2 + id_len + data_len + spi_compact_trailer_length(integrity);
+}
+
+/* 槽位格式的帧转换成紧凑帧以后的长度 */
+static inline size_t spi_compact_encoded_length(const struct spi_can_frame *frame, enum canhal_integrity integrity)
+{
+	size_t data_len = spi_compact_data_len(frame->dlc, frame->can_id & SPI_FRAME_ID_FD);
+	return 2 + (frame->ide ? 4 : 2) + data_len + spi_compact_trailer_length(integrity);
+}
+
+/* 把槽位格式的帧 (可以是 FD 长帧) 转换成紧凑帧写到 out, 返回紧凑帧的长度 */
+static inline size_t spi_compact_encode(uint8_t *out, const struct spi_can_frame *frame, enum canhal_integrity integrity)
+{
+	uint32_t flags = frame->can_id & ~SPI_FRAME_ID_MASK;
+	size_t data_len = spi_compact_data_len(frame->dlc, frame->can_id & SPI_FRAME_ID_FD);
+	size_t len = 0;
+
+	out[len++] = HEAD_SIGN;
+	out[len++] = ((const uint8_t *)frame)[1];
+	if (frame->ide)
+	{
+		uint32_t id = (frame->can_id & SPI_FRAME_ID_MASK) | flags;
+		out[len++] = id >> 24;
+		out[len++] = id >> 16;
+		out[len++] = id >> 8;
+		out[len++] = id;
+	}
+	else
+	{
+		uint16_t id = (frame->can_id & 0x7ff) | (flags >> 16);
+		out[len++] = id >> 8;
+		out[len++] = id;
+	}
+	memcpy(out + len, frame->payload, data_len);
+	len += data_len;
+
+	if (integrity == CANHAL_INTEGRITY_CRC16)
+	{
+		uint16_t crc = checksum_crc16(INIT, out, len);
+		out[len++] = crc >> 8;
+		out[len++] = crc & 0xff;
+	}
+	else
+	{
+		out[len] = checksum_xor8(out, len);
+		len++;
+	}
+	return len;
+}
+
+static inline bool spi_compact_verify(const uint8_t *p, size_t len, enum canhal_integrity integrity)
+{
+	if (p[0] != HEAD_SIGN)
+		return false;
+	if (integrity == CANHAL_INTEGRITY_CRC16)
+	{
+		uint16_t crc = checksum_crc16(INIT, p, len - 2);
+		return p[len - 2] == (crc >> 8) && p[len - 1] == (crc & 0xff);
+	}
+	return checksum_xor8(p, len - 1) == p[len - 1];
+}
+
+/*
+	取出紧凑帧的 can_id (和槽位格式一样带 FD 标志位), 返回 payload 在帧里的偏移.
+	前两个字节和槽位格式相同, ide/rtr/dlc 直接按 struct spi_can_frame 读
+*/
+static inline size_t spi_compact_id(const uint8_t *p, uint32_t *can_id)
+{
+	const struct spi_can_frame *head = (const struct spi_can_frame *)p;
+
+	if (head->ide)
+	{
+		*can_id = ((uint32_t)p[2] << 24) | ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 8) | p[5];
+		return 6;
+	}
+	uint16_t std = ((uint16_t)p[2] << 8) | p[3];
+	*can_id = (std & 0x7ff) | ((uint32_t)(std & 0xe000) << 16);
+	return 4;
+}
+
+/*
+	把紧凑帧展开成槽位格式写到 out, 不填校验字段.
+	out 要能放下对应的 FD 长帧, 即 CAN_FRAME_MAX_LENGTH 字节
+*/
+static inline void spi_compact_decode(struct spi_can_frame *out, const uint8_t *p)
+{
+	uint32_t id;
+	size_t off = spi_compact_id(p, &id);
+
+	memset(out, 0, CAN_FRAME_LENGTH);
+	((uint8_t *)out)[0] = HEAD_SIGN;
+	((uint8_t *)out)[1] = p[1];
+	out->can_id = id;
+	memcpy(out->payload, p + off, spi_compact_data_len(out->dlc, id & SPI_FRAME_ID_FD));
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef CAN_TRANSPORT_H
+#define CAN_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "can_hal.h"
+
+/*
+	主机与 MCU 之间的传输后端.
+	SPI 线程只通过这组操作和 MCU 交换数据, 因此同一套收发代码既能跑在真实的 spidev 上,
+	也能跑在进程内的 MCU 模拟器上 (用于没有板子的构建机做测试和性能对比).
+	除 close 以外的操作都只在 SPI 线程里调用
+*/
+
+#define CAN_TRANSPORT_MAX_FRAMES (256) /**< 单次 transfer 最多的帧数 */
+
+struct can_transport;
+
+struct can_transport_ops
+{
+	/* 全双工交换 frames 个帧, 每帧 frame_len 字节, 帧与帧之间翻转一次片选. 返回交换的字节数, 失败返回 -1 */
+	int (*transfer)(struct can_transport *t, const void *tx, void *rx, size_t frame_len, int frames);
+	/* 阻塞到 MCU 有数据、wake_fd 可读或者超时. wake_fd 可以是 -1. 返回 1 有事件, 0 超时, -1 出错 */
+	int (*wait)(struct can_transport *t, int wake_fd, int timeout_ms);
+	/* 设置链路参数, 成功后 link 里是实际生效的值. 返回 0 成功, -1 失败 */
+	int (*configure)(struct can_transport *t, struct canhal_link *link);
+	/* 单次 transfer 最多能交换的字节数 */
+	size_t (*max_transfer)(struct can_transport *t);
+	void (*close)(struct can_transport *t);
+};
+
+struct can_transport
+{
+	const struct can_transport_ops *ops;
+	bool has_data_irq; /**< wait 能在 MCU 有数据时立即返回, 否则只能靠超时轮询 */
+};
+
+static inline int can_transport_transfer(struct can_transport *t, const void *tx, void *rx, size_t frame_len, int frames)
+{
+	return t->ops->transfer(t, tx, rx, frame_len, frames);
+}
+
+static inline int can_transport_wait(struct can_transport *t, int wake_fd, int timeout_ms)
+{
+	return t->ops->wait(t, wake_fd, timeout_ms);
+}
+
+static inline int can_transport_configure(struct can_transport *t, struct canhal_link *link)
+{
+	return t->ops->configure(t, link);
+}
+
+static inline size_t can_transport_max_transfer(struct can_transport *t)
+{
+	return t->ops->max_transfer(t);
+}
+
+static inline void can_transport_close(struct can_transport *t)
+{
+	if (t != NULL)
+		t->ops->close(t);
+}
+
+/* spidev 后端, "数据就绪" 中断的来源与 canhal_options 里的同名字段相同 */
+struct can_spidev_params
+{
+	const char *device;
+	const char *irq_gpiochip;
+	uint32_t irq_gpio_line;
+	bool irq_rising_edge;
+	int irq_fd; /**< 外部提供的唤醒 fd, 调用者负责关闭, -1 表示不使用 */
+};
+
+struct can_transport *can_transport_spidev_open(const struct can_spidev_params *params);
+
+/*
+	进程内 MCU 模拟器后端. 按 spi_can_frame 协议应答: 有数据时回有效帧, 没有数据时回空闲帧,
+	并且解析主机发来的帧. 经典帧和 FD 长帧都按字节流处理, 长帧可以跨越两次传输. 不需要额外线程, 接收帧按设定速率随时间积累, 在 transfer 里一次性交出
+*/
+struct can_sim_params
+{
+	uint32_t rx_frames_per_sec; /**< MCU 产生接收帧的速率, 0 表示每次传输的每个位置都有帧 */
+	uint32_t rx_backlog_frames; /**< MCU 侧能积压的帧数, 超过的帧丢弃并计入 rx_overruns, 0 表示默认值 */
+	uint8_t channels;			/**< 生成的帧轮流使用的通道数, 0 表示 1 */
+	uint32_t can_id_base;		/**< 生成的帧的 ID 在 [base, base + count) 内轮转 */
+	uint32_t can_id_count;		/**< 0 表示 1 */
+	uint8_t fd_len;				/**< 生成 payload 为这么多字节的 CAN FD 帧, 0 表示生成 8 字节的经典帧 */
+	bool loopback;				/**< 主机发来的有效帧原样回送, 优先于生成的帧 */
+	enum canhal_integrity integrity;
+	uint32_t corrupt_ppm;  /**< 每个回送/生成的帧被翻转一个随机 bit 的概率, 单位百万分之一 */
+	uint32_t slip_ppm;	   /**< 每次传输在开头多插一个垃圾字节, 使后面的字节流错位的概率, 单位百万分之一 */
+	uint32_t seed;		   /**< 错误注入的随机种子 */
+	uint32_t max_transfer; /**< 单次 transfer 最多的字节数, 0 表示默认值 */
+	uint32_t max_clean_hz; /**< 链路时钟高于它时改用 overspeed_corrupt_ppm, 模拟信号完整性变差, 0 表示不模拟 */
+	uint32_t overspeed_corrupt_ppm;
+	bool compact_wire;	 /**< 模拟支持紧凑线上格式的固件 */
+	bool pending_status; /**< 模拟支持状态传输的固件; 和 compact_wire 都为 false 时像老固件一样不应答协商 */
+};
+
+/* 模拟器的计数器, 可以在任意线程读取 */
+struct can_sim_stats
+{
+	uint64_t transfers;
+	uint64_t status_transfers; /**< 状态传输次数, 不计入 transfers */
+	uint64_t rx_generated; /**< 按速率产生的帧数 */
+	uint64_t rx_sent;	   /**< 交给主机的有效帧数 (含回送) */
+	uint64_t rx_overruns;  /**< 积压满而丢掉的帧数 */
+	uint64_t tx_received;  /**< 主机发来的校验正确的帧数 */
+	uint64_t tx_bad;	   /**< 主机发来的既不是空闲帧也没通过校验的帧数 */
+	uint64_t corrupted;	   /**< 注入了 bit 错误的帧数 */
+	uint64_t slipped;	   /**< 注入了字节错位的传输次数 */
+};
+
+void can_sim_params_init(struct can_sim_params *params);
+struct can_transport *can_transport_sim_open(const struct can_sim_params *params);
+// 任意线程调用: 不再产生新的接收帧, 已经开始发送的帧照常发完, 回送不受影响
+void can_transport_sim_stop_rx(struct can_transport *t);
+void can_transport_sim_get_stats(struct can_transport *t, struct can_sim_stats *out);
+
+#endif
@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include "can_transport.h"
+#include "can_spi_frame.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAN_SIM_BACKLOG_DEFAULT (1024)
+#define CAN_SIM_MAX_TRANSFER_DEFAULT (4096)
+
+#define CAN_SIM_SLOTS_MAX (CAN_FRAME_MAX_SLOTS * CAN_FRAME_LENGTH)
+
+/* 回送队列里的一帧, 按最长的 FD 帧分配 */
+struct sim_wire
+{
+	uint8_t bytes[CAN_FRAME_MAX_LENGTH];
+};
+
+struct can_transport_sim
+{
+	struct can_transport base;
+	struct can_sim_params params;
+	uint64_t last_ns;	   /**< 上次按速率积累帧的时间 */
+	uint64_t carry;		   /**< 不足一帧的余量, 单位是 纳秒 * 帧/秒 */
+	uint32_t pending;	   /**< 已经产生、还没交给主机的帧数 */
+	uint64_t seq;		   /**< 生成帧的序号, 写在 payload 里 */
+	uint32_t rng;		   /**< xorshift32 状态 */
+	uint32_t corrupt_ppm;  /**< 当前链路时钟下实际使用的 bit 错误概率 */
+	struct sim_wire *loop; /**< 回送队列 */
+	uint32_t loop_mask;
+	uint32_t loop_head;
+	uint32_t loop_tail;
+	uint8_t out[CAN_SIM_SLOTS_MAX]; /**< 正在发给主机的帧, 槽位格式下补齐到槽位, 可以跨越多次传输 */
+	size_t out_len;
+	size_t out_pos;
+	bool out_idle;	  /**< out 里是空闲帧, 没发完也不算有数据 */
+	uint8_t in[CAN_SIM_SLOTS_MAX]; /**< 正在接收的主机长帧或紧凑帧 */
+	size_t in_len;
+	size_t in_need; /**< 这个长帧还差的字节数 */
+	int ack_caps;	  /**< 收到 HELLO 后要回的 ACK 的能力位图, -1 表示没有 */
+	bool out_compact; /**< ACK 之后按紧凑格式发给主机 */
+	bool in_compact;  /**< COMMIT 之后按紧凑格式解析主机发来的字节 */
+	bool status_ok;	  /**< COMMIT 之后接受状态传输 */
+	bool rx_stopped;  /**< 不再产生新帧, 任意线程置位, SPI 线程 relaxed 读 */
+	struct can_sim_stats stats; /**< 只由 SPI 线程写, 任意线程用 relaxed 读 */
+};
+
+#define SIM_STAT_INC(c, v) __atomic_store_n(&(c), (c) + (v), __ATOMIC_RELAXED)
+
+static uint64_t sim_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t sim_rand(struct can_transport_sim *sim)
+{
+	uint32_t x = sim->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->rng = x;
+	return x;
+}
+
+static bool sim_chance(struct can_transport_sim *sim, uint32_t ppm)
+{
+	return ppm != 0 && sim_rand(sim) % 1000000 < ppm;
+}
+
+/* 按速率把流逝的时间换算成新产生的帧 */
+static void sim_accumulate(struct can_transport_sim *sim)
+{
+	uint32_t rate = sim->params.rx_frames_per_sec;
+	if (rate == 0)
+		return;
+
+	uint64_t now = sim_now_ns();
+	uint64_t acc = (now - sim->last_ns) * rate + sim->carry;
+	uint64_t frames = acc / 1000000000ull;
+	sim->carry = acc % 1000000000ull;
+	sim->last_ns = now;
+
+	SIM_STAT_INC(sim->stats.rx_generated, frames);
+	uint64_t room = sim->params.rx_backlog_frames - sim->pending;
+	if (frames > room)
+	{
+		SIM_STAT_INC(sim->stats.rx_overruns, frames - room);
+		frames = room;
+	}
+	sim->pending += frames;
+}
+
+/* 取下一个要发给主机的帧放进 frame, frame 要能放下最长的 FD 帧. 返回 false 表示没有数据 */
+static bool sim_next_frame(struct can_transport_sim *sim, struct spi_can_frame *frame)
+{
+	if (sim->loop_head != sim->loop_tail)
+	{
+		const struct sim_wire *w = &sim->loop[sim->loop_tail++ & sim->loop_mask];
+		memcpy(frame, w->bytes, spi_frame_length((const struct spi_can_frame *)w->bytes));
+		return true;
+	}
+
+	if (__atomic_load_n(&sim->rx_stopped, __ATOMIC_RELAXED))
+		return false;
+	if (sim->params.rx_frames_per_sec != 0)
+	{
+		if (sim->pending == 0)
+			return false;
+		sim->pending--;
+	}
+	else
+	{
+		SIM_STAT_INC(sim->stats.rx_generated, 1);
+	}
+
+	uint8_t len = sim->params.fd_len;
+	memset(frame, 0, CAN_FRAME_LENGTH - 8 + (len > 8 ? len : 8));
+	frame->head = HEAD_SIGN;
+	frame->ide = 1;
+	frame->dlc = 8;
+	frame->can_id = sim->params.can_id_base + sim->seq % sim->params.can_id_count;
+	if (len != 0)
+	{
+		frame->dlc = can_fd_len_to_dlc(len);
+		frame->can_id |= SPI_FRAME_ID_FD | SPI_FRAME_ID_BRS;
+	}
+	spi_frame_set_channel(frame, sim->seq % sim->params.channels);
+	memcpy(frame->payload, &sim->seq, sizeof(sim->seq));
+	spi_frame_seal(frame, sim->params.integrity);
+	sim->seq++;
+	return true;
+}
+
+/*
+	准备下一段要发给主机的字节: 待回的 ACK, 或者一个帧 (槽位格式补齐到槽位, 紧凑格式不补齐),
+	没有数据时是一个空闲帧, 紧凑格式下是一个槽位的 IDLE_SIGN
+*/
+static void sim_load_out(struct can_transport_sim *sim)
+{
+	struct sim_wire w;
+	struct spi_can_frame *frame = (struct spi_can_frame *)w.bytes;
+
+	sim->out_pos = 0;
+	sim->out_idle = false;
+	if (sim->ack_caps >= 0)
+	{
+		spi_ctrl_make((struct spi_can_frame *)sim->out, SPI_CTRL_ACK, sim->ack_caps, sim->params.integrity);
+		sim->out_len = CAN_FRAME_LENGTH;
+		sim->out_compact = sim->ack_caps & SPI_CAP_COMPACT;
+		sim->ack_caps = -1;
+		return;
+	}
+	if (!sim_next_frame(sim, frame))
+	{
+		memset(sim->out, sim->out_compact ? IDLE_SIGN : 0, CAN_FRAME_LENGTH);
+		sim->out[0] = IDLE_SIGN;
+		sim->out_len = CAN_FRAME_LENGTH;
+		sim->out_idle = true;
+		return;
+	}
+
+	size_t len;
+	if (sim->out_compact)
+	{
+		len = spi_compact_encode(sim->out, frame, sim->params.integrity);
+		sim->out_len = len;
+	}
+	else
+	{
+		len = spi_frame_length(frame);
+		sim->out_len = spi_frame_slot_length(len);
+		memcpy(sim->out, w.bytes, len);
+		memset(sim->out + len, IDLE_SIGN, sim->out_len - len);
+	}
+	SIM_STAT_INC(sim->stats.rx_sent, 1);
+	if (sim_chance(sim, sim->corrupt_ppm))
+	{
+		uint32_t bit = sim_rand(sim) % (len * 8);
+		sim->out[bit / 8] ^= 1u << (bit % 8);
+		SIM_STAT_INC(sim->stats.corrupted, 1);
+	}
+}
+
+/* 主机发来的控制帧. 模拟老固件时不认识控制帧, 当作无效数据 */
+static void sim_receive_ctrl(struct can_transport_sim *sim, const struct spi_can_frame *frame)
+{
+	uint8_t caps = (sim->params.compact_wire ? SPI_CAP_COMPACT : 0) | (sim->params.pending_status ? SPI_CAP_PENDING : 0);
+
+	if (caps == 0 || !spi_ctrl_verify(frame, sim->params.integrity))
+	{
+		SIM_STAT_INC(sim->stats.tx_bad, 1);
+		return;
+	}
+	caps &= frame->payload[1];
+	if (frame->payload[0] == SPI_CTRL_HELLO)
+	{
+		sim->ack_caps = caps;
+	}
+	else if (frame->payload[0] == SPI_CTRL_COMMIT)
+	{
+		sim->in_compact = caps & SPI_CAP_COMPACT;
+		sim->status_ok = caps & SPI_CAP_PENDING;
+	}
+}
+
+/* 主机发来的一个完整帧, 回送模式下把有效帧放进回送队列 */
+static void sim_receive(struct can_transport_sim *sim, const struct spi_can_frame *frame)
+{
+	if (frame->head == CTRL_SIGN)
+	{
+		sim_receive_ctrl(sim, frame);
+		return;
+	}
+	if (!spi_frame_verify(frame, sim->params.integrity))
+	{
+		SIM_STAT_INC(sim->stats.tx_bad, 1);
+		return;
+	}
+	SIM_STAT_INC(sim->stats.tx_received, 1);
+
+	if (sim->params.loopback)
+	{
+		if (sim->loop_head - sim->loop_tail > sim->loop_mask)
+			SIM_STAT_INC(sim->stats.rx_overruns, 1);
+		else
+			memcpy(sim->loop[sim->loop_head++ & sim->loop_mask].bytes, frame, spi_frame_length(frame));
+	}
+}
+
+/* 主机发来的一个槽位. 主机总是按槽位对齐发送, 长帧的后续槽位先攒在 in 里 */
+static void sim_receive_slot(struct can_transport_sim *sim, const uint8_t *slot)
+{
+	const struct spi_can_frame *frame = (const struct spi_can_frame *)slot;
+
+	if (sim->in_need > 0)
+	{
+		memcpy(sim->in + sim->in_len, slot, CAN_FRAME_LENGTH);
+		sim->in_len += CAN_FRAME_LENGTH;
+		sim->in_need -= CAN_FRAME_LENGTH;
+		if (sim->in_need == 0)
+			sim_receive(sim, (const struct spi_can_frame *)sim->in);
+		return;
+	}
+	if (frame->head == IDLE_SIGN)
+		return;
+
+	size_t padded = frame->head == HEAD_SIGN ? spi_frame_slot_length(spi_frame_length(frame)) : CAN_FRAME_LENGTH;
+	if (padded == CAN_FRAME_LENGTH)
+	{
+		sim_receive(sim, frame);
+		return;
+	}
+	memcpy(sim->in, slot, CAN_FRAME_LENGTH);
+	sim->in_len = CAN_FRAME_LENGTH;
+	sim->in_need = padded - CAN_FRAME_LENGTH;
+}
+
+/* COMMIT 之后主机发来的紧凑格式字节流, 没收全的帧攒在 in 里. 有效帧展开成槽位格式后按 sim_receive 处理 */
+static void sim_receive_compact(struct can_transport_sim *sim, const uint8_t *p, size_t len)
+{
+	enum canhal_integrity integrity = sim->params.integrity;
+	size_t off = 0;
+
+	while (off < len)
+	{
+		if (sim->in_len == 0)
+		{
+			const uint8_t *head = memchr(p + off, HEAD_SIGN, len - off);
+			if (head == NULL)
+				return;
+			off = head - p;
+		}
+		sim->in[sim->in_len++] = p[off++];
+		if (sim->in_len < SPI_COMPACT_HEAD_LENGTH || sim->in_len < spi_compact_length(sim->in, integrity))
+			continue;
+
+		if (spi_compact_verify(sim->in, sim->in_len, integrity))
+		{
+			struct sim_wire w;
+			struct spi_can_frame *frame = (struct spi_can_frame *)w.bytes;
+			spi_compact_decode(frame, sim->in);
+			spi_frame_seal(frame, integrity);
+			sim_receive(sim, frame);
+		}
+		else
+		{
+			SIM_STAT_INC(sim->stats.tx_bad, 1);
+		}
+		sim->in_len = 0;
+	}
+}
+
+/* 一帧按当前发给主机的格式占多少字节 */
+static size_t sim_out_length(const struct can_transport_sim *sim, const struct spi_can_frame *frame)
+{
+	if (sim->out_compact)
+		return spi_compact_encoded_length(frame, sim->params.integrity);
+	return spi_frame_slot_length(spi_frame_length(frame));
+}
+
+/* 还要发给主机的字节数: 没发完的一段、待回的 ACK、回送队列和按速率积压的帧, 不限速时报告最大值 */
+static uint32_t sim_pending_bytes(struct can_transport_sim *sim)
+{
+	if (sim->params.rx_frames_per_sec == 0)
+		return SPI_STATUS_PENDING_MAX;
+
+	uint32_t bytes = 0;
+	if (!sim->out_idle && sim->out_pos != sim->out_len)
+	{
+		size_t pos = sim->out_pos;
+		if (!sim->out_compact && pos % CAN_FRAME_LENGTH != 0)
+			pos += CAN_FRAME_LENGTH - pos % CAN_FRAME_LENGTH;
+		bytes += sim->out_len - pos;
+	}
+	if (sim->ack_caps >= 0)
+		bytes += CAN_FRAME_LENGTH;
+	for (uint32_t n = sim->loop_tail; n != sim->loop_head && bytes < SPI_STATUS_PENDING_MAX; n++)
+		bytes += sim_out_length(sim, (const struct spi_can_frame *)sim->loop[n & sim->loop_mask].bytes);
+
+	// 生成的帧长度都一样, 用一个只有帧头的样本算
+	struct spi_can_frame sample;
+	memset(&sample, 0, sizeof(sample));
+	sample.ide = 1;
+	sample.dlc = 8;
+	if (sim->params.fd_len != 0)
+	{
+		sample.dlc = can_fd_len_to_dlc(sim->params.fd_len);
+		sample.can_id = SPI_FRAME_ID_FD;
+	}
+	uint64_t total = bytes + (uint64_t)sim->pending * sim_out_length(sim, &sample);
+	return total > SPI_STATUS_PENDING_MAX ? SPI_STATUS_PENDING_MAX : (uint32_t)total;
+}
+
+/* 状态传输, 不动正在发送的字节流 */
+static int sim_status(struct can_transport_sim *sim, const uint8_t *tx, uint8_t *rx)
+{
+	SIM_STAT_INC(sim->stats.status_transfers, 1);
+	sim_accumulate(sim);
+	if (spi_status_parse(tx) < 0)
+	{
+		SIM_STAT_INC(sim->stats.tx_bad, 1);
+		memset(rx, IDLE_SIGN, SPI_STATUS_LENGTH);
+		return SPI_STATUS_LENGTH;
+	}
+	spi_status_make(rx, sim_pending_bytes(sim));
+	if (sim_chance(sim, sim->corrupt_ppm))
+	{
+		rx[sim_rand(sim) % SPI_STATUS_LENGTH] ^= 1u << (sim_rand(sim) % 8);
+		SIM_STAT_INC(sim->stats.corrupted, 1);
+	}
+	return SPI_STATUS_LENGTH;
+}
+
+static int sim_transfer(struct can_transport *t, const void *tx, void *rx, size_t frame_len, int frames)
+{
+	struct can_transport_sim *sim = (struct can_transport_sim *)t;
+	size_t len = frame_len * frames;
+	uint8_t *out = rx;
+
+	if (sim->status_ok && frame_len == SPI_STATUS_LENGTH && frames == 1)
+		return sim_status(sim, tx, rx);
+	if (frames <= 0 || len > sim->params.max_transfer || frame_len != CAN_FRAME_LENGTH)
+		return -1;
+
+	SIM_STAT_INC(sim->stats.transfers, 1);
+	sim_accumulate(sim);
+
+	// MCU 应答的是发送队列里原有的帧, 本次主机发来的帧要到下一次传输才会回送.
+	// 发给主机的是连续的字节流, 一帧没发完就接着在下一次传输里发
+	// 片选翻转后 MCU 从槽位边界重新开始, 上次错位时没发完的槽位作废
+	// 紧凑格式没有槽位边界, 错位只是多了一个垃圾字节, 没发完的空闲字节也不必发完
+	size_t off = 0;
+	if (!sim->out_compact && sim->out_pos % CAN_FRAME_LENGTH != 0)
+		sim->out_pos += CAN_FRAME_LENGTH - sim->out_pos % CAN_FRAME_LENGTH;
+	if (sim->out_compact && sim->out_idle)
+		sim->out_pos = sim->out_len;
+	if (sim_chance(sim, sim->params.slip_ppm))
+	{
+		out[off++] = (uint8_t)sim_rand(sim);
+		SIM_STAT_INC(sim->stats.slipped, 1);
+	}
+	while (off < len)
+	{
+		if (sim->out_pos == sim->out_len)
+			sim_load_out(sim);
+		size_t copy = sim->out_len - sim->out_pos;
+		if (copy > len - off)
+			copy = len - off;
+		memcpy(out + off, sim->out + sim->out_pos, copy);
+		sim->out_pos += copy;
+		off += copy;
+	}
+
+	if (sim->in_compact)
+	{
+		sim_receive_compact(sim, tx, len);
+		return (int)len;
+	}
+	for (int n = 0; n < frames; n++)
+		sim_receive_slot(sim, (const uint8_t *)tx + n * frame_len);
+	return (int)len;
+}
+
+/* 有数据可读时立即返回, 否则等到按速率产生下一帧的时刻、wake_fd 可读或者超时 */
+static int sim_wait(struct can_transport *t, int wake_fd, int timeout_ms)
+{
+	struct can_transport_sim *sim = (struct can_transport_sim *)t;
+	uint32_t rate = sim->params.rx_frames_per_sec;
+
+	bool stopped = __atomic_load_n(&sim->rx_stopped, __ATOMIC_RELAXED);
+	bool sending = sim->out_pos != sim->out_len && !sim->out_idle;
+	if (sim->loop_head != sim->loop_tail || sending || sim->ack_caps >= 0 || (rate == 0 && !stopped))
+		return 1;
+
+	// 停止产生帧以后不会再有数据自己到来, 只等 wake_fd 或者超时
+	uint64_t due_ns = UINT64_MAX;
+	if (!stopped)
+	{
+		sim_accumulate(sim);
+		if (sim->pending > 0)
+			return 1;
+		due_ns = (1000000000ull - sim->carry + rate - 1) / rate;
+	}
+	bool data_due = !stopped && (timeout_ms < 0 || due_ns <= (uint64_t)timeout_ms * 1000000ull);
+	if (!data_due && timeout_ms >= 0)
+		due_ns = (uint64_t)timeout_ms * 1000000ull;
+
+	struct timespec ts = {
+		.tv_sec = due_ns / 1000000000ull,
+		.tv_nsec = due_ns % 1000000000ull,
+	};
+	if (wake_fd >= 0)
+	{
+		struct pollfd pfd = {.fd = wake_fd, .events = POLLIN};
+		int ret = ppoll(&pfd, 1, &ts, NULL);
+		if (ret < 0)
+			return errno == EINTR ? 0 : -1;
+		if (ret > 0)
+		{
+			uint64_t cnt;
+			if (read(wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+				return -1;
+			return 1;
+		}
+	}
+	else
+	{
+		nanosleep(&ts, NULL);
+	}
+	return data_due ? 1 : 0;
+}
+
+static int sim_configure(struct can_transport *t, struct canhal_link *link)
+{
+	struct can_transport_sim *sim = (struct can_transport_sim *)t;
+	bool overspeed = sim->params.max_clean_hz != 0 && link->speed_hz > sim->params.max_clean_hz;
+	sim->corrupt_ppm = overspeed ? sim->params.overspeed_corrupt_ppm : sim->params.corrupt_ppm;
+	return 0;
+}
+
+static size_t sim_max_transfer(struct can_transport *t)
+{
+	return ((struct can_transport_sim *)t)->params.max_transfer;
+}
+
+static void sim_close(struct can_transport *t)
+{
+	struct can_transport_sim *sim = (struct can_transport_sim *)t;
+	free(sim->loop);
+	free(sim);
+}
+
+static const struct can_transport_ops sim_ops = {
+	.transfer = sim_transfer,
+	.wait = sim_wait,
+	.configure = sim_configure,
+	.max_transfer = sim_max_transfer,
+	.close = sim_close,
+};
+
+void can_sim_params_init(struct can_sim_params *params)
+{
+	memset(params, 0, sizeof(*params));
+	params->rx_backlog_frames = CAN_SIM_BACKLOG_DEFAULT;
+	params->channels = 1;
+	params->can_id_base = 0x100;
+	params->can_id_count = 1;
+	params->seed = 1;
+	params->max_transfer = CAN_SIM_MAX_TRANSFER_DEFAULT;
+}
+
+struct can_transport *can_transport_sim_open(const struct can_sim_params *params)
+{
+	struct can_transport_sim *sim = calloc(1, sizeof(*sim));
+	if (sim == NULL)
+		return NULL;
+
+	sim->base.ops = &sim_ops;
+	sim->base.has_data_irq = true; // wait 自己知道下一帧什么时候到, 相当于有中断
+	sim->params = *params;
+	if (sim->params.rx_backlog_frames == 0)
+		sim->params.rx_backlog_frames = CAN_SIM_BACKLOG_DEFAULT;
+	if (sim->params.channels == 0 || sim->params.channels > CANHAL_MAX_CHANNELS)
+		sim->params.channels = 1;
+	if (sim->params.can_id_count == 0)
+		sim->params.can_id_count = 1;
+	if (sim->params.max_transfer == 0)
+		sim->params.max_transfer = CAN_SIM_MAX_TRANSFER_DEFAULT;
+	if (sim->params.fd_len != 0)
+		sim->params.fd_len = can_fd_dlc_to_len(can_fd_len_to_dlc(sim->params.fd_len));
+	sim->rng = sim->params.seed ? sim->params.seed : 1;
+	sim->corrupt_ppm = sim->params.corrupt_ppm;
+	sim->ack_caps = -1;
+	sim->last_ns = sim_now_ns();
+
+	uint32_t loop = 1;
+	while (loop < sim->params.rx_backlog_frames)
+		loop <<= 1;
+	sim->loop = calloc(loop, sizeof(*sim->loop));
+	if (sim->loop == NULL)
+	{
+		free(sim);
+		return NULL;
+	}
+	sim->loop_mask = loop - 1;
+	return &sim->base;
+}
+
+void can_transport_sim_stop_rx(struct can_transport *t)
+{
+	struct can_transport_sim *sim = (struct can_transport_sim *)t;
+	__atomic_store_n(&sim->rx_stopped, true, __ATOMIC_RELAXED);
+}
+
+void can_transport_sim_get_stats(struct can_transport *t, struct can_sim_stats *out)
+{
+	struct can_transport_sim *sim = (struct can_transport_sim *)t;
+	out->transfers = __atomic_load_n(&sim->stats.transfers, __ATOMIC_RELAXED);
+	out->status_transfers = __atomic_load_n(&sim->stats.status_transfers, __ATOMIC_RELAXED);
+	out->rx_generated = __atomic_load_n(&sim->stats.rx_generated, __ATOMIC_RELAXED);
+	out->rx_sent = __atomic_load_n(&sim->stats.rx_sent, __ATOMIC_RELAXED);
+	out->rx_overruns = __atomic_load_n(&sim->stats.rx_overruns, __ATOMIC_RELAXED);
+	out->tx_received = __atomic_load_n(&sim->stats.tx_received, __ATOMIC_RELAXED);
+	out->tx_bad = __atomic_load_n(&sim->stats.tx_bad, __ATOMIC_RELAXED);
+	out->corrupted = __atomic_load_n(&sim->stats.corrupted, __ATOMIC_RELAXED);
+	out->slipped = __atomic_load_n(&sim->stats.slipped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include "can_transport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "spidev.h"
+
+#define SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_BUFSIZ_DEFAULT (4096)
+
+struct can_transport_spidev
+{
+	struct can_transport base;
+	int fd;			   /**< SPI 设备文件描述符 */
+	int irq_fd;		   /**< MCU "数据就绪" 唤醒 fd, -1 表示没有中断源 */
+	bool irq_fd_owned; /**< irq_fd 是否由本模块打开 (需要负责关闭) */
+	uint16_t delay_us;
+	size_t bufsiz;
+	struct spi_ioc_transfer tr[CAN_TRANSPORT_MAX_FRAMES];
+};
+
+static size_t spidev_get_bufsiz(void)
+{
+	unsigned int bufsiz = SPIDEV_BUFSIZ_DEFAULT;
+	FILE *fp = fopen(SPIDEV_BUFSIZ_PATH, "r");
+	if (fp)
+	{
+		if (fscanf(fp, "%u", &bufsiz) != 1)
+			bufsiz = SPIDEV_BUFSIZ_DEFAULT;
+		fclose(fp);
+	}
+	return bufsiz;
+}
+
+/*
+	打开 gpiochip 上的 "数据就绪" line, 返回 line event fd, 失败返回 -1
+*/
+static int can_irq_gpio_open(const char *chip, uint32_t line, bool rising_edge)
+{
+	int chip_fd = open(chip, O_RDONLY | O_CLOEXEC);
+	if (chip_fd < 0)
+	{
+		perror("can't open gpiochip");
+		return -1;
+	}
+
+	struct gpioevent_request req;
+	memset(&req, 0, sizeof(req));
+	req.lineoffset = line;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	req.eventflags = rising_edge ? GPIOEVENT_REQUEST_RISING_EDGE : GPIOEVENT_REQUEST_FALLING_EDGE;
+	strncpy(req.consumer_label, "can_hal_irq", sizeof(req.consumer_label) - 1);
+
+	int ret = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+	close(chip_fd);
+	if (ret < 0)
+	{
+		perror("can't request gpio line event");
+		return -1;
+	}
+	return req.fd;
+}
+
+static void can_event_drain(int fd)
+{
+	// 足够放下 eventfd 的计数、若干个 gpioevent_data 或者管道里的若干字节
+	uint8_t buf[64];
+	if (read(fd, buf, sizeof(buf)) < 0 && errno != EAGAIN)
+		perror("can't drain wakeup fd");
+}
+
+/*
+	一次 ioctl 完成 frames 个帧的全双工交换, 每帧之间翻转一次片选,
+	与单帧传输时 MCU 看到的时序一致
+*/
+static int spidev_transfer(struct can_transport *t, const void *tx, void *rx, size_t frame_len, int frames)
+{
+	struct can_transport_spidev *sp = (struct can_transport_spidev *)t;
+	struct spi_ioc_transfer *tr = sp->tr;
+
+	if (frames <= 0 || frames > CAN_TRANSPORT_MAX_FRAMES)
+		return -1;
+
+	memset(tr, 0, sizeof(tr[0]) * frames);
+	for (int n = 0; n < frames; n++)
+	{
+		tr[n].tx_buf = (unsigned long)((const uint8_t *)tx + n * frame_len);
+		tr[n].rx_buf = (unsigned long)((uint8_t *)rx + n * frame_len);
+		tr[n].len = frame_len;
+		tr[n].delay_usecs = sp->delay_us;
+		tr[n].cs_change = (n != frames - 1);
+	}
+	return ioctl(sp->fd, SPI_IOC_MESSAGE(frames), tr);
+}
+
+static int spidev_wait(struct can_transport *t, int wake_fd, int timeout_ms)
+{
+	struct can_transport_spidev *sp = (struct can_transport_spidev *)t;
+	struct pollfd pfd[2];
+	int nfds = 0;
+
+	if (wake_fd >= 0)
+	{
+		pfd[nfds].fd = wake_fd;
+		pfd[nfds++].events = POLLIN;
+	}
+	if (sp->irq_fd >= 0)
+	{
+		pfd[nfds].fd = sp->irq_fd;
+		pfd[nfds++].events = POLLIN;
+	}
+
+	int ret = poll(pfd, nfds, timeout_ms);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (int n = 0; ret > 0 && n < nfds; n++)
+	{
+		if (pfd[n].revents & POLLIN)
+			can_event_drain(pfd[n].fd);
+	}
+	return ret > 0;
+}
+
+static int spidev_configure(struct can_transport *t, struct canhal_link *link)
+{
+	struct can_transport_spidev *sp = (struct can_transport_spidev *)t;
+	int fd = sp->fd;
+	int ret = 0;
+
+	if (ioctl(fd, SPI_IOC_WR_MODE, &link->mode) == -1)
+	{
+		printf("can't set spi mode\n");
+		ret = -1;
+	}
+	if (ioctl(fd, SPI_IOC_RD_MODE, &link->mode) == -1)
+		printf("can't get spi mode\n");
+
+	/*
+	 * bits per word
+	 */
+	if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &link->bits) == -1)
+	{
+		printf("can't set bits per word\n");
+		ret = -1;
+	}
+	if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &link->bits) == -1)
+		printf("can't get bits per word\n");
+	/*
+	 * max speed hz
+	 */
+	if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &link->speed_hz) == -1)
+	{
+		printf("can't set max speed hz\n");
+		ret = -1;
+	}
+	if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &link->speed_hz) == -1)
+		printf("can't get max speed hz\n");
+
+	sp->delay_us = link->delay_us;
+	printf("bits per word: %d\n", link->bits);
+	printf("max speed: %d KHz (%d MHz)\n", link->speed_hz / 1000, link->speed_hz / 1000 / 1000);
+	return ret;
+}
+
+static size_t spidev_max_transfer(struct can_transport *t)
+{
+	return ((struct can_transport_spidev *)t)->bufsiz;
+}
+
+static void spidev_close(struct can_transport *t)
+{
+	struct can_transport_spidev *sp = (struct can_transport_spidev *)t;
+	if (sp->irq_fd >= 0 && sp->irq_fd_owned)
+		close(sp->irq_fd);
+	if (sp->fd >= 0)
+		close(sp->fd);
+	free(sp);
+}
+
+static const struct can_transport_ops spidev_ops = {
+	.transfer = spidev_transfer,
+	.wait = spidev_wait,
+	.configure = spidev_configure,
+	.max_transfer = spidev_max_transfer,
+	.close = spidev_close,
+};
+
+struct can_transport *can_transport_spidev_open(const struct can_spidev_params *params)
+{
+	struct can_transport_spidev *sp = calloc(1, sizeof(*sp));
+	if (sp == NULL)
+		return NULL;
+	sp->base.ops = &spidev_ops;
+	sp->irq_fd = -1;
+	sp->bufsiz = spidev_get_bufsiz();
+
+	sp->fd = open(params->device, O_RDWR);
+	if (sp->fd < 0)
+	{
+		printf("can't open device %s\n", params->device);
+		spidev_close(&sp->base);
+		return NULL;
+	}
+	printf("SPI - Open Succeed. Start Init SPI...\n");
+
+	if (params->irq_fd >= 0)
+	{
+		sp->irq_fd = params->irq_fd;
+	}
+	else if (params->irq_gpiochip != NULL)
+	{
+		sp->irq_fd = can_irq_gpio_open(params->irq_gpiochip, params->irq_gpio_line, params->irq_rising_edge);
+		if (sp->irq_fd < 0)
+		{
+			spidev_close(&sp->base);
+			return NULL;
+		}
+		sp->irq_fd_owned = true;
+	}
+	sp->base.has_data_irq = sp->irq_fd >= 0;
+	return &sp->base;
+}
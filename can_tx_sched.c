@@ -0,0 +1,220 @@
+#include "can_tx_sched.h"
+#include <stdlib.h>
+#include <string.h>
+#include "utils/prefault.h"
+
+#define SCHED_NIL (UINT32_MAX)
+
+struct sched_node
+{
+	uint64_t key;
+	uint64_t seq;	   /**< 入队序号, key 相同时保证先进先出 */
+	uint64_t enq_ns;   /**< 入队时间, 用于饥饿判断 */
+	uint32_t heap_pos; /**< 在堆数组里的位置 */
+	uint32_t prev;	   /**< 所在 lane 的入队顺序链表, 空闲时 next 串成空闲链表 */
+	uint32_t next;
+	uint32_t lane;
+};
+
+struct can_tx_sched
+{
+	uint32_t capacity;
+	uint32_t elem_size;
+	uint64_t max_starve_ns;
+	uint64_t next_seq;
+
+	struct sched_node *nodes;
+	char *elems;
+	uint32_t *heap; /**< 存放节点下标的小顶堆 */
+	uint32_t count;
+
+	uint32_t free_head;
+	uint32_t oldest[CAN_TX_SCHED_LANES]; /**< 每个 lane 的入队顺序链表头 (最早入队) */
+	uint32_t newest[CAN_TX_SCHED_LANES];
+};
+
+struct can_tx_sched *can_tx_sched_new(uint32_t capacity, uint32_t elem_size, uint64_t max_starve_ns)
+{
+	struct can_tx_sched *s = calloc(1, sizeof(struct can_tx_sched));
+	if (s == NULL)
+		return NULL;
+	s->capacity = capacity;
+	s->elem_size = elem_size;
+	s->max_starve_ns = max_starve_ns;
+	s->nodes = calloc(capacity, sizeof(struct sched_node));
+	s->elems = calloc(capacity, elem_size);
+	s->heap = calloc(capacity, sizeof(uint32_t));
+	if (capacity == 0 || s->nodes == NULL || s->elems == NULL || s->heap == NULL)
+	{
+		can_tx_sched_free(s);
+		return NULL;
+	}
+
+	for (uint32_t n = 0; n < capacity; n++)
+		s->nodes[n].next = (n + 1 < capacity) ? n + 1 : SCHED_NIL;
+	s->free_head = 0;
+	for (int lane = 0; lane < CAN_TX_SCHED_LANES; lane++)
+	{
+		s->oldest[lane] = SCHED_NIL;
+		s->newest[lane] = SCHED_NIL;
+	}
+	return s;
+}
+
+void can_tx_sched_free(struct can_tx_sched *s)
+{
+	if (s == NULL)
+		return;
+	free(s->nodes);
+	free(s->elems);
+	free(s->heap);
+	free(s);
+}
+
+void can_tx_sched_prefault(struct can_tx_sched *s)
+{
+	prefault_range(s->nodes, (size_t)s->capacity * sizeof(struct sched_node));
+	prefault_range(s->elems, (size_t)s->capacity * s->elem_size);
+	prefault_range(s->heap, (size_t)s->capacity * sizeof(uint32_t));
+}
+
+static inline bool sched_less(struct can_tx_sched *s, uint32_t a, uint32_t b)
+{
+	struct sched_node *na = &s->nodes[a];
+	struct sched_node *nb = &s->nodes[b];
+	if (na->key != nb->key)
+		return na->key < nb->key;
+	return na->seq < nb->seq;
+}
+
+static inline void sched_heap_set(struct can_tx_sched *s, uint32_t pos, uint32_t node)
+{
+	s->heap[pos] = node;
+	s->nodes[node].heap_pos = pos;
+}
+
+static void sched_sift_up(struct can_tx_sched *s, uint32_t pos)
+{
+	uint32_t node = s->heap[pos];
+	while (pos > 0)
+	{
+		uint32_t parent = (pos - 1) / 2;
+		if (!sched_less(s, node, s->heap[parent]))
+			break;
+		sched_heap_set(s, pos, s->heap[parent]);
+		pos = parent;
+	}
+	sched_heap_set(s, pos, node);
+}
+
+static void sched_sift_down(struct can_tx_sched *s, uint32_t pos)
+{
+	uint32_t node = s->heap[pos];
+	while (1)
+	{
+		uint32_t child = pos * 2 + 1;
+		if (child >= s->count)
+			break;
+		if (child + 1 < s->count && sched_less(s, s->heap[child + 1], s->heap[child]))
+			child++;
+		if (!sched_less(s, s->heap[child], node))
+			break;
+		sched_heap_set(s, pos, s->heap[child]);
+		pos = child;
+	}
+	sched_heap_set(s, pos, node);
+}
+
+bool can_tx_sched_push(struct can_tx_sched *s, uint64_t key, uint32_t lane, uint64_t enq_ns, const void *elem)
+{
+	uint32_t idx = s->free_head;
+	if (idx == SCHED_NIL || lane >= CAN_TX_SCHED_LANES)
+		return false;
+
+	struct sched_node *node = &s->nodes[idx];
+	s->free_head = node->next;
+
+	node->key = key;
+	node->seq = s->next_seq++;
+	node->enq_ns = enq_ns;
+	node->lane = lane;
+	memcpy(s->elems + (size_t)idx * s->elem_size, elem, s->elem_size);
+
+	// 挂到所在 lane 的入队顺序链表尾
+	node->prev = s->newest[lane];
+	node->next = SCHED_NIL;
+	if (s->newest[lane] != SCHED_NIL)
+		s->nodes[s->newest[lane]].next = idx;
+	else
+		s->oldest[lane] = idx;
+	s->newest[lane] = idx;
+
+	s->heap[s->count] = idx;
+	sched_sift_up(s, s->count++);
+	return true;
+}
+
+static void sched_remove(struct can_tx_sched *s, uint32_t idx, void *elem)
+{
+	struct sched_node *node = &s->nodes[idx];
+	uint32_t pos = node->heap_pos;
+
+	// 用堆尾元素填补空位, 再根据大小向上或向下调整
+	s->count--;
+	if (pos != s->count)
+	{
+		sched_heap_set(s, pos, s->heap[s->count]);
+		if (pos > 0 && sched_less(s, s->heap[pos], s->heap[(pos - 1) / 2]))
+			sched_sift_up(s, pos);
+		else
+			sched_sift_down(s, pos);
+	}
+
+	if (node->prev != SCHED_NIL)
+		s->nodes[node->prev].next = node->next;
+	else
+		s->oldest[node->lane] = node->next;
+	if (node->next != SCHED_NIL)
+		s->nodes[node->next].prev = node->prev;
+	else
+		s->newest[node->lane] = node->prev;
+
+	memcpy(elem, s->elems + (size_t)idx * s->elem_size, s->elem_size);
+	node->next = s->free_head;
+	s->free_head = idx;
+}
+
+bool can_tx_sched_pop(struct can_tx_sched *s, uint64_t now_ns, void *elem)
+{
+	if (s->count == 0)
+		return false;
+
+	uint32_t idx = s->heap[0];
+	if (s->max_starve_ns != 0)
+	{
+		// 各 lane 链表头里最老的一个就是全体最老的帧
+		uint32_t oldest = SCHED_NIL;
+		for (int lane = 0; lane < CAN_TX_SCHED_LANES; lane++)
+		{
+			uint32_t head = s->oldest[lane];
+			if (head != SCHED_NIL && (oldest == SCHED_NIL || s->nodes[head].enq_ns < s->nodes[oldest].enq_ns))
+				oldest = head;
+		}
+		// enq_ns 可能由别的线程稍晚于 now_ns 取得, 按有符号比较
+		if ((int64_t)(now_ns - s->nodes[oldest].enq_ns) >= (int64_t)s->max_starve_ns)
+			idx = oldest;
+	}
+
+	sched_remove(s, idx, elem);
+	return true;
+}
+
+uint32_t can_tx_sched_count(struct can_tx_sched *s)
+{
+	return s->count;
+}
+
+uint32_t can_tx_sched_space(struct can_tx_sched *s)
+{
+	return s->capacity - s->count;
+}
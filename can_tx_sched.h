@@ -0,0 +1,46 @@
+#ifndef CAN_TX_SCHED_H
+#define CAN_TX_SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+	按 CAN 总线仲裁顺序出队的发送调度器.
+	待发帧放在一个按 (key, 入队序号) 排序的二叉堆里, key 越小越先发, key 相同的帧保持先进先出,
+	所以同一个 CAN ID 的帧不会乱序. 另外同一个 lane 的帧按入队顺序串成一条链表,
+	各 lane 链表头里最老的帧等待超过 max_starve_ns 时直接把它从堆里摘出来发送, 保证低优先级帧不会被无限饿死.
+	enq_ns 由调用者给出, 可以早于放进调度器的时间, 这样之前排队的时间也计入饥饿判断.
+	只检查链表头, 所以饥饿上限是近似的: lane 内 enq_ns 不单调时, 比链表头更老的帧要等链表头发走,
+	最多多等 lane 内时间戳倒挂的幅度 (多个生产者先取时间再入队时, 一般是入队本身的耗时).
+	入队/出队都是 O(log n), 只能在一个线程里使用.
+*/
+struct can_tx_sched;
+
+#define CAN_TX_SCHED_LANES (4) /**< 入队顺序链表的个数 */
+
+struct can_tx_sched *can_tx_sched_new(uint32_t capacity, uint32_t elem_size, uint64_t max_starve_ns);
+void can_tx_sched_free(struct can_tx_sched *s);
+bool can_tx_sched_push(struct can_tx_sched *s, uint64_t key, uint32_t lane, uint64_t enq_ns, const void *elem);
+bool can_tx_sched_pop(struct can_tx_sched *s, uint64_t now_ns, void *elem);
+uint32_t can_tx_sched_count(struct can_tx_sched *s);
+uint32_t can_tx_sched_space(struct can_tx_sched *s);
+/* 提前访问所有节点和帧缓冲区, 只能在开始使用前调用 */
+void can_tx_sched_prefault(struct can_tx_sched *s);
+
+/*
+	把 CAN ID 换算成仲裁值, 数值越小仲裁越优先. 按总线上的位顺序排列:
+	11 位基本 ID, 标准帧的 RTR / 扩展帧的 SRR, IDE, 18 位扩展 ID, 扩展帧的 RTR.
+	基本 ID 相同时标准帧总是赢扩展帧, 数据帧总是赢遥控帧.
+*/
+static inline uint32_t can_arb_key(uint32_t can_id, bool extended, bool rtr)
+{
+	if (extended)
+	{
+		uint32_t base = (can_id >> 18) & 0x7ff;
+		uint32_t ext = can_id & 0x3ffff;
+		return (base << 21) | (1u << 20) | (1u << 19) | (ext << 1) | (rtr ? 1u : 0u);
+	}
+	return ((can_id & 0x7ff) << 21) | ((rtr ? 1u : 0u) << 20);
+}
+
+#endif
@@ -3,30 +3,33 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "can_hal.h"
+#include "utils/blog.h"
 
 
 int main(void)
 {
 	canhal_ctx ctx;
+	blog_start(stderr);
 	if (!canhal_init(&ctx, "/dev/spidev0.0"))
 	{
+		blog_stop();
 		return -1;
 	}
-	int sock = canhal_get_read_fd(ctx);
-	uint8_t buf[256];
+	struct can_frame frames[CANHAL_DGRAM_MAX_FRAMES * 8];
 	while (1)
 	{
-		int n = recv(sock, buf, sizeof(buf), 0);
-		if (n > 0)
+		int n = canhal_read_batch(ctx, frames, sizeof(frames) / sizeof(frames[0]), -1);
+		for (int i = 0; i < n; i++)
 		{
-			printf("Received %d bytes: ", n);
-			for (int i = 0; i < n; i++)
+			printf("Received id=0x%08x dlc=%d: ", frames[i].can_id, frames[i].can_dlc);
+			for (int j = 0; j < frames[i].can_dlc && j < CANHAL_FD_MAX_DLEN; j++)
 			{
-				printf("%02X ", buf[i]);
+				printf("%02X ", frames[i].payload[j]);
 			}
 			printf("\n");
 		}
 	}
 	canhal_close(ctx);
+	blog_stop();
 	return 0;
 }
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include "blog.h"
+#include "ringbuffer.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOG_RING_BYTES (64 * 1024)    /**< 每个线程的环大小, 必须是 2 的幂 */
+#define BLOG_IDLE_SLEEP_US (10 * 1000) /**< 后台线程没有记录时的休眠时间 */
+#define BLOG_LINE_MAX (512)
+
+/* 环里的定长记录 */
+struct blog_record
+{
+    uint64_t ts_ns;
+    const struct blog_site *site;
+    uint32_t suppressed; /**< 这条记录之前被限速丢掉的同一调用点的条数 */
+    uint32_t nargs;
+    uint64_t args[BLOG_MAX_ARGS];
+};
+
+/* 每个写日志的线程一个, 线程退出后由消费者输出完剩余记录再释放 */
+struct blog_ring
+{
+    spsc_ring_buffer_t rb;
+    uint64_t dropped;  /**< 生产者写, 环满丢弃的记录数 */
+    uint64_t reported; /**< 消费者已经报告过的丢弃数 */
+    int closed;        /**< 所属线程已退出 */
+    char name[16];
+    struct blog_ring *next;
+    char buff[BLOG_RING_BYTES];
+};
+
+static int blog_level = BLOG_LEVEL_INFO;
+
+static pthread_mutex_t blog_lock = PTHREAD_MUTEX_INITIALIZER; /**< 保护 blog_rings 链表和输出 */
+static struct blog_ring *blog_rings;
+static pthread_once_t blog_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t blog_key;
+static __thread struct blog_ring *blog_tls_ring;
+
+static pthread_t blog_thread;
+static bool blog_thread_started;
+static volatile int blog_running;
+static FILE *blog_out;
+
+static const char blog_level_char[] = {'D', 'I', 'W', 'E'};
+
+static uint64_t blog_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void blog_set_level(enum blog_level level)
+{
+    __atomic_store_n(&blog_level, (int)level, __ATOMIC_RELAXED);
+}
+
+enum blog_level blog_get_level(void)
+{
+    return (enum blog_level)__atomic_load_n(&blog_level, __ATOMIC_RELAXED);
+}
+
+static void blog_thread_exit(void *arg)
+{
+    struct blog_ring *ring = arg;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void blog_key_init(void)
+{
+    pthread_key_create(&blog_key, blog_thread_exit);
+}
+
+static struct blog_ring *blog_ring_get(void)
+{
+    struct blog_ring *ring = blog_tls_ring;
+    if (ring != NULL)
+        return ring;
+
+    // 每个线程第一次写日志时才创建, 之后不再分配内存
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+    spsc_ring_buffer_init(&ring->rb, ring->buff, sizeof(ring->buff));
+    if (pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name)) != 0)
+        snprintf(ring->name, sizeof(ring->name), "?");
+
+    pthread_once(&blog_key_once, blog_key_init);
+    pthread_setspecific(blog_key, ring);
+
+    pthread_mutex_lock(&blog_lock);
+    ring->next = blog_rings;
+    blog_rings = ring;
+    pthread_mutex_unlock(&blog_lock);
+
+    blog_tls_ring = ring;
+    return ring;
+}
+
+/*
+    按秒为窗口限速. 新窗口的第一条记录带上上个窗口被丢掉的条数.
+    多个线程同时命中同一调用点时计数可能有少量误差, 只影响限速的精度
+*/
+int blog_site_allow(struct blog_site *site, uint32_t *suppressed)
+{
+    *suppressed = 0;
+    if (site->rate == 0)
+        return 1;
+
+    uint64_t now = blog_now_ns();
+    uint64_t start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+    if (now - start >= 1000000000ull)
+    {
+        __atomic_store_n(&site->window_start, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->window_count, 0, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&site->window_count, 1, __ATOMIC_RELAXED) > site->rate)
+    {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+void blog_write(const struct blog_site *site, uint32_t suppressed, int nargs, const uint64_t *args)
+{
+    struct blog_ring *ring = blog_ring_get();
+    if (ring == NULL)
+        return;
+
+    struct blog_record rec;
+    rec.ts_ns = blog_now_ns();
+    rec.site = site;
+    rec.suppressed = suppressed;
+    rec.nargs = nargs;
+    memcpy(rec.args, args, nargs * sizeof(args[0]));
+
+    if (!spsc_ring_buffer_queue_arr(&ring->rb, (const char *)&rec, sizeof(rec)))
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+}
+
+/*
+    按格式串逐个转换说明符格式化, 参数的真实类型由长度修饰符和转换字符决定.
+    不支持 '*' 宽度/精度和 %n
+*/
+static void blog_format(char *line, size_t size, const char *fmt, const uint64_t *args, int nargs)
+{
+    size_t len = 0;
+    int arg = 0;
+
+#define BLOG_APPEND(...)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if (len < size)                                                     \
+        {                                                                   \
+            int n_ = snprintf(line + len, size - len, __VA_ARGS__);         \
+            if (n_ > 0)                                                     \
+                len += n_;                                                  \
+        }                                                                   \
+    } while (0)
+
+    while (*fmt != '\0')
+    {
+        if (*fmt != '%')
+        {
+            const char *end = strchr(fmt, '%');
+            int n = end ? (int)(end - fmt) : (int)strlen(fmt);
+            BLOG_APPEND("%.*s", n, fmt);
+            fmt += n;
+            continue;
+        }
+        if (fmt[1] == '%')
+        {
+            BLOG_APPEND("%%");
+            fmt += 2;
+            continue;
+        }
+
+        // spec = '%' + 标志/宽度/精度, 长度修饰符单独解析
+        char spec[32];
+        size_t sl = 0;
+        spec[sl++] = *fmt++;
+        while (*fmt != '\0' && strchr("-+ #0123456789.", *fmt) && sl < sizeof(spec) - 4)
+            spec[sl++] = *fmt++;
+
+        int hh = 0, h = 0, l = 0;
+        while (*fmt != '\0' && strchr("hlLjzt", *fmt))
+        {
+            if (*fmt == 'h')
+                h ? (hh = 1) : (h = 1);
+            else
+                l = 1;
+            fmt++;
+        }
+
+        char conv = *fmt;
+        if (conv == '\0')
+            break;
+        fmt++;
+
+        if (arg >= nargs)
+        {
+            BLOG_APPEND("<?>");
+            continue;
+        }
+        uint64_t v = args[arg++];
+
+        switch (conv)
+        {
+        case 'd':
+        case 'i':
+        {
+            long long s = l ? (long long)v : hh ? (signed char)v : h ? (short)v : (int)v;
+            spec[sl++] = 'l';
+            spec[sl++] = 'l';
+            spec[sl++] = conv;
+            spec[sl] = '\0';
+            BLOG_APPEND(spec, s);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        {
+            unsigned long long u = l ? v : hh ? (unsigned char)v : h ? (unsigned short)v : (unsigned int)v;
+            spec[sl++] = 'l';
+            spec[sl++] = 'l';
+            spec[sl++] = conv;
+            spec[sl] = '\0';
+            BLOG_APPEND(spec, u);
+            break;
+        }
+        case 'c':
+            spec[sl++] = conv;
+            spec[sl] = '\0';
+            BLOG_APPEND(spec, (int)v);
+            break;
+        case 'p':
+            spec[sl++] = conv;
+            spec[sl] = '\0';
+            BLOG_APPEND(spec, (void *)(uintptr_t)v);
+            break;
+        case 's':
+            spec[sl++] = conv;
+            spec[sl] = '\0';
+            BLOG_APPEND(spec, v ? (const char *)(uintptr_t)v : "(null)");
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        {
+            union { uint64_t u; double d; } f = { .u = v };
+            spec[sl++] = conv;
+            spec[sl] = '\0';
+            BLOG_APPEND(spec, f.d);
+            break;
+        }
+        default:
+            BLOG_APPEND("<?>");
+            break;
+        }
+    }
+#undef BLOG_APPEND
+}
+
+static void blog_emit(FILE *out, const struct blog_ring *ring, const struct blog_record *rec)
+{
+    char line[BLOG_LINE_MAX];
+    const struct blog_site *site = rec->site;
+    const char *file = strrchr(site->file, '/');
+    file = file ? file + 1 : site->file;
+
+    blog_format(line, sizeof(line), site->fmt, rec->args, rec->nargs);
+    size_t len = strlen(line);
+    fprintf(out, "[%llu.%06llu] %c %s %s:%d: %s%s",
+            (unsigned long long)(rec->ts_ns / 1000000000ull),
+            (unsigned long long)(rec->ts_ns % 1000000000ull / 1000),
+            blog_level_char[site->level & 3], ring->name, file, site->line, line,
+            (len > 0 && line[len - 1] == '\n') ? "" : "\n");
+    if (rec->suppressed)
+        fprintf(out, "    (%u similar messages suppressed)\n", rec->suppressed);
+}
+
+int blog_flush(FILE *out)
+{
+    int count = 0;
+    struct blog_record rec;
+
+    pthread_mutex_lock(&blog_lock);
+    struct blog_ring **link = &blog_rings;
+    while (*link != NULL)
+    {
+        struct blog_ring *ring = *link;
+        // 先读 closed 再取记录, 这样看到 closed 以后取空就说明不会再有新记录
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+
+        while (spsc_ring_buffer_dequeue_arr(&ring->rb, (char *)&rec, sizeof(rec)) == sizeof(rec))
+        {
+            if (out != NULL)
+                blog_emit(out, ring, &rec);
+            count++;
+        }
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported)
+        {
+            if (out != NULL)
+                fprintf(out, "blog: %llu records dropped by thread %s\n",
+                        (unsigned long long)(dropped - ring->reported), ring->name);
+            ring->reported = dropped;
+        }
+
+        if (closed)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+    if (count > 0 && out != NULL)
+        fflush(out);
+    pthread_mutex_unlock(&blog_lock);
+    return count;
+}
+
+static void *blog_thread_main(void *arg)
+{
+    pthread_setname_np(pthread_self(), "blog");
+    while (__atomic_load_n(&blog_running, __ATOMIC_RELAXED))
+    {
+        if (blog_flush(__atomic_load_n(&blog_out, __ATOMIC_RELAXED)) == 0)
+            usleep(BLOG_IDLE_SLEEP_US);
+    }
+    return NULL;
+}
+
+int blog_start(FILE *out)
+{
+    __atomic_store_n(&blog_out, out, __ATOMIC_RELAXED);
+    if (blog_thread_started)
+        return 0;
+
+    blog_running = 1;
+    if (pthread_create(&blog_thread, NULL, blog_thread_main, NULL) != 0)
+    {
+        blog_running = 0;
+        return -1;
+    }
+    blog_thread_started = true;
+    return 0;
+}
+
+void blog_stop(void)
+{
+    if (!blog_thread_started)
+        return;
+
+    blog_running = 0;
+    pthread_join(blog_thread, NULL);
+    blog_thread_started = false;
+    blog_flush(blog_out);
+}
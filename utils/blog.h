@@ -0,0 +1,124 @@
+#ifndef BLOG_H
+#define BLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    二进制异步日志.
+    热路径只把 "调用点 + 时间戳 + 原始参数" 作为定长记录写进本线程的 SPSC 环, 不做任何格式化;
+    格式化和输出由 blog_start 启动的后台线程 (或者调用 blog_flush 的线程) 完成.
+    环满时丢弃新记录并计数, 日志永远不会阻塞调用者.
+
+    参数最多 BLOG_MAX_ARGS 个, 只按值保存: 整数, 浮点数和指针可以直接传;
+    %s 只能用于常量字符串这类在格式化之前不会失效的指针. 其他类型的指针请先转成 void *.
+*/
+enum blog_level
+{
+    BLOG_LEVEL_DBG = 0,
+    BLOG_LEVEL_INFO,
+    BLOG_LEVEL_WARN,
+    BLOG_LEVEL_ERR,
+    BLOG_LEVEL_OFF,
+};
+
+#define BLOG_MAX_ARGS (6)
+#define BLOG_RATE_DEFAULT (100) /**< 每个调用点每秒最多记录的条数 */
+
+/* 编译期最低级别, 低于它的调用点会被整段优化掉 */
+#ifndef BLOG_COMPILE_LEVEL
+#define BLOG_COMPILE_LEVEL BLOG_LEVEL_DBG
+#endif
+
+/* 每个调用点一个静态实例, 它的地址就是记录里的 "格式串编号" */
+struct blog_site
+{
+    const char *fmt;
+    const char *file;
+    int line;
+    int level;
+    uint32_t rate;         /**< 每秒最多记录的条数, 0 表示不限 */
+    uint64_t window_start; /**< 以下是限速状态, 多线程之间只做 relaxed 读写, 允许少量误差 */
+    uint32_t window_count;
+    uint32_t suppressed;
+};
+
+void blog_set_level(enum blog_level level);
+enum blog_level blog_get_level(void);
+
+/* 启动后台格式化线程, 输出到 out. 重复调用只会改变输出目标 */
+int blog_start(FILE *out);
+/* 停止后台线程, 并把剩下的记录全部输出 */
+void blog_stop(void);
+/* 在当前线程格式化并输出所有线程里积压的记录, 返回输出的条数 */
+int blog_flush(FILE *out);
+
+/* 以下由宏调用 */
+int blog_site_allow(struct blog_site *site, uint32_t *suppressed);
+void blog_write(const struct blog_site *site, uint32_t suppressed, int nargs, const uint64_t *args);
+
+static inline uint64_t blog_arg_u(uint64_t v) { return v; }
+static inline uint64_t blog_arg_p(const void *p) { return (uint64_t)(uintptr_t)p; }
+static inline uint64_t blog_arg_f(double d)
+{
+    union { double d; uint64_t u; } v = { .d = d };
+    return v.u;
+}
+
+#define BLOG_ARG(x) _Generic((x),   \
+    float: blog_arg_f,              \
+    double: blog_arg_f,             \
+    char *: blog_arg_p,             \
+    const char *: blog_arg_p,       \
+    void *: blog_arg_p,             \
+    const void *: blog_arg_p,       \
+    default: blog_arg_u)(x)
+
+#define BLOG_NARGS(...) BLOG_NARGS_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define BLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, N, ...) N
+
+#define BLOG_MAP_0()
+#define BLOG_MAP_1(a) , BLOG_ARG(a)
+#define BLOG_MAP_2(a, ...) , BLOG_ARG(a) BLOG_MAP_1(__VA_ARGS__)
+#define BLOG_MAP_3(a, ...) , BLOG_ARG(a) BLOG_MAP_2(__VA_ARGS__)
+#define BLOG_MAP_4(a, ...) , BLOG_ARG(a) BLOG_MAP_3(__VA_ARGS__)
+#define BLOG_MAP_5(a, ...) , BLOG_ARG(a) BLOG_MAP_4(__VA_ARGS__)
+#define BLOG_MAP_6(a, ...) , BLOG_ARG(a) BLOG_MAP_5(__VA_ARGS__)
+#define BLOG_MAP_N(n, ...) BLOG_MAP_N_(n, ##__VA_ARGS__)
+#define BLOG_MAP_N_(n, ...) BLOG_MAP_##n(__VA_ARGS__)
+
+#define blog_log_rate(lvl, rate_per_sec, fmt_str, ...)                                           \
+    do                                                                                           \
+    {                                                                                            \
+        if ((lvl) >= BLOG_COMPILE_LEVEL && (int)(lvl) >= (int)blog_get_level())                  \
+        {                                                                                        \
+            static struct blog_site blog_site_ = {                                               \
+                .fmt = fmt_str, .file = __FILE__, .line = __LINE__,                              \
+                .level = (lvl), .rate = (rate_per_sec)};                                         \
+            uint32_t blog_suppressed_;                                                           \
+            if (blog_site_allow(&blog_site_, &blog_suppressed_))                                 \
+            {                                                                                    \
+                const uint64_t blog_args_[BLOG_MAX_ARGS + 1] = {                                 \
+                    0 BLOG_MAP_N(BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)};                       \
+                blog_write(&blog_site_, blog_suppressed_, BLOG_NARGS(__VA_ARGS__), blog_args_ + 1); \
+            }                                                                                    \
+        }                                                                                        \
+    } while (0)
+
+#define blog_log(lvl, fmt_str, ...) blog_log_rate(lvl, BLOG_RATE_DEFAULT, fmt_str, ##__VA_ARGS__)
+
+#define blog_dbg(fmt_str, ...) blog_log(BLOG_LEVEL_DBG, fmt_str, ##__VA_ARGS__)
+#define blog_info(fmt_str, ...) blog_log(BLOG_LEVEL_INFO, fmt_str, ##__VA_ARGS__)
+#define blog_warn(fmt_str, ...) blog_log(BLOG_LEVEL_WARN, fmt_str, ##__VA_ARGS__)
+#define blog_err(fmt_str, ...) blog_log(BLOG_LEVEL_ERR, fmt_str, ##__VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,9 +1,10 @@
 #include <assert.h>
 #include "buffer_helper.h"
+#include "blog.h"
+#include "prefault.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <alloca.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -14,18 +15,25 @@ struct buffer_helper
     uint8_t frame_head_size;
     uint32_t frame_size; // frame_size 是一个 frame 的长度， 必须小于 buff 数组的大小
     uint32_t payload_size;
+    bool payload_known; // payload_cb 已经对当前帧调用过, payload_size 有效
     uint32_t already_read;
+    const uint8_t *frame; // 当前帧的连续视图, 给 payload_cb 读包头用
 
     // 如果 payload_cb 为null，直接调用 cb。如果payload_cb不为空，调用payload_cb。
     buffer_helper_callback cb;
     void *cb_userdata;
 
+    // 计数器只由调用 buffer_helper_loop 的线程写, 其他线程可以随时读
     uint32_t receive_frame_count;
+    uint32_t resync_count;   // 包头不对而重新同步的次数, 一段连续的垃圾数据只算一次
+    uint32_t discard_bytes;  // 重新同步时丢弃的字节数
+    bool in_resync;          // 正在丢弃垃圾数据, 收到下一个完整帧后清除
 
     // 接收到一个完整的 frame 以后，先调用 payload_callback 看是否还有后继的数据需要读。如果没有了，就调用 cb
     buffer_helper_payload_callback payload_cb;
 
     char buff[2048]; // 必须大于 485/can 协议里最大长度的 frame
+    char scratch[2048]; // 帧在环里跨越环尾时, 拼成连续的一帧
     ring_buffer_t ring_buffer;
 };
 
@@ -50,136 +58,195 @@ struct buffer_helper *buffer_helper_new(struct buffer_helper_meta *bhmeta, buffe
     return bh;
 }
 
+void buffer_helper_free(struct buffer_helper *bh)
+{
+    free(bh);
+}
+
+// 提前访问解析器的环形缓冲区和拼帧缓冲区, 只能在开始 loop 之前调用
+void buffer_helper_prefault(struct buffer_helper *bh)
+{
+    prefault_range(bh, sizeof(*bh));
+}
+
 void buffer_helper_reset(struct buffer_helper *bh)
 {
     bh->already_read = 0;
     bh->payload_size = 0;
+    bh->payload_known = false;
+    bh->frame = NULL;
+}
+
+static void buffer_helper_deliver(struct buffer_helper *bh, const uint8_t *frame, uint32_t len)
+{
+    bh->in_resync = false;
+    if (bh->cb != NULL) {
+        (bh->cb)((uint8_t *)frame, len, bh->cb_userdata);
+        __atomic_store_n(&bh->receive_frame_count, bh->receive_frame_count + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void buffer_helper_discard(struct buffer_helper *bh, uint8_t data, uint32_t bytes)
+{
+    __atomic_store_n(&bh->discard_bytes, bh->discard_bytes + bytes, __ATOMIC_RELAXED);
+    if (!bh->in_resync)
+    {
+        bh->in_resync = true;
+        __atomic_store_n(&bh->resync_count, bh->resync_count + 1, __ATOMIC_RELAXED);
+        blog_dbg("head is wrong, c=0x%02x\n", data);
+    }
+}
+
+/* 从 p[1] 开始找下一个可能的包头, 返回要丢弃的字节数; 找不到时丢弃全部 len 个字节 */
+static uint32_t buffer_helper_scan(struct buffer_helper *bh, const uint8_t *p, uint32_t len)
+{
+    if (len <= 1)
+        return len;
+    const uint8_t *next = memchr(p + 1, bh->frame_head[0], len - 1);
+    return next ? (uint32_t)(next - p) : len;
 }
 
 /*
-    返回 true： 表示读完了一个完整的 frame， 大小为  bh->frame_size
-    返回 false： 如果 error ！= 0 ，表示包头错了
+    当前帧的总长度 (frame_size + payload). 调用时 bh->frame 必须指向至少 frame_size 个连续字节.
+    payload_cb 对同一帧只调用一次
 */
-bool buffer_helper_recv(struct buffer_helper *bh, int *error)
+static uint32_t buffer_helper_frame_len(struct buffer_helper *bh)
 {
-    int read_size = 0;
-    assert(bh != NULL);
-
-    if (bh->already_read < (bh->frame_size + bh->payload_size))
+    if (!bh->payload_known)
     {
-        size_t to_read;
+        int continue_to_read;
+        bh->payload_size = 0;
+        if (bh->payload_cb != NULL && (continue_to_read = bh->payload_cb(bh)) > 0)
+            bh->payload_size = continue_to_read;
+        bh->payload_known = true;
+    }
+    return bh->frame_size + bh->payload_size;
+}
+
+/*
+    环里最老的 len 个字节的连续视图: 没有跨越环尾时直接指向环内存, 否则拼到 scratch 里
+*/
+static const uint8_t *buffer_helper_ring_view(struct buffer_helper *bh, uint32_t len)
+{
+    char *view;
+    if (ring_buffer_peek_ptr(&bh->ring_buffer, &view) >= len)
+        return (const uint8_t *)view;
+    ring_buffer_peek_arr(&bh->ring_buffer, bh->scratch, len);
+    return (const uint8_t *)bh->scratch;
+}
+
+/*
+    直接在调用者的连续缓冲区上解析完整的帧, 回调拿到的是指向输入的指针.
+    返回消耗的字节数, 剩下不足一帧的部分由调用者放进环里
+*/
+static int buffer_helper_parse_direct(struct buffer_helper *bh, const uint8_t *buff, int buff_len)
+{
+    int off = 0;
 
-        while ((bh->frame_size + bh->payload_size) > bh->already_read)
+    while (buff_len - off >= (int)bh->frame_size)
+    {
+        const uint8_t *p = buff + off;
+        if (memcmp(p, bh->frame_head, bh->frame_head_size) != 0)
         {
-            int all_size = bh->frame_size + bh->payload_size;
-
-            // 读包头期间，需要一个字节地去读
-            bool read_head = bh->already_read < bh->frame_head_size;
-            if (read_head)
-                to_read = 1;
-            else
-                to_read = all_size - bh->already_read;
-
-            int total_bytes_in_rb = ring_buffer_num_items(&bh->ring_buffer) - bh->already_read;
-            if (total_bytes_in_rb >= to_read)
-            {
-                // do nothing
-                read_size = to_read;
-            }
-            else if (total_bytes_in_rb > 0 && total_bytes_in_rb < to_read)
-            {
-                read_size = total_bytes_in_rb;
-            }
-            else
-            {
-                read_size = 0;
-                return false;
-            }
-
-            bh->already_read += read_size;
-
-            // 需要检查包头是否正确
-            if (read_head)
-            {
-                // head wrong
-                bool flag = false;
-                for (int n = 0; n < bh->already_read; n++)
-                {
-                    char data;
-                    if (!ring_buffer_peek(&bh->ring_buffer, &data, n) || memcmp(&data, bh->frame_head + n, 1) != 0)
-                    {
-                        flag = true;
-                        break;
-                    }
-                }
-                if (flag)
-                {
-                    *error = -1;
-                    return false;
-                }
-            }
-
-            if (bh->already_read == bh->frame_size)
-            {
-                int continue_to_read;
-                if (bh->payload_cb != NULL && (continue_to_read = bh->payload_cb(bh)) > 0)
-                {
-                    bh->payload_size = continue_to_read;
-                }
-            }
+            // 整段跳过到下一个包头首字节, 而不是一次丢一个字节再重新解析
+            uint32_t skip = buffer_helper_scan(bh, p, buff_len - off);
+            buffer_helper_discard(bh, p[0], skip);
+            off += skip;
+            continue;
         }
-    }
 
-    return bh->already_read >= (bh->frame_size + bh->payload_size);
+        bh->frame = p;
+        uint32_t len = buffer_helper_frame_len(bh);
+        if (len > (uint32_t)(buff_len - off))
+            break; // payload 还没收全
+
+        buffer_helper_deliver(bh, p, len);
+        buffer_helper_reset(bh);
+        off += len;
+    }
+    return off;
 }
 
-void buffer_helper_loop(struct buffer_helper *bh, char *buff, int buff_len)
+/* 解析环里积压的数据, 直到剩下的不足一帧 */
+static void buffer_helper_parse_ring(struct buffer_helper *bh)
 {
-    int error = 0;
-    // printf("\nbuff_len = %d\n", buff_len);
-    ring_buffer_queue_arr(&bh->ring_buffer, buff, buff_len);
+    ring_buffer_t *rb = &bh->ring_buffer;
+    char head[STRUCT_MEMBER_SIZE(struct buffer_helper, frame_head)];
+
     while (1)
     {
-        error = 0;
-        if (buffer_helper_recv(bh, &error))
+        uint32_t items = ring_buffer_num_items(rb);
+        uint32_t head_len = items < bh->frame_head_size ? items : bh->frame_head_size;
+        if (head_len == 0)
+            break;
+
+        // 包头不完整时也先比较已经收到的部分, 尽早丢掉错误的字节
+        ring_buffer_peek_arr(rb, head, head_len);
+        if (memcmp(head, bh->frame_head, head_len) != 0)
         {
-            char *data = alloca(bh->frame_size + bh->payload_size);
-            ring_buffer_dequeue_arr(&bh->ring_buffer, data, bh->frame_size + bh->payload_size);
-            // deal package
-            if (bh->cb != NULL) {
-                (bh->cb)((uint8_t *)data, bh->frame_size + bh->payload_size, bh->cb_userdata);
-                bh->receive_frame_count++;
-            }
-                
-            // dump_memory(data, global_bh.frame_size);
+            char *view;
+            uint32_t contiguous = ring_buffer_peek_ptr(rb, &view);
+            uint32_t skip = buffer_helper_scan(bh, (const uint8_t *)view, contiguous);
+            ring_buffer_skip(rb, skip);
+            buffer_helper_discard(bh, (uint8_t)head[0], skip);
             buffer_helper_reset(bh);
+            continue;
         }
-        else
-        {
-            if (error != 0)
-            {
-                char data;
-                // 读包头期间，是1个字节1个字节读的， 所以这里只需要 dequeue 1个字节
-                ring_buffer_dequeue(&bh->ring_buffer, &data);
-                printf("head is wrong, current mod name=%s, c=0x%02x\n", buffer_helper_get_name(bh), (uint8_t)data);
-                buffer_helper_reset(bh); // 设置 alread_read = 0;
-            }
-            else
-            {
-                break;
-            }
-        }
+
+        bh->already_read = items;
+        if (items < bh->frame_size)
+            break;
+
+        bh->frame = buffer_helper_ring_view(bh, bh->frame_size);
+        uint32_t len = buffer_helper_frame_len(bh);
+        if (items < len)
+            break;
+
+        buffer_helper_deliver(bh, buffer_helper_ring_view(bh, len), len);
+        ring_buffer_skip(rb, len);
+        buffer_helper_reset(bh);
     }
 }
 
+void buffer_helper_loop(struct buffer_helper *bh, char *buff, int buff_len)
+{
+    int used = 0;
+
+    // 环里没有上次剩下的半帧时, 直接在输入上解析, 不经过环
+    if (ring_buffer_is_empty(&bh->ring_buffer))
+        used = buffer_helper_parse_direct(bh, (const uint8_t *)buff, buff_len);
+
+    if (used < buff_len)
+    {
+        ring_buffer_queue_arr(&bh->ring_buffer, buff + used, buff_len - used);
+        buffer_helper_reset(bh);
+        buffer_helper_parse_ring(bh);
+    }
+}
+
+const uint8_t *buffer_helper_get_frame(struct buffer_helper *bh)
+{
+    return bh->frame;
+}
+
 void buffer_helper_clear_receive_count(struct buffer_helper *bh)
 {
-    bh->receive_frame_count = 0;
+    __atomic_store_n(&bh->receive_frame_count, 0, __ATOMIC_RELAXED);
 }
 
 uint32_t buffer_helper_get_receive_count(struct buffer_helper *bh)
 {
-    return bh->receive_frame_count;
+    return __atomic_load_n(&bh->receive_frame_count, __ATOMIC_RELAXED);
+}
+
+uint32_t buffer_helper_get_resync_count(struct buffer_helper *bh)
+{
+    return __atomic_load_n(&bh->resync_count, __ATOMIC_RELAXED);
+}
+
+uint32_t buffer_helper_get_discard_bytes(struct buffer_helper *bh)
+{
+    return __atomic_load_n(&bh->discard_bytes, __ATOMIC_RELAXED);
 }
 
 void buffer_helper_set_name(struct buffer_helper *bh, const char *name)
@@ -11,9 +11,7 @@
 #include <stdbool.h>
 #include <assert.h>
 #include "ringbuffer.h"
-
-#define POLY (0x1021)
-#define INIT (0x0000)
+#include "checksum.h"
 
 #define STRUCT_MEMBER_SIZE(name, field) \
   (sizeof(((name *)0)->field))
@@ -34,15 +32,21 @@ typedef void (*buffer_helper_callback)(uint8_t *buff, int len, void *userdata);
 typedef int (*buffer_helper_payload_callback)(struct buffer_helper *this);
 
 struct buffer_helper *buffer_helper_new(struct buffer_helper_meta *bmeta, buffer_helper_callback cb, void *userdata);
+void buffer_helper_free(struct buffer_helper *bh);
 void buffer_helper_set_payload_callback(struct buffer_helper *bh, buffer_helper_payload_callback cb);
 ring_buffer_t *buffer_helper_get_ringbuffer(struct buffer_helper *bh);
 void buffer_helper_reset(struct buffer_helper *bh);
+void buffer_helper_prefault(struct buffer_helper *bh);
 void buffer_helper_loop(struct buffer_helper *bh, char *buff, int buff_len);
 void buffer_helper_set_name(struct buffer_helper *bh, const char *name);
 char *buffer_helper_get_name(struct buffer_helper *bh);
 void buffer_helper_clear_receive_count(struct buffer_helper *bh);
 uint32_t buffer_helper_get_receive_count(struct buffer_helper *bh);
+uint32_t buffer_helper_get_resync_count(struct buffer_helper *bh);
+uint32_t buffer_helper_get_discard_bytes(struct buffer_helper *bh);
 uint32_t buffer_helper_get_already_read_bytes(struct buffer_helper *bh);
+// 当前帧前 frame_size 个字节的连续视图, 只在 payload_callback 里有效
+const uint8_t *buffer_helper_get_frame(struct buffer_helper *bh);
 void *buffer_helper_get_userdata(struct buffer_helper*bh);
 void buffer_helper_update_meta(struct buffer_helper*bh, struct buffer_helper_meta *bhmeta);
 
@@ -0,0 +1,100 @@
+#include "checksum.h"
+#include <pthread.h>
+#include <string.h>
+
+/* crc16_table[k][b]: 字节 b 后面再跟 k 个 0 字节时的 CRC */
+static uint16_t crc16_table[8][256];
+static pthread_once_t crc16_once = PTHREAD_ONCE_INIT;
+
+static void crc16_table_init(void)
+{
+    for (int b = 0; b < 256; b++)
+    {
+        uint16_t crc = (uint16_t)(b << 8);
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ POLY) : (uint16_t)(crc << 1);
+        crc16_table[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint16_t prev = crc16_table[k - 1][b];
+            crc16_table[k][b] = (uint16_t)(prev << 8) ^ crc16_table[0][prev >> 8];
+        }
+    }
+}
+
+static inline uint8_t xor_fold64(uint64_t v)
+{
+    v ^= v >> 32;
+    v ^= v >> 16;
+    v ^= v >> 8;
+    return (uint8_t)v;
+}
+
+uint8_t checksum_xor8(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t acc = 0;
+    uint8_t tail = 0;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        acc ^= w;
+    }
+    while (len--)
+        tail ^= *p++;
+    return xor_fold64(acc) ^ tail;
+}
+
+size_t checksum_xor8_verify_frames(const void *frames, size_t frame_len, size_t count, uint8_t *ok)
+{
+    const uint8_t *p = frames;
+    size_t passed = 0;
+
+    // 16 字节的帧是最常见的情况, 两次 8 字节加载就够了
+    if (frame_len == 16)
+    {
+        for (size_t n = 0; n < count; n++, p += 16)
+        {
+            uint64_t lo, hi;
+            memcpy(&lo, p, 8);
+            memcpy(&hi, p + 8, 8);
+            ok[n] = xor_fold64(lo ^ hi) == 0;
+            passed += ok[n];
+        }
+        return passed;
+    }
+
+    for (size_t n = 0; n < count; n++, p += frame_len)
+    {
+        ok[n] = checksum_xor8(p, frame_len) == 0;
+        passed += ok[n];
+    }
+    return passed;
+}
+
+uint16_t checksum_crc16(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc16_once, crc16_table_init);
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        crc = crc16_table[7][p[0] ^ (crc >> 8)] ^
+              crc16_table[6][p[1] ^ (crc & 0xff)] ^
+              crc16_table[5][p[2]] ^
+              crc16_table[4][p[3]] ^
+              crc16_table[3][p[4]] ^
+              crc16_table[2][p[5]] ^
+              crc16_table[1][p[6]] ^
+              crc16_table[0][p[7]];
+    }
+    while (len--)
+        crc = (uint16_t)(crc << 8) ^ crc16_table[0][(crc >> 8) ^ *p++];
+    return crc;
+}
@@ -0,0 +1,37 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* CRC-16/CCITT (XMODEM): 多项式 0x1021, 初值 0x0000, 不反射, 无最终异或 */
+#define POLY (0x1021)
+#define INIT (0x0000)
+
+/*
+    按 8 字节一次异或, 最后折叠成 1 字节. 结果与逐字节异或相同
+*/
+uint8_t checksum_xor8(const void *data, size_t len);
+
+/*
+    一次校验 count 个连续的、每个长 frame_len 字节的帧: 帧内全部字节 (含最后的校验字节) 异或为 0 即通过.
+    ok[i] 写入第 i 帧是否通过, 返回通过的帧数
+*/
+size_t checksum_xor8_verify_frames(const void *frames, size_t frame_len, size_t count, uint8_t *ok);
+
+/*
+    查表法 (slice-by-8) CRC-16/CCITT, 每次处理 8 个字节. crc 传上一段的结果可以分段计算, 第一段传 INIT
+*/
+uint16_t checksum_crc16(uint16_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+#include "latency_hist.h"
+#include <stdbool.h>
+#include <string.h>
+
+static inline uint32_t latency_hist_index(uint64_t v)
+{
+    if (v < LATENCY_HIST_SUB_COUNT)
+        return (uint32_t)v;
+    uint32_t msb = 63 - __builtin_clzll(v);
+    uint32_t sub = (v >> (msb - LATENCY_HIST_SUB_BITS)) & (LATENCY_HIST_SUB_COUNT - 1);
+    return (msb - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_COUNT + sub;
+}
+
+// 桶里最大的值
+static inline uint64_t latency_hist_upper(uint32_t idx)
+{
+    if (idx < LATENCY_HIST_SUB_COUNT)
+        return idx;
+    uint32_t shift = idx / LATENCY_HIST_SUB_COUNT - 1;
+    uint64_t sub = idx % LATENCY_HIST_SUB_COUNT;
+    return ((LATENCY_HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void latency_hist_reset(struct latency_hist *h)
+{
+    // 只在没有并发记录时调用才严格准确, 并发时最多丢几个样本
+    for (uint32_t n = 0; n < LATENCY_HIST_BUCKETS; n++)
+        __atomic_store_n(&h->buckets[n], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->min, UINT64_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+void latency_hist_record(struct latency_hist *h, uint64_t value_ns)
+{
+    __atomic_fetch_add(&h->buckets[latency_hist_index(value_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value_ns, __ATOMIC_RELAXED);
+
+    uint64_t cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value_ns < cur && !__atomic_compare_exchange_n(&h->min, &cur, value_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value_ns > cur && !__atomic_compare_exchange_n(&h->max, &cur, value_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t latency_hist_percentile(const struct latency_hist *h, double percentile)
+{
+    uint64_t total = 0;
+    for (uint32_t n = 0; n < LATENCY_HIST_BUCKETS; n++)
+        total += __atomic_load_n(&h->buckets[n], __ATOMIC_RELAXED);
+    if (total == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (target == 0)
+        target = 1;
+    uint64_t seen = 0;
+    for (uint32_t n = 0; n < LATENCY_HIST_BUCKETS; n++)
+    {
+        seen += __atomic_load_n(&h->buckets[n], __ATOMIC_RELAXED);
+        if (seen >= target)
+        {
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            uint64_t upper = latency_hist_upper(n);
+            return upper < max ? upper : max;
+        }
+    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+void latency_hist_summary(const struct latency_hist *h, struct latency_summary *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (out->count == 0)
+        return;
+    out->min_ns = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    out->max_ns = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    out->mean_ns = __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / out->count;
+    out->p50_ns = latency_hist_percentile(h, 50.0);
+    out->p90_ns = latency_hist_percentile(h, 90.0);
+    out->p99_ns = latency_hist_percentile(h, 99.0);
+    out->p999_ns = latency_hist_percentile(h, 99.9);
+}
@@ -0,0 +1,51 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    HDR 风格的对数-线性直方图, 用于记录纳秒级延迟.
+    每个 2 的幂区间再线性分成 2^LATENCY_HIST_SUB_BITS 个桶, 相对误差不超过 1/32.
+    记录只做一次 relaxed 原子加, 任意线程可以并发记录和读取, 不需要加锁.
+*/
+#define LATENCY_HIST_SUB_BITS (5)
+#define LATENCY_HIST_SUB_COUNT (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((64 - LATENCY_HIST_SUB_BITS) * LATENCY_HIST_SUB_COUNT + LATENCY_HIST_SUB_COUNT)
+
+struct latency_hist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+struct latency_summary
+{
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+};
+
+void latency_hist_reset(struct latency_hist *h);
+void latency_hist_record(struct latency_hist *h, uint64_t value_ns);
+// percentile 取值 0~100, 返回所在桶的上界
+uint64_t latency_hist_percentile(const struct latency_hist *h, double percentile);
+void latency_hist_summary(const struct latency_hist *h, struct latency_summary *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
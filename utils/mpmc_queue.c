@@ -0,0 +1,138 @@
+#include "mpmc_queue.h"
+#include "ringbuffer.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mpmc_cell
+{
+    size_t sequence;
+    char data[];
+};
+
+struct mpmc_queue
+{
+    size_t enqueue_pos __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+    size_t dequeue_pos __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+
+    char *cells __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+    size_t cell_size;
+    size_t elem_size;
+    size_t mask;
+};
+
+static inline struct mpmc_cell *mpmc_cell_at(struct mpmc_queue *q, size_t pos)
+{
+    return (struct mpmc_cell *)(q->cells + (pos & q->mask) * q->cell_size);
+}
+
+struct mpmc_queue *mpmc_queue_new(size_t capacity, size_t elem_size)
+{
+    if (capacity < 2 || !RING_BUFFER_IS_POWER_OF_TWO(capacity))
+        return NULL;
+
+    struct mpmc_queue *q = aligned_alloc(RING_BUFFER_CACHE_LINE, sizeof(struct mpmc_queue));
+    if (q == NULL)
+        return NULL;
+    memset(q, 0, sizeof(*q));
+
+    // 槽位按 8 字节对齐, 保证 sequence 的原子访问是对齐的
+    q->cell_size = (sizeof(struct mpmc_cell) + elem_size + 7) & ~(size_t)7;
+    q->elem_size = elem_size;
+    q->mask = capacity - 1;
+    q->cells = calloc(capacity, q->cell_size);
+    if (q->cells == NULL)
+    {
+        free(q);
+        return NULL;
+    }
+    for (size_t n = 0; n < capacity; n++)
+        __atomic_store_n(&mpmc_cell_at(q, n)->sequence, n, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->enqueue_pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->dequeue_pos, 0, __ATOMIC_RELEASE);
+    return q;
+}
+
+void mpmc_queue_free(struct mpmc_queue *q)
+{
+    if (q == NULL)
+        return;
+    free(q->cells);
+    free(q);
+}
+
+bool mpmc_queue_push(struct mpmc_queue *q, const void *elem)
+{
+    struct mpmc_cell *cell;
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        cell = mpmc_cell_at(q, pos);
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            // 槽位空闲, 抢占 enqueue_pos; 失败时 pos 被更新为最新值
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // 消费者还没取走上一圈的数据, 队列满
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(cell->data, elem, q->elem_size);
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool mpmc_queue_pop(struct mpmc_queue *q, void *elem)
+{
+    struct mpmc_cell *cell;
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        cell = mpmc_cell_at(q, pos);
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // 生产者还没写完这个槽位, 队列空
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(elem, cell->data, q->elem_size);
+    // 把槽位交还给下一圈的生产者
+    __atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t mpmc_queue_size_approx(struct mpmc_queue *q)
+{
+    size_t head = __atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE);
+    return head > tail ? head - tail : 0;
+}
+
+size_t mpmc_queue_capacity(struct mpmc_queue *q)
+{
+    return q->mask + 1;
+}
@@ -0,0 +1,32 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    有界多生产者/多消费者定长元素队列 (Dmitry Vyukov 的 bounded MPMC 算法).
+    每个槽位带一个序号, 生产者和消费者各自用 CAS 抢占 enqueue_pos / dequeue_pos,
+    抢到以后只操作自己的槽位, 不需要全局锁. 队列满时 push 直接失败.
+*/
+struct mpmc_queue;
+
+// capacity 必须是 2 的幂
+struct mpmc_queue *mpmc_queue_new(size_t capacity, size_t elem_size);
+void mpmc_queue_free(struct mpmc_queue *q);
+bool mpmc_queue_push(struct mpmc_queue *q, const void *elem);
+bool mpmc_queue_pop(struct mpmc_queue *q, void *elem);
+// 并发时只是一个近似值, 仅用于判断空/估计积压
+size_t mpmc_queue_size_approx(struct mpmc_queue *q);
+size_t mpmc_queue_capacity(struct mpmc_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef PREFAULT_H
+#define PREFAULT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define PREFAULT_PAGE_SIZE (4096)
+
+/*
+    对 [data, data + len) 的每一页原样读写一个字节, 让内核提前分配物理页.
+    calloc 出来的大块内存和 mmap 的共享内存在第一次写之前都还没有物理页,
+    实时线程第一次访问时会缺页. 内容不变, 但调用时不能有其他线程在写这块内存
+*/
+static inline void prefault_range(void *data, size_t len)
+{
+    volatile uint8_t *p = (volatile uint8_t *)data;
+    if (p == NULL || len == 0)
+        return;
+    for (size_t off = 0; off < len; off += PREFAULT_PAGE_SIZE)
+        p[off] = p[off];
+    p[len - 1] = p[len - 1];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,5 @@
 #include "ringbuffer.h"
+#include <string.h>
 
 /**
  * @file
@@ -12,6 +13,7 @@ void ring_buffer_init(ring_buffer_t *buffer, char *buf, size_t buf_size)
   buffer->buffer_mask = buf_size - 1;
   buffer->tail_index = 0;
   buffer->head_index = 0;
+  buffer->overwrite_count = 0;
 }
 
 void ring_buffer_queue(ring_buffer_t *buffer, char data)
@@ -22,6 +24,7 @@ void ring_buffer_queue(ring_buffer_t *buffer, char data)
     /* Is going to overwrite the oldest byte */
     /* Increase tail index */
     buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK(buffer));
+    __atomic_store_n(&buffer->overwrite_count, buffer->overwrite_count + 1, __ATOMIC_RELAXED);
   }
 
   /* Place data in buffer */
@@ -31,12 +34,34 @@ void ring_buffer_queue(ring_buffer_t *buffer, char data)
 
 void ring_buffer_queue_arr(ring_buffer_t *buffer, const char *data, ring_buffer_size_t size)
 {
-  /* Add bytes; one by one */
-  ring_buffer_size_t i;
-  for (i = 0; i < size; i++)
+  ring_buffer_size_t usable = RING_BUFFER_MASK(buffer);
+  ring_buffer_size_t lost = 0;
+
+  /* Only the newest bytes fit; the rest would be overwritten anyway */
+  if (size > usable)
+  {
+    lost += size - usable;
+    data += size - usable;
+    size = usable;
+  }
+
+  /* Make room by dropping the oldest bytes, like ring_buffer_queue() does */
+  ring_buffer_size_t room = usable - ring_buffer_num_items(buffer);
+  if (size > room)
   {
-    ring_buffer_queue(buffer, data[i]);
+    lost += size - room;
+    buffer->tail_index = ((buffer->tail_index + (size - room)) & RING_BUFFER_MASK(buffer));
   }
+  if (lost)
+    __atomic_store_n(&buffer->overwrite_count, buffer->overwrite_count + lost, __ATOMIC_RELAXED);
+
+  /* Copy in at most two pieces, split at the end of the buffer */
+  ring_buffer_size_t first = usable + 1 - buffer->head_index;
+  if (first > size)
+    first = size;
+  memcpy(buffer->buffer + buffer->head_index, data, first);
+  memcpy(buffer->buffer, data + first, size - first);
+  buffer->head_index = ((buffer->head_index + size) & RING_BUFFER_MASK(buffer));
 }
 
 uint8_t ring_buffer_dequeue(ring_buffer_t *buffer, char *data)
@@ -54,20 +79,42 @@ uint8_t ring_buffer_dequeue(ring_buffer_t *buffer, char *data)
 
 ring_buffer_size_t ring_buffer_dequeue_arr(ring_buffer_t *buffer, char *data, ring_buffer_size_t len)
 {
-  if (ring_buffer_is_empty(buffer))
-  {
-    /* No items */
-    return 0;
-  }
+  ring_buffer_size_t cnt = ring_buffer_peek_arr(buffer, data, len);
+  return ring_buffer_skip(buffer, cnt);
+}
 
-  char *data_ptr = data;
-  ring_buffer_size_t cnt = 0;
-  while ((cnt < len) && ring_buffer_dequeue(buffer, data_ptr))
-  {
-    cnt++;
-    data_ptr++;
-  }
-  return cnt;
+ring_buffer_size_t ring_buffer_peek_arr(ring_buffer_t *buffer, char *data, ring_buffer_size_t len)
+{
+  char *view;
+  ring_buffer_size_t items = ring_buffer_num_items(buffer);
+  if (len > items)
+    len = items;
+
+  /* Copy out in at most two pieces, split at the end of the buffer */
+  ring_buffer_size_t first = ring_buffer_peek_ptr(buffer, &view);
+  if (first > len)
+    first = len;
+  memcpy(data, view, first);
+  memcpy(data + first, buffer->buffer, len - first);
+  return len;
+}
+
+ring_buffer_size_t ring_buffer_peek_ptr(ring_buffer_t *buffer, char **data)
+{
+  ring_buffer_size_t items = ring_buffer_num_items(buffer);
+  ring_buffer_size_t to_end = RING_BUFFER_MASK(buffer) + 1 - buffer->tail_index;
+
+  *data = buffer->buffer + buffer->tail_index;
+  return items < to_end ? items : to_end;
+}
+
+ring_buffer_size_t ring_buffer_skip(ring_buffer_t *buffer, ring_buffer_size_t len)
+{
+  ring_buffer_size_t items = ring_buffer_num_items(buffer);
+  if (len > items)
+    len = items;
+  buffer->tail_index = ((buffer->tail_index + len) & RING_BUFFER_MASK(buffer));
+  return len;
 }
 
 uint8_t ring_buffer_peek(ring_buffer_t *buffer, char *data, ring_buffer_size_t index)
@@ -84,7 +131,75 @@ uint8_t ring_buffer_peek(ring_buffer_t *buffer, char *data, ring_buffer_size_t i
   return 1;
 }
 
+void spsc_ring_buffer_init(spsc_ring_buffer_t *buffer, char *buf, size_t buf_size)
+{
+  RING_BUFFER_ASSERT(RING_BUFFER_IS_POWER_OF_TWO(buf_size) == 1);
+  buffer->buffer = buf;
+  buffer->buffer_mask = buf_size - 1;
+  buffer->cached_tail_index = 0;
+  buffer->cached_head_index = 0;
+  __atomic_store_n(&buffer->tail_index, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&buffer->head_index, 0, __ATOMIC_RELEASE);
+}
+
+uint8_t spsc_ring_buffer_queue_arr(spsc_ring_buffer_t *buffer, const char *data, ring_buffer_size_t size)
+{
+  ring_buffer_size_t capacity = buffer->buffer_mask + 1;
+  /* Only the producer writes head, so a relaxed load is enough */
+  ring_buffer_size_t head = __atomic_load_n(&buffer->head_index, __ATOMIC_RELAXED);
+
+  if (capacity - (head - buffer->cached_tail_index) < size)
+  {
+    /* Looks full; refresh our view of the consumer */
+    buffer->cached_tail_index = __atomic_load_n(&buffer->tail_index, __ATOMIC_ACQUIRE);
+    if (capacity - (head - buffer->cached_tail_index) < size)
+      return 0;
+  }
+
+  /* Copy in at most two pieces, split at the end of the buffer */
+  ring_buffer_size_t offset = head & RING_BUFFER_MASK(buffer);
+  ring_buffer_size_t first = capacity - offset;
+  if (first > size)
+    first = size;
+  memcpy(buffer->buffer + offset, data, first);
+  memcpy(buffer->buffer, data + first, size - first);
+
+  __atomic_store_n(&buffer->head_index, head + size, __ATOMIC_RELEASE);
+  return 1;
+}
+
+ring_buffer_size_t spsc_ring_buffer_dequeue_arr(spsc_ring_buffer_t *buffer, char *data, ring_buffer_size_t len)
+{
+  ring_buffer_size_t capacity = buffer->buffer_mask + 1;
+  /* Only the consumer writes tail, so a relaxed load is enough */
+  ring_buffer_size_t tail = __atomic_load_n(&buffer->tail_index, __ATOMIC_RELAXED);
+
+  if (buffer->cached_head_index - tail < len)
+  {
+    /* Looks short; refresh our view of the producer */
+    buffer->cached_head_index = __atomic_load_n(&buffer->head_index, __ATOMIC_ACQUIRE);
+  }
+
+  ring_buffer_size_t avail = buffer->cached_head_index - tail;
+  if (len > avail)
+    len = avail;
+  if (len == 0)
+    return 0;
+
+  ring_buffer_size_t offset = tail & RING_BUFFER_MASK(buffer);
+  ring_buffer_size_t first = capacity - offset;
+  if (first > len)
+    first = len;
+  memcpy(data, buffer->buffer + offset, first);
+  memcpy(data + first, buffer->buffer, len - first);
+
+  __atomic_store_n(&buffer->tail_index, tail + len, __ATOMIC_RELEASE);
+  return len;
+}
+
 extern inline uint8_t ring_buffer_is_empty(ring_buffer_t *buffer);
 extern inline uint8_t ring_buffer_is_full(ring_buffer_t *buffer);
 extern inline ring_buffer_size_t ring_buffer_num_items(ring_buffer_t *buffer);
 extern inline void ring_buffer_safe_queue_arr(ring_buffer_t *buffer, const char *data, ring_buffer_size_t size);
+extern inline ring_buffer_size_t ring_buffer_overwrite_count(ring_buffer_t *buffer);
+extern inline ring_buffer_size_t spsc_ring_buffer_num_items(spsc_ring_buffer_t *buffer);
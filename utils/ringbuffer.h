@@ -58,6 +58,8 @@ extern "C"
     ring_buffer_size_t tail_index;
     /** Index of head. */
     ring_buffer_size_t head_index;
+    /** Bytes lost because the buffer was full, see ring_buffer_overwrite_count(). */
+    ring_buffer_size_t overwrite_count;
   };
 
   /**
@@ -101,6 +103,32 @@ extern "C"
    * @return The number of bytes returned.
    */
   ring_buffer_size_t ring_buffer_dequeue_arr(ring_buffer_t *buffer, char *data, ring_buffer_size_t len);
+
+  /**
+   * Copies the <em>len</em> oldest bytes of a ring buffer without removing them.
+   * @param buffer The buffer from which the data should be copied.
+   * @param data A pointer to the array at which the data should be placed.
+   * @param len The maximum number of bytes to copy.
+   * @return The number of bytes copied.
+   */
+  ring_buffer_size_t ring_buffer_peek_arr(ring_buffer_t *buffer, char *data, ring_buffer_size_t len);
+
+  /**
+   * Returns a pointer to the oldest byte, for reading in place.
+   * @param buffer The buffer to look into.
+   * @param data Receives a pointer into the buffer memory.
+   * @return The number of bytes readable at <em>*data</em> before the
+   *         buffer wraps; may be less than ring_buffer_num_items().
+   */
+  ring_buffer_size_t ring_buffer_peek_ptr(ring_buffer_t *buffer, char **data);
+
+  /**
+   * Removes the <em>len</em> oldest bytes without copying them.
+   * @param buffer The buffer from which the data should be removed.
+   * @param len The maximum number of bytes to remove.
+   * @return The number of bytes removed.
+   */
+  ring_buffer_size_t ring_buffer_skip(ring_buffer_t *buffer, ring_buffer_size_t len);
   /**
    * Peeks a ring buffer, i.e. returns an element without removing it.
    * @param buffer The buffer from which the data should be returned.
@@ -146,6 +174,95 @@ extern "C"
       ring_buffer_queue_arr(buffer,data, size);
   }
 
+  /**
+   * Returns the number of old bytes overwritten by ring_buffer_queue() on a full buffer.
+   * The counters are written by the owning thread only and may be read from any thread.
+   * @param buffer The buffer to query.
+   * @return The number of overwritten bytes.
+   */
+  inline ring_buffer_size_t ring_buffer_overwrite_count(ring_buffer_t *buffer)
+  {
+    return __atomic_load_n(&buffer->overwrite_count, __ATOMIC_RELAXED);
+  }
+
+/**
+ * Size of a cache line, used to keep the producer and consumer
+ * fields of a SPSC ring buffer from false sharing.
+ */
+#define RING_BUFFER_CACHE_LINE (64)
+
+  /**
+   * Simplifies the use of <tt>struct spsc_ring_buffer_t</tt>.
+   */
+  typedef struct spsc_ring_buffer_t spsc_ring_buffer_t;
+
+  /**
+   * Lock-free single-producer/single-consumer ring buffer.
+   * Exactly one thread may queue and exactly one (other) thread may dequeue.
+   * Indices run freely and are masked on access, so the whole
+   * <em>buf_size</em> bytes can be used.
+   * The producer publishes <tt>head_index</tt> with release semantics and the
+   * consumer publishes <tt>tail_index</tt> the same way; each side keeps a cached
+   * copy of the opposite index and only reloads it when the cached value says
+   * the ring is full (producer) or empty (consumer).
+   */
+  struct spsc_ring_buffer_t
+  {
+    /** Index of head, written by the producer only. */
+    ring_buffer_size_t head_index __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+    /** Producer's last seen tail index. */
+    ring_buffer_size_t cached_tail_index;
+    /** Index of tail, written by the consumer only. */
+    ring_buffer_size_t tail_index __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+    /** Consumer's last seen head index. */
+    ring_buffer_size_t cached_head_index;
+    /** Buffer memory. */
+    char *buffer __attribute__((aligned(RING_BUFFER_CACHE_LINE)));
+    /** Buffer mask. */
+    ring_buffer_size_t buffer_mask;
+  };
+
+  /**
+   * Initializes the SPSC ring buffer pointed to by <em>buffer</em>.
+   * Must not be called while a producer or consumer is running.
+   * @param buffer The ring buffer to initialize.
+   * @param buf The buffer allocated for the ringbuffer.
+   * @param buf_size The size of the allocated ringbuffer, a power of two.
+   */
+  void spsc_ring_buffer_init(spsc_ring_buffer_t *buffer, char *buf, size_t buf_size);
+
+  /**
+   * Adds an array of bytes to a SPSC ring buffer, producer side.
+   * The array is queued as a whole or not at all, so a consumer never
+   * sees a partially written record.
+   * @param buffer The buffer in which the data should be placed.
+   * @param data A pointer to the array of bytes to place in the queue.
+   * @param size The size of the array.
+   * @return 1 if the data was queued; 0 if there was not enough room.
+   */
+  uint8_t spsc_ring_buffer_queue_arr(spsc_ring_buffer_t *buffer, const char *data, ring_buffer_size_t size);
+
+  /**
+   * Returns the <em>len</em> oldest bytes in a SPSC ring buffer, consumer side.
+   * @param buffer The buffer from which the data should be returned.
+   * @param data A pointer to the array at which the data should be placed.
+   * @param len The maximum number of bytes to return.
+   * @return The number of bytes returned.
+   */
+  ring_buffer_size_t spsc_ring_buffer_dequeue_arr(spsc_ring_buffer_t *buffer, char *data, ring_buffer_size_t len);
+
+  /**
+   * Returns the number of items in a SPSC ring buffer.
+   * Exact when called by the consumer; a lower bound of the
+   * free space when called by the producer.
+   * @param buffer The buffer for which the number of items should be returned.
+   * @return The number of items in the ring buffer.
+   */
+  inline ring_buffer_size_t spsc_ring_buffer_num_items(spsc_ring_buffer_t *buffer)
+  {
+    return __atomic_load_n(&buffer->head_index, __ATOMIC_ACQUIRE) - __atomic_load_n(&buffer->tail_index, __ATOMIC_ACQUIRE);
+  }
+
 #ifdef __cplusplus
 }
 #endif